@@ -443,7 +443,7 @@ RewriteCalls::BindBinary(Context *context,
     Name *valueName = value1->AsName();
     if (!valueName)
         return FAILED;
-    if (formName->value != valueName->value)
+    if (!formName->Is(valueName))
         return FAILED;
 
     return Bind(context, form2, value2, rc);
@@ -23,9 +23,12 @@
 #include "save.h"
 #include "errors.h"
 #include "basics.h"
+#include "remote.h"
+#include "profiler.h"
 
 #include <algorithm>
 #include <sstream>
+#include <pthread.h>
 
 ELIOT_BEGIN
 
@@ -53,7 +56,9 @@ Tree *EvaluateWithBytecode(Context *ctx, Tree *what)
         captured.push_back(what);
         captured.push_back(scope);
         Data data = &captured[size];
-        Op *op = function;
+
+        // The code may have been compiled for the same tree in another scope
+        Op *op = function->Run(data, scope);
         while(op)
             op = op->Run(data);
         result = DataResult(data);
@@ -131,6 +136,37 @@ struct ConstOp : Op
 };
 
 
+struct NameOp : Op
+// ----------------------------------------------------------------------------
+//   Evaluates a name that was not bound at compile time, e.g. a variable
+// ----------------------------------------------------------------------------
+{
+    NameOp(Name *name): name(name) {}
+    Name_p name;
+
+    virtual Op *        Run(Data data)
+    {
+        Context_p context = new Context(DataScope(data));
+        Tree *result = name;
+        if (Tree *bound = context->Bound(name))
+        {
+            result = bound;
+            if (Tree *inside = IsClosure(bound, &context))
+                result = inside;
+            if (!result->IsConstant())
+                result = EvaluateWithBytecode(context, result);
+        }
+        DataResult(data, result);
+        return success;
+    }
+    virtual kstring     OpID()  { return "name"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << name;
+    }
+};
+
+
 struct SelfOp : Op
 // ----------------------------------------------------------------------------
 //   Evaluate self
@@ -184,6 +220,18 @@ struct EvalOp : FailOp
 };
 
 
+static inline bool IsBuiltinName(Context *ctx, Tree *value)
+// ----------------------------------------------------------------------------
+//   Check if a value is a builtin name like 'true', with its own opcode
+// ----------------------------------------------------------------------------
+{
+    if (Name *name = value->AsName())
+        if (Tree *bound = ctx->Bound(name))
+            return bound->GetInfo<Opcode>() != NULL;
+    return false;
+}
+
+
 struct ArgEvalOp : FailOp
 // ----------------------------------------------------------------------------
 //    Evaluate the given tree once and only once
@@ -214,8 +262,11 @@ struct ArgEvalOp : FailOp
             result = EvaluateWithBytecode(ctx, self);
         if (result)
         {
-            result = MakeClosure(ctx, result);
+            // Builtin names such as 'true' do not need a closure
+            if (!IsBuiltinName(ctx, result))
+                result = MakeClosure(ctx, result);
             data[id] = result;
+            DataResult(data, result);
             return success;
         }
 
@@ -279,6 +330,45 @@ struct ClosureOp : Op
 };
 
 
+struct DeferOp : Op
+// ----------------------------------------------------------------------------
+//    Create a closure for a deferred argument in the current scope
+// ----------------------------------------------------------------------------
+//    The parameters it uses are bound in the closure with their values,
+//    so that the callee can evaluate it after this frame is reused.
+{
+    DeferOp(Tree *self, TreeList &names, ParmOrder &ids)
+        : self(self), names(names), ids(ids) {}
+    Tree_p      self;
+    TreeList    names;
+    ParmOrder   ids;
+
+    virtual Op *        Run(Data data)
+    {
+        Context_p context = new Context(DataScope(data));
+        uint count = names.size();
+        if (count)
+        {
+            context->CreateScope(self->Position());
+            for (uint n = 0; n < count; n++)
+                context->Define(names[n], data[ids[n]]);
+        }
+        Tree *closure = new Prefix(context->CurrentScope(), self);
+        closure->SetInfo(new ClosureInfo);
+        DataResult(data, closure);
+        return success;
+    }
+
+    virtual kstring     OpID()  { return "defer"; }
+    virtual void        Dump(std::ostream &out)
+    {
+        out << OpID() << "\t" << self;
+        for (uint n = 0; n < names.size(); n++)
+            out << (n ? "," : " with ") << names[n] << "=" << ids[n];
+    }
+};
+
+
 struct ValueOp : Op
 // ----------------------------------------------------------------------------
 //    Return a tree that we know was already evaluated
@@ -319,16 +409,30 @@ struct StoreOp : Op
 };
 
 
+struct TailCall
+// ----------------------------------------------------------------------------
+//   A call in tail position, made by the enclosing Function::Run
+// ----------------------------------------------------------------------------
+{
+    Function *  target;
+    Data        args;
+};
+static __thread TailCall tail_call = { NULL, NULL };
+
+
 struct CallOp : Op
 // ----------------------------------------------------------------------------
 //    Call a subroutine using the given inputs
 // ----------------------------------------------------------------------------
 {
     CallOp(Code *target, uint outId, ParmOrder &parms)
-        : target(target), outId(outId), parms(parms) {}
+        : target(target), outId(outId), parms(parms), tail(false),
+          decl(NULL) {}
     Code  *     target;
     int         outId;
     ParmOrder   parms;
+    bool        tail;
+    Infix *     decl;           // Declaration called, for statistics
 
     virtual Op *Run(Data data)
     {
@@ -339,12 +443,24 @@ struct CallOp : Op
         DataResult(out, DataResult(data));
         DataScope (out, DataScope (data));
 
-        // Copy all parameters
+        // Copy all parameters, waiting for futures from ask_async
         for (uint p = 0; p < sz; p++)
         {
             int parmId = parms[p];
-            out[~p] = data[parmId];
+            out[~int(p)] = eliot_future(data[parmId]);
+        }
+
+        // In tail position, return to Function::Run to reuse the frame
+        if (tail)
+        {
+            RewriteStats::Enter(decl);
+            tail_call.target = (Function *) target;
+            tail_call.args = out;
+            return NULL;
         }
+
+        RewriteTimer timer;
+        RewriteStats::Enter(decl);
         Op *remaining = target->Run(out);
         ELIOT_ASSERT(!remaining);
         if (remaining)
@@ -354,7 +470,7 @@ struct CallOp : Op
         return success;
     }
 
-    virtual kstring     OpID()  { return "call"; }
+    virtual kstring     OpID()  { return tail ? "tailcall" : "call"; }
     virtual void        Dump(std::ostream &out)
     {
         out << OpID() << "\t" << Code::Ref(target, "\t", "code", "null")
@@ -540,7 +656,7 @@ Code::Code(Context *ctx, Tree *self)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(ctx), self(self), ops(NULL), instrs()
+    : context(ctx), self(self), ops(NULL), instrs(), registers(0)
 {}
 
 
@@ -548,7 +664,7 @@ Code::Code(Context *context, Tree *self, Op *ops)
 // ----------------------------------------------------------------------------
 //    Create a new code from the given ops
 // ----------------------------------------------------------------------------
-    : context(context), self(self), ops(ops), instrs()
+    : context(context), self(self), ops(ops), instrs(), registers(0)
 {
     for (Op *op = ops; op; op = op->success)
         instrs.push_back(op);
@@ -604,6 +720,538 @@ void Code::SetOps(Op **newOps, Ops *instrsToTakeOver, uint outId)
             delete label;
         }
     }
+
+    // Lower the resulting graph for faster dispatch
+    Thread();
+}
+
+
+typedef std::map<Op *, uint> ThreadIndex;
+enum ThreadedTag { BOXED, UNBOXED_INTEGER, UNBOXED_REAL };
+static const uint MAX_REGISTERS = 64;
+static const uint MAX_RETURNS   = 32;
+
+
+static bool ThreadedArithmetic(kstring name,
+                               ThreadedOp::Kind &kind, ThreadedOp::Alu &alu)
+// ----------------------------------------------------------------------------
+//   Identify the arithmetic opcodes that can run on unboxed registers
+// ----------------------------------------------------------------------------
+{
+    static const struct
+    {
+        kstring                 name;
+        ThreadedOp::Kind        kind;
+        ThreadedOp::Alu         alu;
+    } arithmetic[] =
+    {
+        { "Add",        ThreadedOp::IARITH,     ThreadedOp::ADD },
+        { "Sub",        ThreadedOp::IARITH,     ThreadedOp::SUB },
+        { "Mul",        ThreadedOp::IARITH,     ThreadedOp::MUL },
+        { "FAdd",       ThreadedOp::FARITH,     ThreadedOp::ADD },
+        { "FSub",       ThreadedOp::FARITH,     ThreadedOp::SUB },
+        { "FMul",       ThreadedOp::FARITH,     ThreadedOp::MUL },
+        { "FDiv",       ThreadedOp::FARITH,     ThreadedOp::DIV },
+        { "ICmpEQ",     ThreadedOp::ICMP,       ThreadedOp::EQ  },
+        { "ICmpNE",     ThreadedOp::ICMP,       ThreadedOp::NE  },
+        { "ICmpSGT",    ThreadedOp::ICMP,       ThreadedOp::GT  },
+        { "ICmpSGE",    ThreadedOp::ICMP,       ThreadedOp::GE  },
+        { "ICmpSLT",    ThreadedOp::ICMP,       ThreadedOp::LT  },
+        { "ICmpSLE",    ThreadedOp::ICMP,       ThreadedOp::LE  },
+        { "FCmpOEQ",    ThreadedOp::FCMP,       ThreadedOp::EQ  },
+        { "FCmpONE",    ThreadedOp::FCMP,       ThreadedOp::NE  },
+        { "FCmpOGT",    ThreadedOp::FCMP,       ThreadedOp::GT  },
+        { "FCmpOGE",    ThreadedOp::FCMP,       ThreadedOp::GE  },
+        { "FCmpOLT",    ThreadedOp::FCMP,       ThreadedOp::LT  },
+        { "FCmpOLE",    ThreadedOp::FCMP,       ThreadedOp::LE  },
+        { "FCmpUEQ",    ThreadedOp::FCMP,       ThreadedOp::EQ  },
+        { "FCmpUNE",    ThreadedOp::FCMP,       ThreadedOp::NE  },
+        { "FCmpUGT",    ThreadedOp::FCMP,       ThreadedOp::GT  },
+        { "FCmpUGE",    ThreadedOp::FCMP,       ThreadedOp::GE  },
+        { "FCmpULT",    ThreadedOp::FCMP,       ThreadedOp::LT  },
+        { "FCmpULE",    ThreadedOp::FCMP,       ThreadedOp::LE  },
+    };
+    uint max = sizeof(arithmetic) / sizeof(arithmetic[0]);
+    for (uint i = 0; i < max; i++)
+    {
+        if (strcmp(arithmetic[i].name, name) == 0)
+        {
+            kind = arithmetic[i].kind;
+            alu = arithmetic[i].alu;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static uint ThreadTarget(ThreadedCode &threaded, ThreadIndex &index,
+                         Ops &pending, Op *op, uint exit)
+// ----------------------------------------------------------------------------
+//   Return the index of the instruction for 'op', reserving it if needed
+// ----------------------------------------------------------------------------
+{
+    if (!op)
+        return exit;
+    ThreadIndex::iterator found = index.find(op);
+    if (found != index.end())
+        return found->second;
+    uint id = threaded.size();
+    index[op] = id;
+    threaded.push_back(ThreadedOp(ThreadedOp::GENERIC, op));
+    pending.push_back(op);
+    return id;
+}
+
+
+void Code::Thread()
+// ----------------------------------------------------------------------------
+//   Lower the op graph into a contiguous array of threaded instructions
+// ----------------------------------------------------------------------------
+//   Instruction 0 is the exit, reached when an op has no successor.
+//   Instruction 1 returns from the sequence of an 'eval' op, which is
+//   lowered in the same array. Nested sequences are numbered separately
+//   from the top-level ones, since a missing successor means a return.
+//   The entry point, if any, is instruction 2.
+{
+    threaded.clear();
+    registers = 0;
+#ifdef __GNUC__
+    if (!ops || !MAIN->options.threaded_code)
+        return;
+
+    ThreadIndex index[2];
+    Ops pending[2];
+    threaded.push_back(ThreadedOp(ThreadedOp::EXIT));
+    threaded.push_back(ThreadedOp(ThreadedOp::RETURN));
+    ThreadTarget(threaded, index[0], pending[0], ops, 0);
+
+    // Encode each op, keeping a generic call for complex ones
+    int maxSlot = 0;
+    while (!pending[0].empty() || !pending[1].empty())
+    {
+        uint nested = pending[0].empty();
+        Op *op = pending[nested].back();
+        pending[nested].pop_back();
+
+        ThreadedOp code(ThreadedOp::GENERIC, op);
+        if (ConstOp *cst = dynamic_cast<ConstOp *>(op))
+        {
+            code.kind = ThreadedOp::CONST;
+            code.value = cst->value;
+        }
+        else if (dynamic_cast<SelfOp *>(op))
+        {
+            code.kind = ThreadedOp::SELF;
+        }
+        else if (ValueOp *val = dynamic_cast<ValueOp *>(op))
+        {
+            code.kind = ThreadedOp::VALUE;
+            code.a = val->id;
+        }
+        else if (StoreOp *store = dynamic_cast<StoreOp *>(op))
+        {
+            if (store->id >= 0)
+            {
+                code.kind = ThreadedOp::STORE;
+                code.a = store->id;
+            }
+        }
+        else if (ClearOp *clear = dynamic_cast<ClearOp *>(op))
+        {
+            if (clear->lo >= 0)
+            {
+                code.kind = ThreadedOp::CLEAR;
+                code.a = clear->lo;
+                code.b = clear->hi;
+            }
+        }
+        else if (EvalOp *eval = dynamic_cast<EvalOp *>(op))
+        {
+            if (eval->id >= 0)
+            {
+                code.kind = ThreadedOp::EVAL;
+                code.a = eval->id;
+                code.b = ThreadTarget(threaded, index[1], pending[1],
+                                      eval->ops, 1);
+            }
+        }
+        else if (TypeCheckOp *check = dynamic_cast<TypeCheckOp *>(op))
+        {
+            code.kind = ThreadedOp::TYPECHK;
+            code.a = check->value;
+            code.b = check->type;
+        }
+        else if (Opcode *opcode = dynamic_cast<Opcode *>(op))
+        {
+            int left, right;
+            if (opcode->Operands(left, right) &&
+                ThreadedArithmetic(opcode->OpID(), code.kind, code.alu))
+            {
+                code.a = left;
+                code.b = right;
+            }
+        }
+
+        // Record the highest slot that may hold a register
+        if (code.kind != ThreadedOp::GENERIC && code.kind != ThreadedOp::EVAL)
+            maxSlot = std::max(maxSlot, std::max(code.a, code.b));
+        else if (code.kind == ThreadedOp::EVAL)
+            maxSlot = std::max(maxSlot, code.a);
+
+        // Successors in nested sequences return to the 'eval' op
+        code.next = ThreadTarget(threaded, index[nested], pending[nested],
+                                 op->success, nested);
+        code.fail = ThreadTarget(threaded, index[nested], pending[nested],
+                                 op->Fail(), nested);
+        threaded[index[nested][op]] = code;
+    }
+    registers = maxSlot + 1;
+#endif // __GNUC__
+}
+
+
+static void BoxRegisters(Data data, ThreadedReg *regs, byte *tags,
+                         uint count, TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Box all unboxed registers into the corresponding data slots
+// ----------------------------------------------------------------------------
+{
+    for (uint r = 0; r < count; r++)
+    {
+        switch(tags[r])
+        {
+        case UNBOXED_INTEGER:   data[r] = new Integer(regs[r].i, pos); break;
+        case UNBOXED_REAL:      data[r] = new Real(regs[r].r, pos);    break;
+        default:                break;
+        }
+        tags[r] = BOXED;
+    }
+}
+
+
+void Code::RunThreaded(Data data)
+// ----------------------------------------------------------------------------
+//   Run the threaded instructions using computed-goto dispatch
+// ----------------------------------------------------------------------------
+//   Integer and real values computed by arithmetic ops are kept unboxed in
+//   'regs', with 'tags' telling which slots hold an unboxed value.
+//   They are boxed before any op that may see the data slots escapes.
+{
+#ifdef __GNUC__
+    static void *dispatch[] =
+    {
+        &&do_exit, &&do_return, &&do_generic, &&do_const, &&do_self,
+        &&do_value, &&do_store, &&do_clear, &&do_eval, &&do_typechk,
+        &&do_iarith, &&do_farith, &&do_icmp, &&do_fcmp
+    };
+    const ThreadedOp *code = &threaded[0];
+    const ThreadedOp *ip = code + 2;
+
+    // Registers, on the stack unless the code uses many slots
+    ThreadedReg regStack[MAX_REGISTERS];
+    byte tagStack[MAX_REGISTERS];
+    std::vector<ThreadedReg> regHeap;
+    std::vector<byte> tagHeap;
+    ThreadedReg *regs = regStack;
+    byte *tags = tagStack;
+    if (registers > MAX_REGISTERS)
+    {
+        regHeap.resize(registers);
+        tagHeap.resize(registers);
+        regs = &regHeap[0];
+        tags = &tagHeap[0];
+    }
+    memset(tags, BOXED, registers);
+    int dirty = 0;
+
+    // Return stack for nested evaluations
+    uint returns[MAX_RETURNS];
+    uint depth = 0;
+
+#define DISPATCH(target)                                \
+    do                                                  \
+    {                                                   \
+        ip = code + (target);                           \
+        goto *dispatch[ip->kind];                       \
+    } while (0)
+
+#define UNBOXED(id)     ((id) >= 0 && tags[id] != BOXED)
+
+#define TAG(id, tag)                                    \
+    do                                                  \
+    {                                                   \
+        byte newTag = (tag);                            \
+        dirty += newTag != BOXED;                       \
+        dirty -= tags[id] != BOXED;                     \
+        tags[id] = newTag;                              \
+    } while (0)
+
+#define BOX_ALL()                                                       \
+    do                                                                  \
+    {                                                                   \
+        if (dirty)                                                      \
+        {                                                               \
+            BoxRegisters(data, regs, tags, registers, self->Position()); \
+            dirty = 0;                                                  \
+        }                                                               \
+    } while (0)
+
+#define INTEGER_ARG(id, x)                              \
+    if (UNBOXED(id))                                    \
+    {                                                   \
+        if (tags[id] != UNBOXED_INTEGER)                \
+            goto do_generic;                            \
+        x = regs[id].i;                                 \
+    }                                                   \
+    else if (Integer *ival = data[id]->AsInteger())     \
+    {                                                   \
+        x = ival->value;                                \
+    }                                                   \
+    else                                                \
+    {                                                   \
+        goto do_generic;                                \
+    }
+
+#define REAL_ARG(id, x)                                 \
+    if (UNBOXED(id))                                    \
+    {                                                   \
+        if (tags[id] != UNBOXED_REAL)                   \
+            goto do_generic;                            \
+        x = regs[id].r;                                 \
+    }                                                   \
+    else if (Real *rval = data[id]->AsReal())           \
+    {                                                   \
+        x = rval->value;                                \
+    }                                                   \
+    else                                                \
+    {                                                   \
+        goto do_generic;                                \
+    }
+
+#define COMPARE(alu, l, r)                              \
+    switch(alu)                                         \
+    {                                                   \
+    case ThreadedOp::EQ:        cmp = l == r; break;    \
+    case ThreadedOp::NE:        cmp = l != r; break;    \
+    case ThreadedOp::GT:        cmp = l >  r; break;    \
+    case ThreadedOp::GE:        cmp = l >= r; break;    \
+    case ThreadedOp::LT:        cmp = l <  r; break;    \
+    case ThreadedOp::LE:        cmp = l <= r; break;    \
+    default:                    goto do_generic;        \
+    }
+
+    goto *dispatch[ip->kind];
+
+do_exit:
+    BOX_ALL();
+    return;
+
+do_return:
+    {
+        // End of a nested evaluation, same as the end of EvalOp::Run
+        const ThreadedOp *caller = code + returns[--depth];
+        int id = caller->a;
+        if (tags[0] != BOXED)
+        {
+            regs[id] = regs[0];
+            TAG(id, tags[0]);
+            DISPATCH(caller->next);
+        }
+        Tree *result = DataResult(data);
+        if (!result)
+            DISPATCH(caller->fail);
+        data[id] = result;
+        TAG(id, BOXED);
+        DISPATCH(caller->next);
+    }
+
+do_generic:
+    {
+        BOX_ALL();
+        Op *op = ip->op;
+        Op *next = op->Run(data);
+        if (next == op->success)
+            DISPATCH(ip->next);
+        if (next == op->Fail())
+            DISPATCH(ip->fail);
+
+        // Unexpected continuation, finish the sequence in the op graph
+        while (next)
+            next = next->Run(data);
+        DISPATCH(depth ? 1 : 0);
+    }
+
+do_const:
+    DataResult(data, ip->value);
+    TAG(0, BOXED);
+    DISPATCH(ip->next);
+
+do_self:
+    DISPATCH(ip->next);
+
+do_value:
+    if (UNBOXED(ip->a))
+    {
+        regs[0] = regs[ip->a];
+        TAG(0, tags[ip->a]);
+        DISPATCH(ip->next);
+    }
+    DataResult(data, data[ip->a]);
+    TAG(0, BOXED);
+    DISPATCH(ip->next);
+
+do_store:
+    if (tags[0] != BOXED)
+    {
+        regs[ip->a] = regs[0];
+        TAG(ip->a, tags[0]);
+        DISPATCH(ip->next);
+    }
+    data[ip->a] = DataResult(data);
+    TAG(ip->a, BOXED);
+    DISPATCH(ip->next);
+
+do_clear:
+    for (int v = ip->a; v <= ip->b; v++)
+    {
+        data[v] = NULL;
+        TAG(v, BOXED);
+    }
+    DISPATCH(ip->next);
+
+do_eval:
+    {
+        // Same as EvalOp::Run, evaluate only once
+        if (tags[ip->a] != BOXED)
+        {
+            regs[0] = regs[ip->a];
+            TAG(0, tags[ip->a]);
+            DISPATCH(ip->next);
+        }
+        Tree *result = data[ip->a];
+        if (result)
+        {
+            DataResult(data, result);
+            TAG(0, BOXED);
+            DISPATCH(ip->next);
+        }
+        if (depth < MAX_RETURNS)
+        {
+            returns[depth++] = ip - code;
+            DISPATCH(ip->b);
+        }
+
+        // Too deeply nested, evaluate in the op graph
+        BOX_ALL();
+        Op *op = ((EvalOp *) ip->op)->ops;
+        while (op)
+            op = op->Run(data);
+
+        result = DataResult(data);
+        if (!result)
+            DISPATCH(ip->fail);
+        data[ip->a] = result;
+        DISPATCH(ip->next);
+    }
+
+do_typechk:
+    if (UNBOXED(ip->a) && !UNBOXED(ip->b))
+    {
+        // Checking an unboxed value against 'integer' or 'real'
+        Tree *type = data[ip->b];
+        byte tag = tags[ip->a];
+        if (type == integer_type && tag == UNBOXED_INTEGER)
+        {
+            regs[0] = regs[ip->a];
+            TAG(0, UNBOXED_INTEGER);
+            DISPATCH(ip->next);
+        }
+        if (type == real_type)
+        {
+            if (tag == UNBOXED_INTEGER)
+                regs[0].r = regs[ip->a].i;
+            else
+                regs[0] = regs[ip->a];
+            TAG(0, UNBOXED_REAL);
+            DISPATCH(ip->next);
+        }
+    }
+    goto do_generic;
+
+do_iarith:
+    {
+        longlong left, right;
+        INTEGER_ARG(ip->a, left);
+        INTEGER_ARG(ip->b, right);
+        switch(ip->alu)
+        {
+        case ThreadedOp::ADD:   regs[0].i = left + right; break;
+        case ThreadedOp::SUB:   regs[0].i = left - right; break;
+        case ThreadedOp::MUL:   regs[0].i = left * right; break;
+        default:                goto do_generic;
+        }
+        TAG(0, UNBOXED_INTEGER);
+        DISPATCH(ip->next);
+    }
+
+do_farith:
+    {
+        double left, right;
+        REAL_ARG(ip->a, left);
+        REAL_ARG(ip->b, right);
+        switch(ip->alu)
+        {
+        case ThreadedOp::ADD:   regs[0].r = left + right; break;
+        case ThreadedOp::SUB:   regs[0].r = left - right; break;
+        case ThreadedOp::MUL:   regs[0].r = left * right; break;
+        case ThreadedOp::DIV:
+            if (right == 0)
+                goto do_generic; // Let the opcode report the error
+            regs[0].r = left / right;
+            break;
+        default:                goto do_generic;
+        }
+        TAG(0, UNBOXED_REAL);
+        DISPATCH(ip->next);
+    }
+
+do_icmp:
+    {
+        longlong left, right;
+        bool cmp;
+        INTEGER_ARG(ip->a, left);
+        INTEGER_ARG(ip->b, right);
+        COMPARE(ip->alu, left, right);
+        DataResult(data, cmp ? eliot_true : eliot_false);
+        TAG(0, BOXED);
+        DISPATCH(ip->next);
+    }
+
+do_fcmp:
+    {
+        double left, right;
+        bool cmp;
+        REAL_ARG(ip->a, left);
+        REAL_ARG(ip->b, right);
+        COMPARE(ip->alu, left, right);
+        DataResult(data, cmp ? eliot_true : eliot_false);
+        TAG(0, BOXED);
+        DISPATCH(ip->next);
+    }
+
+#undef COMPARE
+#undef REAL_ARG
+#undef INTEGER_ARG
+#undef BOX_ALL
+#undef TAG
+#undef UNBOXED
+#undef DISPATCH
+#else // !__GNUC__
+    Op *op = ops;
+    while (op)
+        op = op->Run(data);
+#endif // __GNUC__
 }
 
 
@@ -618,15 +1266,30 @@ Op *Code::Run(Data data)
     data[1] = scope;
 
     // Run all instructions we have in that code
-    Op *op = ops;
-    while (op)
-        op = op->Run(data);
+    RunOps(data);
 
     // We were successful
     return success;
 }
 
 
+void Code::RunOps(Data data)
+// ----------------------------------------------------------------------------
+//   Run the instructions, using the threaded encoding if we have one
+// ----------------------------------------------------------------------------
+{
+    if (!threaded.empty())
+    {
+        RunThreaded(data);
+        return;
+    }
+
+    Op *op = ops;
+    while (op)
+        op = op->Run(data);
+}
+
+
 void Code::Dump(std::ostream &out)
 // ----------------------------------------------------------------------------
 //   Dump all the instructions
@@ -693,6 +1356,128 @@ text Code::Ref(Op *op, text sep, text set, text null)
 }
 
 
+// ============================================================================
+//
+//    Bytecode value stack
+//
+// ============================================================================
+//   Frames for Function::Run are bump-allocated in a contiguous per-thread
+//   stack. Slots in the free area of the stack are always null.
+//   A frame is laid out as [closures | inputs | self | scope | locals],
+//   with Data pointing at 'self'. The rules for slots are:
+//   - Input arguments are borrowed from the caller's frame, which does not
+//     change until the call returns. Closure values are borrowed from the
+//     'captured' list of the function being run. Both are stored uncounted.
+//   - Self, scope, locals and temporaries are counted, since ops store
+//     computed values there that nothing else keeps alive.
+//   Ops never store into the negative slots of their own frame, so borrowed
+//   slots are only cleared when the frame is released.
+
+struct ValueStack
+// ----------------------------------------------------------------------------
+//   Per-thread contiguous stack of bytecode frames
+// ----------------------------------------------------------------------------
+{
+    enum { SIZE = 64 * 1024 };
+
+    ValueStack(): base(new Tree_p[SIZE]), top(base), limit(base + SIZE) {}
+    ~ValueStack()                       { delete[] base; }
+
+    Data Allocate(uint size)
+    {
+        // Frames that do not fit are allocated on the heap by the caller
+        if (size > uint(limit - top))
+            return NULL;
+        Data frame = top;
+        top += size;
+        return frame;
+    }
+    void Free(Data frame)               { top = frame; }
+
+    static ValueStack *Current();
+
+    Data        base;
+    Data        top;
+    Data        limit;
+};
+
+
+static __thread ValueStack *value_stack = NULL;
+static pthread_key_t        value_stack_key;
+static pthread_once_t       value_stack_once = PTHREAD_ONCE_INIT;
+
+
+static void value_stack_delete(void *stack)
+// ----------------------------------------------------------------------------
+//   Delete the value stack of a thread when it exits
+// ----------------------------------------------------------------------------
+{
+    delete (ValueStack *) stack;
+}
+
+
+static void value_stack_key_create()
+// ----------------------------------------------------------------------------
+//   Create the key used to find the value stack of each thread
+// ----------------------------------------------------------------------------
+{
+    pthread_key_create(&value_stack_key, value_stack_delete);
+}
+
+
+ValueStack *ValueStack::Current()
+// ----------------------------------------------------------------------------
+//   Return the value stack for the current thread, creating it if needed
+// ----------------------------------------------------------------------------
+{
+    if (!value_stack)
+    {
+        // The key only serves to delete the stack when the thread exits
+        pthread_once(&value_stack_once, value_stack_key_create);
+        value_stack = new ValueStack;
+        pthread_setspecific(value_stack_key, value_stack);
+    }
+    return value_stack;
+}
+
+
+struct ValueFrame
+// ----------------------------------------------------------------------------
+//   A frame in the value stack, released when going out of scope
+// ----------------------------------------------------------------------------
+{
+    ValueFrame(uint size, uint borrowed)
+        : stack(ValueStack::Current()), slots(stack->Allocate(size)),
+          size(size), borrowed(borrowed), heap(!slots)
+    {
+        if (heap)
+            slots = new Tree_p[size];
+    }
+
+    ~ValueFrame()
+    {
+        for (uint s = 0; s < borrowed; s++)
+            slots[s].Unborrow();
+        if (heap)
+        {
+            delete[] slots;
+            return;
+        }
+        for (uint s = borrowed; s < size; s++)
+            if (slots[s].Pointer())
+                slots[s] = NULL;
+        stack->Free(slots);
+    }
+
+    ValueStack *stack;
+    Data        slots;
+    uint        size;
+    uint        borrowed;
+    bool        heap;
+};
+
+
+
 Function::Function(Context *context, Tree *self, uint nInputs, uint nLocals)
 // ----------------------------------------------------------------------------
 //   Create a function
@@ -736,46 +1521,130 @@ Op *Function::Run(Data data)
 //   Create a new scope and run all instructions in the sequence
 // ----------------------------------------------------------------------------
 {
-    Scope *scope     = context->CurrentScope();
-    uint   frameSize = FrameSize();
-    uint   offset    = OffsetSize();
-    Data   frame     = new Tree_p[frameSize];
-    Data   newData   = frame + offset;
+    return Run(data, NULL);
+}
 
-    // Initialize self and scope
-    newData[0] = self;
-    newData[1] = scope;
 
-    // Copy input arguments
-    uint inputs   = Inputs();
-    Data oarg = &newData[-1];
-    Data iarg = &data[-1];
-    for (uint a = 0; a < inputs; a++)
-        *oarg-- = *iarg--;
+Op *Function::Run(Data data, Scope *scope)
+// ----------------------------------------------------------------------------
+//   Run the instructions in the given scope, by default the compile scope
+// ----------------------------------------------------------------------------
+//   Calls in tail position come back here with the callee and its inputs,
+//   which then runs in place of this function without growing the C stack
+{
+    Function * function = this;
+    Data       input    = data;
+    TreeList   args, tailArgs;
 
-    // Copy closure data if any
-    uint closures = Closures();
-    if (closures)
+    for (;;)
     {
-        Data carg = ClosureData();
-        for (uint c = 0; c < closures; c++)
-            *oarg-- = *carg++;
+        {
+            Profiler::Frame profile(function->self->Position());
+            if (!scope)
+                scope = function->context->CurrentScope();
+            uint       frameSize = function->FrameSize();
+            uint       offset    = function->OffsetSize();
+            ValueFrame frame(frameSize, offset);
+            Data       newData   = frame.slots + offset;
+
+            // Initialize self and scope
+            newData[0] = function->self;
+            newData[1] = scope;
+
+            // Borrow input arguments from the caller's frame
+            uint inputs   = function->Inputs();
+            Data oarg = &newData[-1];
+            Data iarg = &input[-1];
+            for (uint a = 0; a < inputs; a++)
+                (oarg--)->Borrow((iarg--)->Pointer());
+
+            // Borrow closure data if any
+            uint closures = function->Closures();
+            if (closures)
+            {
+                Data carg = function->ClosureData();
+                for (uint c = 0; c < closures; c++)
+                    (oarg--)->Borrow((carg++)->Pointer());
+            }
+
+            // Execute the instructions in the newly created data context
+            function->RunOps(newData);
+
+            // Copy result and current context to the old data
+            // The frame is released when we return
+            Function *tail = tail_call.target;
+            if (!tail)
+            {
+                Tree *result = DataResult(newData);
+                DataResult(data, result);
+                return success;
+            }
+
+            // Keep the inputs of a tail call, they live in this frame
+            uint tailInputs = tail->Inputs();
+            Data targ = tail_call.args;
+            tail_call.target = NULL;
+            tailArgs.resize(tailInputs);
+            for (uint a = 0; a < tailInputs; a++)
+                tailArgs[tailInputs - 1 - a] = targ[~int(a)];
+            function = tail;
+            scope = NULL;
+        }
+
+        // The frame was released, run the tail call with the saved inputs
+        args.swap(tailArgs);
+        input = args.empty() ? data : &args[0] + args.size();
     }
+}
 
-    // Execute the following instructions in the newly created data context
-    Op *op = ops;
-    while (op)
-        op = op->Run(newData);
 
-    // Copy result and current context to the old data
-    Tree *result = DataResult(newData);
-    DataResult(data, result);
+void Function::MarkTailCalls()
+// ----------------------------------------------------------------------------
+//   Mark the calls whose result is directly the result of the function
+// ----------------------------------------------------------------------------
+//   Only clear ops may follow such a call. Calls in the sequence of an
+//   'eval' op return to that op, and are not in tail position.
+{
+    if (!MAIN->options.tail_calls)
+        return;
 
-    // Destroy the frame, we no longer need it
-    delete[] frame;
+    // Find the ops that belong to nested evaluation sequences
+    std::set<Op *> nested;
+    Ops pending;
+    for (Ops::iterator i = instrs.begin(); i != instrs.end(); i++)
+        if (EvalOp *eval = dynamic_cast<EvalOp *>(*i))
+            pending.push_back(eval->ops);
+    while (!pending.empty())
+    {
+        Op *op = pending.back();
+        pending.pop_back();
+        if (op && nested.insert(op).second)
+        {
+            pending.push_back(op->success);
+            pending.push_back(op->Fail());
+        }
+    }
 
-    // Evaluate next instruction
-    return success;
+    // Check calls reachable from the entry point
+    std::set<Op *> visited;
+    pending.push_back(ops);
+    while (!pending.empty())
+    {
+        Op *op = pending.back();
+        pending.pop_back();
+        if (!op || nested.count(op) || !visited.insert(op).second)
+            continue;
+        pending.push_back(op->success);
+        pending.push_back(op->Fail());
+
+        CallOp *call = dynamic_cast<CallOp *>(op);
+        if (!call || !dynamic_cast<Function *>(call->target))
+            continue;
+        Op *next = call->success;
+        while (dynamic_cast<ClearOp *>(next))
+            next = next->success;
+        call->tail = next == NULL;
+    }
 }
 
 
@@ -1007,7 +1876,7 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
 //    Lookup a given declaration and generate code for it
 // ----------------------------------------------------------------------------
 {
-    static uint  depth = 0;
+    static __thread uint depth = 0;
     Save<uint>   saveDepth(depth, depth+1);
 
     CodeBuilder *builder = (CodeBuilder *) cb;
@@ -1069,9 +1938,12 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
         uint lastInstrSize = builder->instrs.size();
 
         // Check bindings of arguments to declaration, exit if fails
+        // A mismatch is not an error, since another candidate may match
+        Errors errors;
         strength = decl->left->Do(builder);
         if (strength == CodeBuilder::NEVER)
         {
+            errors.Clear();
             IFTRACE(compile)
                 std::cerr << "COMPILE" << depth << ":" << cindex
                           << "(" << self << ") from " << decl->left
@@ -1125,6 +1997,7 @@ static Tree *compileLookup(Scope *evalScope, Scope *declScope,
         CallOp *call = builder->Call(argsCtx, decl->right,
                                      builder->resultType,
                                      builder->outputs, builder->parms);
+        call->decl = decl;
         builder->Add(call);
     }
 
@@ -1178,6 +2051,7 @@ Function *CodeBuilder::Compile(Context *ctx, Tree *what,
     function->SetOps(&ops, &instrs, nEvals + nParms);
     if (result)
     {
+        function->MarkTailCalls();
         // Successful compilation - Return the code we created
         function->nInputs = nArgs + captured.size();
         function->nLocals = nEvals + nParms + 2;
@@ -1278,12 +2152,17 @@ bool CodeBuilder::Instructions(Context *ctx, Tree *what)
         case INTEGER:
         case REAL:
         case TEXT:
-        case NAME:
             // If not looked up, return the original
             Add(new ConstOp(what));
             InstructionsSuccess(saveEvals.saved.size());
             return true;
 
+        case NAME:
+            // Variables may be defined at run time, e.g. by 'X := 0'
+            Add(new NameOp((Name *) (Tree *) what));
+            InstructionsSuccess(saveEvals.saved.size());
+            return true;
+
         case BLOCK:
         {
             // Evaluate child in a new context
@@ -1516,6 +2395,11 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
         return id;
     }
 
+    // Deferred arguments are passed unevaluated if the callee can do it
+    if (deferEval)
+        if ((id = Defer(ctx, self)))
+            return id;
+
     // For names, look them up to check if we have them somewhere
     if (Name *name = self->AsName())
     {
@@ -1532,7 +2416,16 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
             case PARAMETER:
             {
                 TreeIDs::iterator found = inputs.find(rw);
-                ELIOT_ASSERT(found != inputs.end() && "Parameter not bound?");
+                if (found == inputs.end())
+                {
+                    // Variable assigned at run time, e.g. by 'X := 0'
+                    NameOp *lookup = new NameOp(name);
+                    instrs.push_back(lookup);
+                    id = ValueID(rw);
+                    AddEval(id, lookup);
+                    evaluate = false;
+                    break;
+                }
                 int inputId = (*found).second;
 
                 // Don't evaluate if already evaluated during argument passing
@@ -1553,6 +2446,28 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
             // Check if this is a local variable or function
             case LOCAL:
             {
+                // Parameters of the call being built are already in our frame
+                TreeIDs::iterator bound = outputs.find(rw->left);
+                if (bound != outputs.end() &&
+                    size_t(~(*bound).second) < parms.size())
+                {
+                    int valueId = parms[~(*bound).second];
+                    id = ValueID(rw);
+                    Add(new ArgEvalOp(ctx, valueId, id, failOp));
+                    evaluate = false;
+                    break;
+                }
+
+                // A parameter bound to a name like its own, as in 'f N',
+                // must not look itself up again
+                if (Tree::Equal(value, name))
+                {
+                    Context_p outer = new Context(ScopeParent(scope));
+                    id = Evaluate(outer, value);
+                    evaluate = false;
+                    break;
+                }
+
                 id = ValueID(rw);
                 Op *code = CompileInternal(context, value, false);
                 AddEval(id, code);
@@ -1615,6 +2530,125 @@ int CodeBuilder::Evaluate(Context *ctx, Tree *self, bool deferEval)
 }
 
 
+int CodeBuilder::Defer(Context *ctx, Tree *self)
+// ----------------------------------------------------------------------------
+//   Pass a tree as a closure evaluated by the callee, or return 0
+// ----------------------------------------------------------------------------
+//   This lets the callee evaluate it each time, e.g. for a 'loop' body.
+//   Parameters used by the tree are bound in the closure at run time.
+//   Trees that use locals or temporaries are evaluated at the call site.
+{
+    // Temporaries such as the parts of a matched infix are in the frame
+    if (values.count(self))
+        return 0;
+
+    // A lazy parameter is passed on as received from our caller
+    Rewrite_p rw;
+    Scope_p   scope;
+    Name     *name = self->AsName();
+    if (name && ctx->Bound(name, true, &rw, &scope))
+    {
+        if (ScopeDepth(scope) != PARAMETER)
+            return 0;
+        TreeIDs::iterator found = inputs.find(rw);
+        if (found != inputs.end())
+        {
+            Tree *type = RewriteType(rw->left);
+            if (type && type != tree_type)
+                return 0;
+            return (*found).second;
+        }
+    }
+
+    bool      dynamic = false;
+    TreeList  names;
+    ParmOrder ids;
+    if (!Deferrable(ctx, self, dynamic, names, ids))
+        return 0;
+
+    // The closure is a new tree, so its ID does not alias other values
+    Tree *closure = MakeClosure(ctx, self);
+    if (closure == self)
+        return 0;
+    int id = ValueID(closure);
+    if (dynamic || name)
+        Add(new DeferOp(self, names, ids));
+    else
+        Add(new ConstOp(closure));
+    Add(new StoreOp(id));
+    return id;
+}
+
+
+bool CodeBuilder::Deferrable(Context *ctx, Tree *self, bool &dynamic,
+                             TreeList &names, ParmOrder &ids)
+// ----------------------------------------------------------------------------
+//   Check if a tree can be evaluated later, collect the parameters it uses
+// ----------------------------------------------------------------------------
+//   'dynamic' is set if the tree uses names bound at run time in the
+//   scope of the current function, so that its closure is built then.
+{
+    switch(self->Kind())
+    {
+    case INTEGER:
+    case REAL:
+    case TEXT:
+        return true;
+    case NAME:
+    {
+        Rewrite_p rw;
+        Scope_p   scope;
+        if (values.count(self))
+            return false;
+        if (!ctx->Bound((Name *) self, true, &rw, &scope))
+            return true;
+        switch (ScopeDepth(scope))
+        {
+        case PARAMETER:
+        {
+            dynamic = true;
+            TreeIDs::iterator found = inputs.find(rw);
+            if (found == inputs.end())
+                return true;
+            int id = (*found).second;
+            if (count(ids.begin(), ids.end(), id) == 0)
+            {
+                names.push_back(self);
+                ids.push_back(id);
+            }
+            return true;
+        }
+        case GLOBAL:
+            return true;
+        default:
+            return false;
+        }
+    }
+    case BLOCK:
+        return Deferrable(ctx, ((Block *) self)->child, dynamic, names, ids);
+    case PREFIX:
+    {
+        Prefix *prefix = (Prefix *) self;
+        return (Deferrable(ctx, prefix->left, dynamic, names, ids) &&
+                Deferrable(ctx, prefix->right, dynamic, names, ids));
+    }
+    case POSTFIX:
+    {
+        Postfix *postfix = (Postfix *) self;
+        return (Deferrable(ctx, postfix->left, dynamic, names, ids) &&
+                Deferrable(ctx, postfix->right, dynamic, names, ids));
+    }
+    case INFIX:
+    {
+        Infix *infix = (Infix *) self;
+        return (Deferrable(ctx, infix->left, dynamic, names, ids) &&
+                Deferrable(ctx, infix->right, dynamic, names, ids));
+    }
+    }
+    return false;
+}
+
+
 int CodeBuilder::EvaluationTemporary(Tree *self)
 // ----------------------------------------------------------------------------
 //    Create an evaluation temporary
@@ -1709,6 +2743,8 @@ struct NameMatchOp : FailOp
     {
         Tree *test = data[testID];
         Tree *ref  = data[nameID];
+        if (Tree *inside = IsClosure(test, NULL))
+            test = inside;
         if (Tree::Equal(ref, test))
             return success;
         return fail;
@@ -1817,9 +2853,9 @@ CodeBuilder::strength CodeBuilder::DoReal(Real *what)
 // ----------------------------------------------------------------------------
 {
     if (Real *rval = test->AsReal())
-        return rval->value != what->value ? ALWAYS : NEVER;
+        return rval->value == what->value ? ALWAYS : NEVER;
     if (Integer *rval = test->AsInteger())
-        return rval->value != what->value ? ALWAYS : NEVER;
+        return rval->value == what->value ? ALWAYS : NEVER;
     if (test->IsConstant())
         return NEVER;
     Evaluate(context, test);
@@ -1834,7 +2870,7 @@ CodeBuilder::strength CodeBuilder::DoText(Text *what)
 // ----------------------------------------------------------------------------
 {
     if (Text *tval = test->AsText())
-        return tval->value != what->value ? ALWAYS : NEVER;
+        return tval->value == what->value ? ALWAYS : NEVER;
     if (test->IsConstant())
         return NEVER;
     Evaluate(context, test);
@@ -1868,8 +2904,8 @@ CodeBuilder::strength CodeBuilder::DoName(Name *what)
         return SOMETIMES;
     }
 
-    Evaluate(context, test, true);
-    Bind(what, test);
+    int id = Evaluate(context, test, true);
+    Bind(what, test, id);
     return ALWAYS;
 }
 
@@ -1902,7 +2938,7 @@ CodeBuilder::strength CodeBuilder::DoPrefix(Prefix *what)
         {
             if (Name *testName = pfx->left->AsName())
             {
-                if (name->value == testName->value)
+                if (name->Is(testName))
                 {
                     test = pfx->right;
                     return what->right->Do(this);
@@ -1938,7 +2974,7 @@ CodeBuilder::strength CodeBuilder::DoPostfix(Postfix *what)
         {
             if (Name *testName = pfx->right->AsName())
             {
-                if (name->value == testName->value)
+                if (name->Is(testName))
                 {
                     test = pfx->left;
                     return what->left->Do(this);
@@ -1989,15 +3025,15 @@ CodeBuilder::strength CodeBuilder::DoInfix(Infix *what)
         {
             if (namedType == tree_type)
             {
-                Evaluate(context, test, true);
-                Bind(name, test);
+                int id = Evaluate(context, test, true);
+                Bind(name, test, id);
                 return ALWAYS;
             }
             if (Tree *cast = TypeCheck(context, namedType, test))
             {
                 test = cast;
-                Evaluate(context, test);
-                Bind(name, test, namedType);
+                int id = Evaluate(context, test);
+                Bind(name, test, id, namedType);
                 return ALWAYS;
             }
 
@@ -2007,9 +3043,11 @@ CodeBuilder::strength CodeBuilder::DoInfix(Infix *what)
         }
 
         // In all other cases, we need do perform dynamic evaluation to check
-        Evaluate(context, test);
-        AddTypeCheck(context, test, type);
-        Bind(name, test, type);
+        // The declared result type says nothing about the argument here
+        int id = Evaluate(context, test);
+        int typeID = Evaluate(context, namedType ? namedType : type);
+        Add(new TypeCheckOp(id, typeID, failOp));
+        Bind(name, test, id, type);
         return SOMETIMES;
     }
 
@@ -2090,7 +3128,7 @@ CodeBuilder::strength CodeBuilder::DoLeftRight(Tree *wl, Tree *wr,
 }
 
 
-int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
+int CodeBuilder::Bind(Name *name, Tree *value, int valueId, Tree *type)
 // ----------------------------------------------------------------------------
 //   Enter a new binding in the current context
 // ----------------------------------------------------------------------------
@@ -2108,9 +3146,8 @@ int CodeBuilder::Bind(Name *name, Tree *value, Tree *type)
     int parmId = ~outputs.size();
     outputs[rw->left] = parmId;
 
-    // Record parameter order for calls
-    uint id = ValueID(value);
-    parms.push_back(id);
+    // Record parameter order for calls, using the ID the value was stored in
+    parms.push_back(valueId);
 
     return parmId;
 }
@@ -51,6 +51,8 @@ typedef std::map<Tree *, int>  TreeIDs;
 typedef std::map<Tree *, Op *> TreeOps;
 typedef std::vector<int>       ParmOrder;
 typedef Tree_p *               Data;
+struct ThreadedOp;              // Compact encoding of an operation
+typedef std::vector<ThreadedOp> ThreadedCode;
 
 
 
@@ -93,6 +95,44 @@ public:
 };
 
 
+struct ThreadedOp
+// ----------------------------------------------------------------------------
+//   A fixed-size instruction in the threaded encoding of a code sequence
+// ----------------------------------------------------------------------------
+//   Simple ops are executed directly from their operands. Other ops are run
+//   through their 'Run' method ('GENERIC'), with 'next' and 'fail' giving the
+//   index of the instructions matching op->success and op->Fail().
+//   Integer and real arithmetic ('IARITH', 'FARITH', 'ICMP', 'FCMP') works
+//   on unboxed registers, which are boxed only when a generic op needs them.
+{
+    enum Kind { EXIT, RETURN, GENERIC, CONST, SELF, VALUE, STORE, CLEAR, EVAL,
+                TYPECHK, IARITH, FARITH, ICMP, FCMP };
+    enum Alu  { NONE, ADD, SUB, MUL, DIV, EQ, NE, GT, GE, LT, LE };
+
+    ThreadedOp(Kind kind = EXIT, Op *op = NULL)
+        : kind(kind), alu(NONE), a(0), b(0), op(op), value(NULL),
+          next(0), fail(0) {}
+
+    Kind                kind;
+    Alu                 alu;            // Arithmetic or comparison
+    int                 a, b;           // Operands, e.g. slot IDs
+    Op *                op;             // Original op
+    Tree *              value;          // Constant, kept alive by 'op'
+    uint                next;           // Index of the next instruction
+    uint                fail;           // Index of the fail instruction
+};
+
+
+union ThreadedReg
+// ----------------------------------------------------------------------------
+//   An unboxed value held in a register while running threaded code
+// ----------------------------------------------------------------------------
+{
+    longlong            i;
+    double              r;
+};
+
+
 struct Code : Op, Info
 // ----------------------------------------------------------------------------
 //    A sequence of operations (may be local evaluation code in a function)
@@ -103,8 +143,11 @@ struct Code : Op, Info
     ~Code();
 
     virtual Op *        Run(Data data);
+    void                RunOps(Data data);
 
     void                SetOps(Op **ops, Ops *instr, uint outId);
+    void                Thread();
+    void                RunThreaded(Data data);
     virtual void        Dump(std::ostream &out);
     static void         Dump(std::ostream &out, Op *ops, Ops &instrs);
     static text         Ref(Op *op, text sep, text set, text null);
@@ -117,6 +160,8 @@ public:
     Tree_p              self;
     Op *                ops;
     Ops                 instrs;
+    ThreadedCode        threaded;
+    uint                registers;
 };
 
 
@@ -130,6 +175,8 @@ struct Function : Code
     ~Function();
 
     virtual Op *        Run(Data data);
+    Op *                Run(Data data, Scope *scope);
+    void                MarkTailCalls();
     virtual void        Dump(std::ostream &out);
     virtual uint        Inputs()        { return nInputs; }
     virtual uint        Locals()        { return nLocals; }
@@ -185,9 +232,13 @@ public:
     int         ValueID(Tree *);
     int         CaptureID(Tree *);
     int         Evaluate(Context *, Tree *, bool deferEval = false);
+    int         Defer(Context *, Tree *);
+    bool        Deferrable(Context *, Tree *, bool &dynamic,
+                           TreeList &names, ParmOrder &ids);
     int         EvaluationTemporary(Tree *);
     void        Enclose(Context *context, Scope *old, Tree *what);
-    int         Bind(Name *name, Tree *value, Tree *type=NULL);
+    int         Bind(Name *name, Tree *value, int valueId,
+                     Tree *type = NULL);
     CallOp *    Call(Context *context, Tree *value, Tree *type,
                      TreeIDs &inputs, ParmOrder &parms);
 
@@ -286,7 +337,7 @@ inline Tree *DataArg(Data data, uint index)
 //    Return the Nth input argument
 // ----------------------------------------------------------------------------
 {
-    return data[~index];
+    return data[~int(index)];
 }
 
 
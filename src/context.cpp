@@ -76,6 +76,12 @@ ELIOT_BEGIN
 
 
 uint Context::hasRewritesForKind = 0;
+#ifndef INTERPRETER_ONLY
+hash_set *Context::recording = NULL;
+ulong Context::compiledHits = 0;
+ulong Context::compiledMisses = 0;
+ulong Context::compiledInvalidations = 0;
+#endif // INTERPRETER_ONLY
 
 Context::Context()
 // ----------------------------------------------------------------------------
@@ -120,6 +126,253 @@ Context::~Context()
 {}
 
 
+// ============================================================================
+//
+//   Side information attached to scopes
+//
+// ============================================================================
+
+struct ScopeInfo : Info
+// ----------------------------------------------------------------------------
+//   Lookup cache stamp and flat hash index for a scope
+// ----------------------------------------------------------------------------
+//   The stamp is unique across all scopes and changes whenever we enter
+//   a declaration in the scope. A lookup cache entry recorded for a scope is
+//   valid only while the scope still carries the stamp it was recorded with.
+//   Since a scope that was freed and reallocated at the same address gets a
+//   fresh stamp, cache entries do not need to hold a reference to the scope,
+//   which would otherwise create cycles between declarations and scopes.
+//
+//   Large scopes also get an open-addressed table of (hash, declaration),
+//   kept in sync with the rewrite tree by Context::Enter. The tree remains
+//   the reference form, used e.g. for serialization and Context::Dump.
+//   Declarations with the same hash follow the same path in the tree, so
+//   they are found in insertion order. Linear probing without deletion
+//   preserves that order, as long as we rebuild the table in that order.
+//   Entries also record the name heading the defined form, if any, so that
+//   candidates whose name merely has the same hash are not returned.
+{
+    struct Entry
+    {
+        Entry(ulong hash = 0, Infix *decl = NULL, Name *name = NULL)
+            : hash(hash), decl(decl), name(name) {}
+        ulong           hash;
+        Infix *         decl;
+        Name *          name;           // Owned by the declaration
+    };
+    typedef std::vector<Entry> Entries;
+    enum { INDEX_DEPTH = 6, INDEX_MIN_SIZE = 64 };
+
+    ScopeInfo(): stamp(++counter), table(), order() {}
+
+    void                Renew()         { stamp = ++counter; }
+    bool                Indexed()       { return !table.empty(); }
+    void                Reset()         { table.clear(); order.clear(); }
+    void                Index(Tree *locals);
+    void                Insert(ulong hash, Infix *decl);
+    uint                Candidates(ulong hash, Name *name,
+                                   Infix **decls, uint max);
+    static Name *       Key(Tree *form);
+
+public:
+    ulong               stamp;
+    Entries             table;
+    Entries             order;
+
+    static ulong        counter;
+
+private:
+    static ulong        Slot(ulong hash)
+    {
+        return (hash ^ (hash >> 16)) * 0x45d9f3b;
+    }
+    void                Place(const Entry &entry);
+};
+ulong ScopeInfo::counter = 0;
+
+
+void ScopeInfo::Index(Tree *locals)
+// ----------------------------------------------------------------------------
+//   Index an existing rewrite tree, parents before children
+// ----------------------------------------------------------------------------
+{
+    if (locals == eliot_nil)
+        return;
+
+    Rewrite *entry = locals->AsInfix();
+    ELIOT_ASSERT(entry && entry->name == REWRITE_NAME);
+    Infix *decl = RewriteDeclaration(entry);
+    RewriteChildren *children = RewriteNext(entry);
+    ELIOT_ASSERT(children && children->name == REWRITE_CHILDREN_NAME);
+
+    Insert(Context::Hash(RewriteDefined(decl->left)), decl);
+    Index(children->left);
+    Index(children->right);
+}
+
+
+Name *ScopeInfo::Key(Tree *form)
+// ----------------------------------------------------------------------------
+//   Return the name that a form must have to match, e.g. 'sin' in 'sin X'
+// ----------------------------------------------------------------------------
+{
+    switch(form->Kind())
+    {
+    case NAME:          return (Name *) form;
+    case PREFIX:        return ((Prefix *) form)->left->AsName();
+    case POSTFIX:       return ((Postfix *) form)->right->AsName();
+    default:            return NULL;
+    }
+}
+
+
+void ScopeInfo::Insert(ulong hash, Infix *decl)
+// ----------------------------------------------------------------------------
+//   Add a declaration to the index, growing the table as required
+// ----------------------------------------------------------------------------
+{
+    Entry entry(hash, decl, Key(RewriteDefined(decl->left)));
+    order.push_back(entry);
+
+    // Keep the table at most half full
+    size_t size = table.size();
+    if (2 * order.size() <= size)
+    {
+        Place(entry);
+        return;
+    }
+
+    // Grow and replay declarations in insertion order
+    size = size ? 2 * size : size_t(INDEX_MIN_SIZE);
+    while (size < 2 * order.size())
+        size *= 2;
+    table.assign(size, Entry());
+    for (Entries::iterator e = order.begin(); e != order.end(); e++)
+        Place(*e);
+}
+
+
+void ScopeInfo::Place(const Entry &entry)
+// ----------------------------------------------------------------------------
+//   Put an entry in the first free slot of its probe sequence
+// ----------------------------------------------------------------------------
+{
+    ulong mask = table.size() - 1;
+    ulong slot = Slot(entry.hash) & mask;
+    while (table[slot].decl)
+        slot = (slot + 1) & mask;
+    table[slot] = entry;
+}
+
+
+uint ScopeInfo::Candidates(ulong hash, Name *name, Infix **decls, uint max)
+// ----------------------------------------------------------------------------
+//   Collect declarations with the given hash and name, ~0U if more than max
+// ----------------------------------------------------------------------------
+//   'name' is the Key of the form we look up. A declaration headed by
+//   another name cannot match it, even if the hashes are the same
+{
+    uint count = 0;
+    ulong mask = table.size() - 1;
+    for (ulong slot = Slot(hash) & mask; table[slot].decl; slot = (slot+1)&mask)
+    {
+        Entry &entry = table[slot];
+        if (entry.hash == hash &&
+            (name ? entry.name && entry.name->Is(name) : !entry.name))
+        {
+            if (count >= max)
+                return ~0U;
+            decls[count++] = table[slot].decl;
+        }
+    }
+    return count;
+}
+
+
+struct LookupCache : Info
+// ----------------------------------------------------------------------------
+//   Polymorphic inline cache of the candidate declarations for a form
+// ----------------------------------------------------------------------------
+//   For each scope where we looked up the form, we remember the declarations
+//   with a matching hash, in the order of the original lookup. This lets us
+//   skip the walk in large scopes, while still calling the lookup function
+//   on each candidate in turn, since binding may fail on guards or patterns.
+{
+    enum { ENTRIES = 4, CANDIDATES = 16, MIN_VISITS = 4 };
+    struct Entry
+    {
+        Entry(): scope(NULL), stamp(0), hash(0), count(0) {}
+        Scope *         scope;
+        ulong           stamp;
+        ulong           hash;
+        uint            count;
+        Infix *         candidates[CANDIDATES];
+    };
+
+    LookupCache(): replace(0) {}
+    Entry *             Find(Scope *scope, ScopeInfo *info, ulong hash);
+    void                Remember(Scope *scope, ScopeInfo *info, ulong hash,
+                                 Infix **candidates, uint count);
+
+    Entry               entries[ENTRIES];
+    uint                replace;
+};
+
+
+LookupCache::Entry *LookupCache::Find(Scope *scope, ScopeInfo *info, ulong hash)
+// ----------------------------------------------------------------------------
+//   Find a valid cache entry for the given scope
+// ----------------------------------------------------------------------------
+{
+    for (uint e = 0; e < ENTRIES; e++)
+    {
+        Entry &entry = entries[e];
+        if (entry.scope == scope && entry.hash == hash)
+        {
+            if (info && info->stamp == entry.stamp)
+                return &entry;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+
+void LookupCache::Remember(Scope *scope, ScopeInfo *info, ulong hash,
+                           Infix **candidates, uint count)
+// ----------------------------------------------------------------------------
+//   Record the candidates for a scope, replacing stale or older entries
+// ----------------------------------------------------------------------------
+{
+    Entry *entry = NULL;
+    for (uint e = 0; !entry && e < ENTRIES; e++)
+        if (entries[e].scope == scope)
+            entry = &entries[e];
+    if (!entry)
+    {
+        entry = &entries[replace];
+        replace = (replace + 1) % ENTRIES;
+    }
+
+    entry->scope = scope;
+    entry->stamp = info->stamp;
+    entry->hash = hash;
+    entry->count = count;
+    std::copy(candidates, candidates + count, entry->candidates);
+}
+
+
+void Context::ScopeChanged(Scope *scope)
+// ----------------------------------------------------------------------------
+//   Invalidate lookup caches referring to the given scope
+// ----------------------------------------------------------------------------
+{
+    if (ScopeInfo *info = scope->GetInfo<ScopeInfo>())
+        info->Renew();
+}
+
+
+
 
 // ============================================================================
 // 
@@ -161,26 +414,73 @@ eval_fn Context::Compile(Tree *what)
 // ----------------------------------------------------------------------------
 //   Evaluate 'what' in the given context
 // ----------------------------------------------------------------------------
+//   We record the hash of all forms looked up while compiling 'what', so that
+//   entering a rewrite only invalidates the code that may depend on it
 {
-    eval_fn code = compiled[what];
+    eval_fn code = NULL;
 
 #ifndef INTERPRETER_ONLY
+    code_map::iterator found = compiled.find(what);
+    if (found != compiled.end() && found->second)
+    {
+        compiledHits++;
+        return found->second;
+    }
+    compiledMisses++;
+
+    hash_set  used;
+    hash_set *outer = recording;
+    recording = &used;
+    code = MAIN->compiler->Compile(this, what);
+    recording = outer;
+
+    // Code compiled for an enclosing form depends on what we looked up
+    if (outer)
+        outer->insert(used.begin(), used.end());
+
     if (!code)
     {
-        code = MAIN->compiler->Compile(this, what);
-        if (!code)
-        {
-            Ooops("Error compiling $1", what);
-            return NULL;
-        }
-        compiled[what] = code;
+        Ooops("Error compiling $1", what);
+        return NULL;
     }
+    compiled[what] = code;
+    for (hash_set::iterator h = used.begin(); h != used.end(); h++)
+        dependents[*h].insert(what);
 #endif // INTERPRETER_ONLY
 
     return code;
 }
 
 
+#ifndef INTERPRETER_ONLY
+void Context::Invalidate(ulong hash)
+// ----------------------------------------------------------------------------
+//   Forget compiled code that looked up forms with the given hash
+// ----------------------------------------------------------------------------
+{
+    code_dependents::iterator found = dependents.find(hash);
+    if (found == dependents.end())
+        return;
+
+    tree_set &trees = found->second;
+    for (tree_set::iterator t = trees.begin(); t != trees.end(); t++)
+        compiledInvalidations += compiled.erase(*t);
+    dependents.erase(found);
+}
+
+
+void Context::PrintCompiledStatistics()
+// ----------------------------------------------------------------------------
+//   Print statistics about the compiled code cache
+// ----------------------------------------------------------------------------
+{
+    printf("%24s %8s %8s %8s\n", "COMPILED CODE", "HITS", "MISSES", "INVALID");
+    printf("%24s %8lu %8lu %8lu\n", "Cache",
+           compiledHits, compiledMisses, compiledInvalidations);
+}
+#endif // INTERPRETER_ONLY
+
+
 Tree *Context::Evaluate(Tree *what)
 // ----------------------------------------------------------------------------
 //   Evaluate 'what' in the given context
@@ -413,16 +713,20 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
                 if (cname->value == "C")
                     return NULL;
 
-    // Updating a symbol in the context invalidates any cached code we may have
-    compiled.clear();
-
     // Find 'from', 'to' and 'hash' for the rewrite
     Tree *from = rewrite->left;
     
     // Check what we are really defining, and verify if it's a name
     Tree *defined = RewriteDefined(from);
     Name *name = defined->AsName();
-    ulong h = Hash(defined);
+    ulong h0 = Hash(defined);
+    ulong h = h0;
+
+#ifndef INTERPRETER_ONLY
+    // Updating a symbol invalidates cached code that looked that shape up
+    Invalidate(h0);
+#endif // INTERPRETER_ONLY
+    ScopeChanged(symbols);
 
     // Record which kinds we have rewrites for
     HasOneRewriteFor(defined->Kind());
@@ -442,6 +746,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
     Tree_p  &locals = scope->right;
     Tree_p  *parent = &locals;
     Rewrite *result = NULL;
+    uint     depth  = 0;
     while (!result)
     {
         // If we have found a nil spot, that's where we can insert
@@ -460,6 +765,22 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
             // Insert the entry in the parent
             *parent = entry;
 
+            // Keep the side index in sync, create it for deep scopes
+            ScopeInfo *info = scope->GetInfo<ScopeInfo>();
+            if (info && info->Indexed())
+            {
+                info->Insert(h0, rewrite);
+            }
+            else if (depth >= ScopeInfo::INDEX_DEPTH)
+            {
+                if (!info)
+                {
+                    info = new ScopeInfo;
+                    scope->SetInfo<ScopeInfo>(info);
+                }
+                info->Index(locals);
+            }
+
             // We are done
             result = entry;
             break;
@@ -475,7 +796,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
             Tree *declDef = RewriteDefined(decl->left);
             if (Name *declName = declDef->AsName())
             {
-                if (declName->value == name->value)
+                if (declName->Is(name))
                 {
                     if (overwrite)
                     {
@@ -497,6 +818,7 @@ Rewrite *Context::Enter(Infix *rewrite, bool overwrite)
         else
             parent = &children->left;
         h = Rehash(h);
+        depth++;
     }
 
     // Return the entry we created
@@ -624,17 +946,31 @@ text Context::ResolvePrefixedPath(text path)
 // 
 // ============================================================================
 
-Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
+Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info,
+                      bool recurse, bool cached)
 // ----------------------------------------------------------------------------
 //   Lookup a tree using the given lookup function
 // ----------------------------------------------------------------------------
+//   Scopes with a side index are probed through the index.
+//   When 'cached' is set, the candidates found in other large scopes are
+//   recorded on 'what', so that later lookups can skip the walk
 {
+#ifndef INTERPRETER_ONLY
+    // Code being compiled depends on this lookup, even if it fails
+    if (recording)
+        recording->insert(Hash(what));
+#endif // INTERPRETER_ONLY
+
     // Quick exit if we have no rewrite for that tree kind
     if (!HasRewritesFor(what->Kind()))
         return NULL;
     
-    Scope * scope = symbols;
-    ulong   h0    = Hash(what);
+    Scope *       scope = symbols;
+    ulong         h0    = Hash(what);
+    bool          caching = cached && MAIN->options.lookup_cache;
+    LookupCache * cache = NULL;
+    if (caching)
+        cache = what->GetInfo<LookupCache>();
 
     while (scope)
     {
@@ -644,7 +980,89 @@ Tree *Context::Lookup(Tree *what, lookup_fn lookup, void *info, bool recurse)
         Tree *result = NULL;
         ulong h = h0;
 
-        while (true)
+        // Check if we already know the candidates in that scope
+        ScopeInfo *sinfo = scope->GetInfo<ScopeInfo>();
+        LookupCache::Entry *known = cache ? cache->Find(scope,sinfo,h0) : NULL;
+        Infix *candidates[LookupCache::CANDIDATES];
+        uint   count = ~0U;
+
+        if (known)
+        {
+            // Copy, since recursive lookups may update the cache entry
+            count = known->count;
+            std::copy(known->candidates, known->candidates + count,
+                      candidates);
+        }
+        else if (sinfo && sinfo->Indexed())
+        {
+            // Large scope, probe the side index instead of the tree
+            count = sinfo->Candidates(h0, ScopeInfo::Key(what),
+                                      candidates, LookupCache::CANDIDATES);
+        }
+        else if (caching)
+        {
+            // Collect all candidates first, then try them in order
+            uint visits = 0;
+            count = 0;
+            while (*parent != eliot_nil && count != ~0U)
+            {
+                Rewrite *entry = (*parent)->AsInfix();
+                ELIOT_ASSERT(entry && entry->name == REWRITE_NAME);
+                Infix *decl = RewriteDeclaration(entry);
+                ELIOT_ASSERT(!decl || decl->name == "->");
+                RewriteChildren *children = RewriteNext(entry);
+                ELIOT_ASSERT(children && children->name==REWRITE_CHILDREN_NAME);
+
+                Tree *defined = RewriteDefined(decl->left);
+                if (Hash(defined) == h0)
+                {
+                    if (count < LookupCache::CANDIDATES)
+                        candidates[count++] = decl;
+                    else
+                        count = ~0U;
+                }
+
+                visits++;
+                if (h & 1)
+                    parent = &children->right;
+                else
+                    parent = &children->left;
+                h = Rehash(h);
+            }
+
+            // Only record scopes where we save a significant walk
+            if (count != ~0U && visits >= LookupCache::MIN_VISITS)
+            {
+                if (!sinfo)
+                {
+                    sinfo = new ScopeInfo;
+                    scope->SetInfo<ScopeInfo>(sinfo);
+                }
+                if (!cache)
+                {
+                    cache = new LookupCache;
+                    what->SetInfo<LookupCache>(cache);
+                }
+                cache->Remember(scope, sinfo, h0, candidates, count);
+            }
+
+            // With too many candidates, restart with a regular walk
+            parent = &locals;
+            h = h0;
+        }
+
+        if (count != ~0U)
+        {
+            for (uint c = 0; c < count; c++)
+            {
+                result = lookup(symbols, scope, what, candidates[c], info);
+                if (result)
+                    return result;
+            }
+            parent = NULL;
+        }
+
+        while (parent)
         {
             // If we have found a nil spot, we are done with current scope
             if (*parent == eliot_nil)
@@ -845,8 +1263,9 @@ ulong Context::ListNames(text begin, RewriteList &list,
 
 static inline ulong HashText(const text &t)
 // ----------------------------------------------------------------------------
-//   Compute the has for some text
+//   Compute the hash for some text, looking at most at 8 characters
 // ----------------------------------------------------------------------------
+//   Unlike names, texts are hashed at each lookup, and may be long
 {
     ulong h = 0;
     uint  l = t.length();
@@ -882,7 +1301,7 @@ ulong Context::Hash(Tree *what)
         h += HashText(((Text *) what)->value);
         break;
     case NAME:
-        h += HashText(((Name *) what)->value);
+        h += ((Name *) what)->hash;
         break;
     case BLOCK:
         h += HashText(((Block *) what)->opening);
@@ -892,11 +1311,11 @@ ulong Context::Hash(Tree *what)
         break;
     case PREFIX:
         if (Name *name = ((Prefix *) what)->left->AsName())
-            h += HashText(name->value);
+            h += name->hash;
         break;
     case POSTFIX:
         if (Name *name = ((Postfix *) what)->right->AsName())
-            h += HashText(name->value);
+            h += name->hash;
         break;
     }
 
@@ -917,6 +1336,16 @@ void Context::Clear()
 // ----------------------------------------------------------------------------
 {
     symbols->right = eliot_nil;
+#ifndef INTERPRETER_ONLY
+    compiledInvalidations += compiled.size();
+    compiled.clear();
+    dependents.clear();
+#endif // INTERPRETER_ONLY
+    if (ScopeInfo *info = symbols->GetInfo<ScopeInfo>())
+    {
+        info->Renew();
+        info->Reset();
+    }
 }
 
 
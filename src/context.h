@@ -191,6 +191,9 @@ typedef std::vector<Infix_p>            RewriteList;
 typedef std::map<Tree_p, Tree_p>        TreeMap;
 typedef Tree *                          (*eval_fn) (Scope *, Tree *);
 typedef std::map<Tree_p, eval_fn>       code_map;
+typedef std::set<ulong>                 hash_set;
+typedef std::set<Tree_p>                tree_set;
+typedef std::map<ulong, tree_set>       code_dependents;
 
 
 
@@ -238,6 +241,10 @@ public:
     // Compile and evaluate a tree in the current context
     eval_fn             Compile(Tree *what);
     Tree *              Evaluate(Tree *what);
+#ifndef INTERPRETER_ONLY
+    void                Invalidate(ulong hash);
+    static void         PrintCompiledStatistics();
+#endif // INTERPRETER_ONLY
 
     // Special forms of evaluation
     Tree *              Call(text prefix, TreeList &args);
@@ -271,7 +278,7 @@ public:
                                      Tree *form, Infix *decl, void *info);
     Tree *              Lookup(Tree *what,
                                lookup_fn lookup, void *info,
-                               bool recurse=true);
+                               bool recurse=true, bool cached=false);
     Rewrite *           Reference(Tree *form);
     Tree *              Bound(Tree *form,bool recurse=true);
     Tree *              Bound(Tree *form, bool rec, Rewrite_p *rw,Scope_p *ctx);
@@ -291,6 +298,7 @@ public:
 
     // Clear the symbol table
     void                Clear();
+    static void         ScopeChanged(Scope *scope);
 
     // Dump symbol tables
     static void         Dump(std::ostream &out, Scope *symbols);
@@ -301,6 +309,15 @@ public:
     Scope_p             symbols;
     code_map            compiled;
     static uint         hasRewritesForKind;
+
+#ifndef INTERPRETER_ONLY
+    // Shapes looked up while compiling, and compiled code cache counters
+    code_dependents     dependents;
+    static hash_set *   recording;
+    static ulong        compiledHits;
+    static ulong        compiledMisses;
+    static ulong        compiledInvalidations;
+#endif // INTERPRETER_ONLY
     GARBAGE_COLLECT(Context);
 };
 
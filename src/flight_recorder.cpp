@@ -43,6 +43,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
 
 ELIOT_BEGIN
 
@@ -61,12 +63,145 @@ static void Write(int fd, const char *buf, size_t size)
 }
 
 
+ulonglong FlightRecorder::Now()
+// ----------------------------------------------------------------------------
+//   Monotonic time stamp for entries, in nanoseconds
+// ----------------------------------------------------------------------------
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static pthread_key_t  ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+
+static void ring_key_create()
+// ----------------------------------------------------------------------------
+//   Create the key used to release the ring of each thread when it exits
+// ----------------------------------------------------------------------------
+{
+    pthread_key_create(&ring_key, FlightRecorder::Release);
+}
+
+
+FlightRecorder::Ring *FlightRecorder::Acquire()
+// ----------------------------------------------------------------------------
+//   Give the current thread a ring, reusing one left by an exited thread
+// ----------------------------------------------------------------------------
+{
+    pthread_once(&ring_once, ring_key_create);
+
+    Ring *ring;
+    for (ring = rings; ring; ring = ring->next)
+        if (ring->owned.SetQ(0, 1))
+            break;
+    if (!ring)
+    {
+        ring = new Ring(size);
+        ring->owned = 1;
+        LinkedListInsert(rings, ring);
+    }
+
+    ring->thread = ++threads;
+    current = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+
+void FlightRecorder::Release(void *ring)
+// ----------------------------------------------------------------------------
+//   Make the ring of an exiting thread available, keeping its entries
+// ----------------------------------------------------------------------------
+{
+    current = NULL;
+    ((Ring *) ring)->owned = 0;
+}
+
+
+void FlightRecorder::Resize(uint size)
+// ----------------------------------------------------------------------------
+//   Change the size of rings created from now on, and of the current one
+// ----------------------------------------------------------------------------
+//   The rings of other running threads are left alone, since they may be
+//   writing in them. This is normally called before other threads start.
+{
+    this->size = size;
+    for (Ring *ring = rings; ring; ring = ring->next)
+    {
+        if (ring == current)
+        {
+            ring->records.resize(size);
+        }
+        else if (ring->owned.SetQ(0, 1))
+        {
+            ring->records.resize(size);
+            ring->owned = 0;
+        }
+    }
+}
+
+
+uint FlightRecorder::Start()
+// ----------------------------------------------------------------------------
+//   Prepare the cursors used to merge rings, return number of entries
+// ----------------------------------------------------------------------------
+//   The end of each ring is taken at this point, so that threads that keep
+//   recording while we dump do not keep us going forever
+{
+    uint count = 0;
+    for (Ring *ring = rings; ring; ring = ring->next)
+    {
+        uint windex = ring->windex;
+        uint rindex = ring->rindex;
+        uint size = ring->records.size();
+
+        // Can't have more events than the size of the buffer
+        if (rindex + size <= windex)
+            rindex = windex - size + 1;
+        ring->dindex = rindex;
+        ring->dlimit = windex;
+        count += windex - rindex;
+    }
+    return count;
+}
+
+
+FlightRecorder::Entry *FlightRecorder::Next()
+// ----------------------------------------------------------------------------
+//   Return the oldest entry not yet merged across all rings
+// ----------------------------------------------------------------------------
+{
+    Ring  *best = NULL;
+    Entry *result = NULL;
+    for (Ring *ring = rings; ring; ring = ring->next)
+    {
+        if (ring->dindex >= ring->dlimit)
+            continue;
+        Entry *e = &ring->records[ring->dindex % ring->records.size()];
+        if (!result || e->timestamp < result->timestamp)
+        {
+            best = ring;
+            result = e;
+        }
+    }
+    if (best)
+        best->dindex++;
+    return result;
+}
+
+
 void FlightRecorder::Dump(int fd, bool kill)
 // ----------------------------------------------------------------------------
 //   Dump the contents of the flight recorder to given stream
 // ----------------------------------------------------------------------------
 //   We use the lowest-possible sytem-level I/O facility to make it
-//   easier to invoke Dump() from a variety of contexts
+//   easier to invoke Dump() from a variety of contexts.
+//   Entries from all threads are shown in time order, with the thread
+//   number and the time in microseconds relative to the oldest entry.
 {
     using namespace std;
     static char buffer[512];
@@ -78,42 +213,175 @@ void FlightRecorder::Dump(int fd, bool kill)
                            asctime(localtime(&now)));
     Write(fd, buffer, size);
 
-    // Can't have more events than the size of the buffer
-    uint rindex = this->rindex;
-    if (rindex + records.size() <= windex)
-        rindex = windex - records.size() + 1;
-
     // Write all elements that remain to be shown
-    while (rindex < windex)
+    uint left = Start();
+    ulonglong origin = 0;
+    while (Entry *e = Next())
     {
-        Entry &e = records[rindex % records.size()];
+        if (!origin)
+            origin = e->timestamp;
         size = snprintf(buffer, sizeof buffer,
-                        "%4d: %16s %8p ", windex - rindex, e.what, e.caller);
+                        "%4u: %12.3f T%-3u %16s %8p ",
+                        left--, (e->timestamp - origin) * 1e-3,
+                        e->thread, e->what, e->caller);
 
-        if (e.label1[0])
+        if (e->label1[0])
             size += snprintf(buffer + size, sizeof buffer - size,
-                             "%8s=%10p", e.label1, (void *) e.arg1);
-        if (e.label2[0])
+                             "%8s=%10p", e->label1, (void *) e->arg1);
+        if (e->label2[0])
             size += snprintf(buffer + size, sizeof buffer - size,
-                             "%8s=%10p", e.label2, (void *) e.arg2);
-        if (e.label3[0])
+                             "%8s=%10p", e->label2, (void *) e->arg2);
+        if (e->label3[0])
             size += snprintf(buffer + size, sizeof buffer - size,
-                             "%8s=%10p", e.label3, (void *) e.arg3);
+                             "%8s=%10p", e->label3, (void *) e->arg3);
         if (size < sizeof buffer)
             buffer[size++] = '\n';
         Write(fd, buffer, size);
-
-        // Next step
-        rindex++;
     }
 
     if (kill)
-        this->rindex = rindex;
+        for (Ring *ring = rings; ring; ring = ring->next)
+            ring->rindex = ring->dlimit;
+
+    // Write histograms that recorded something
+    for (FlightHistogram *h = FlightHistogram::histograms; h; h = h->next)
+        if (h->count)
+            h->Dump(fd);
+}
+
+
+static size_t ExportText(char *buffer, size_t size, kstring value)
+// ----------------------------------------------------------------------------
+//   Append a length-prefixed string to an export record
+// ----------------------------------------------------------------------------
+{
+    uint16 length = strlen(value);
+    if (length > size - sizeof length)
+        length = size - sizeof length;
+    memcpy(buffer, &length, sizeof length);
+    memcpy(buffer + sizeof length, value, length);
+    return sizeof length + length;
 }
 
 
-FlightRecorder * FlightRecorder::recorder = NULL;
-ulong            FlightRecorder::enabled  = REC_ALWAYS|REC_CRITICAL|REC_DEBUG;
+bool FlightRecorder::Export(kstring file)
+// ----------------------------------------------------------------------------
+//   Write the recorded entries in time order to a binary file
+// ----------------------------------------------------------------------------
+//   The file is meant for offline tools, e.g. to produce Chrome trace JSON.
+//   All values are in host byte order. The file starts with:
+//     char[8]  "ELIOTFR1"
+//     uint64   CLOCK_REALTIME at export time, in nanoseconds
+//     uint64   CLOCK_MONOTONIC at export time, in nanoseconds
+//   It is followed by one record per entry until the end of the file:
+//     uint64   timestamp (CLOCK_MONOTONIC, nanoseconds)
+//     uint64   caller address
+//     int64    arg1, arg2, arg3
+//     uint32   thread number
+//     4 x (uint16 length, char[length]) for what, label1, label2, label3
+{
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    char buffer[1024];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64 header[2] = { ts.tv_sec * 1000000000ULL + ts.tv_nsec, Now() };
+    memcpy(buffer, "ELIOTFR1", 8);
+    memcpy(buffer + 8, header, sizeof header);
+    Write(fd, buffer, 8 + sizeof header);
+
+    Start();
+    while (Entry *e = Next())
+    {
+        uint64 values[5] = { e->timestamp, (uint64) (uintptr_t) e->caller,
+                             (uint64) e->arg1, (uint64) e->arg2,
+                             (uint64) e->arg3 };
+        uint32 thread = e->thread;
+        size_t size = sizeof values + sizeof thread;
+        memcpy(buffer, values, sizeof values);
+        memcpy(buffer + sizeof values, &thread, sizeof thread);
+        kstring texts[4] = { e->what, e->label1, e->label2, e->label3 };
+        for (uint t = 0; t < 4; t++)
+            size += ExportText(buffer + size, (sizeof buffer - size) / (4 - t),
+                               texts[t]);
+        Write(fd, buffer, size);
+    }
+
+    close(fd);
+    return true;
+}
+
+
+
+// ============================================================================
+//
+//    Histograms
+//
+// ============================================================================
+
+FlightHistogram::FlightHistogram(kstring what, kstring unit)
+// ----------------------------------------------------------------------------
+//   Create an empty histogram and link it with the others
+// ----------------------------------------------------------------------------
+    : what(what), unit(unit), count(0), total(0), max(0), next(histograms)
+{
+    for (uint b = 0; b < BUCKETS; b++)
+        buckets[b] = 0;
+    histograms = this;
+}
+
+
+void FlightHistogram::Add(ulong value)
+// ----------------------------------------------------------------------------
+//   Record a value in the right bucket
+// ----------------------------------------------------------------------------
+{
+    uint b = 0;
+    while (b < BUCKETS - 1 && (value >> b))
+        b++;
+    buckets[b]++;
+    count++;
+    total += value;
+    if (max < value)
+        max = value;
+}
+
+
+void FlightHistogram::Dump(int fd)
+// ----------------------------------------------------------------------------
+//   Show the histogram, one line per non-empty bucket
+// ----------------------------------------------------------------------------
+{
+    static char buffer[512];
+    size_t size = snprintf(buffer, sizeof buffer,
+                           "HISTOGRAM %s: %lu values, average %lu%s, "
+                           "max %lu%s\n",
+                           what, count, total / count, unit, max, unit);
+    Write(fd, buffer, size);
+
+    for (uint b = 0; b < BUCKETS; b++)
+    {
+        if (!buckets[b])
+            continue;
+        size = snprintf(buffer, sizeof buffer,
+                        "  %s%8lu%s: %10lu %5.1f%%\n",
+                        b < BUCKETS - 1 ? "<" : ">=",
+                        b < BUCKETS - 1 ? 1UL << b : 1UL << (b - 1), unit,
+                        buckets[b], 100.0 * buckets[b] / count);
+        Write(fd, buffer, size);
+    }
+}
+
+
+FlightHistogram *FlightHistogram::histograms = NULL;
+
+
+FlightRecorder *                FlightRecorder::recorder = NULL;
+__thread FlightRecorder::Ring * FlightRecorder::current  = NULL;
+ulong                           FlightRecorder::enabled  =
+    REC_ALWAYS|REC_CRITICAL|REC_DEBUG;
 
 ELIOT_END
 
@@ -124,3 +392,12 @@ void recorder_dump()
 {
     ELIOT::FlightRecorder::SDump(2);
 }
+
+
+void recorder_export(const char *file)
+// ----------------------------------------------------------------------------
+//   Export the recorder to a binary file (for use in the debugger)
+// ----------------------------------------------------------------------------
+{
+    ELIOT::FlightRecorder::SExport(file);
+}
@@ -40,6 +40,7 @@
 // ****************************************************************************
 
 #include "base.h"
+#include "atomic.h"
 #include <vector>
 
 ELIOT_BEGIN
@@ -79,6 +80,8 @@ struct FlightRecorder
 // ----------------------------------------------------------------------------
 //    Record events 
 // ----------------------------------------------------------------------------
+//    Each thread records in its own ring, so that Record() needs no lock.
+//    Entries are time-stamped, and Dump() merges the rings in time order.
 {
     struct Entry
     {
@@ -86,17 +89,39 @@ struct FlightRecorder
               kstring l1="", intptr_t a1=0,
               kstring l2="", intptr_t a2=0,
               kstring l3="", intptr_t a3=0):
+            timestamp(0), thread(0),
             what(what), caller(caller),
             label1(l1), label2(l2), label3(l3),
             arg1(a1), arg2(a2), arg3(a3) {}
+        ulonglong timestamp;            // CLOCK_MONOTONIC, in nanoseconds
+        uint     thread;
         kstring  what;
         void *   caller;
         kstring  label1, label2, label3;
         intptr_t arg1, arg2, arg3;
     };
 
-    FlightRecorder(uint size=4096) : windex(0), rindex(0),
-                                     records(size) {}
+    struct Ring
+    // ------------------------------------------------------------------------
+    //   The entries recorded by one thread
+    // ------------------------------------------------------------------------
+    //   Only the owning thread writes in a ring. Rings are never freed:
+    //   when a thread exits, its ring is kept for dumps and reused by
+    //   the next thread that starts recording.
+    {
+        Ring(uint size): windex(0), rindex(0), dindex(0), dlimit(0), thread(0),
+                         owned(0), records(size), next(NULL) {}
+        volatile uint      windex;
+        uint               rindex;
+        uint               dindex;      // Cursors while merging in Dump()
+        uint               dlimit;
+        uint               thread;
+        Atomic<uint>       owned;
+        std::vector<Entry> records;
+        Ring *             next;
+    };
+
+    FlightRecorder(uint size=4096) : size(size), threads(0), rings(NULL) {}
 
 public:
     // Interface for a given recorder
@@ -105,7 +130,13 @@ public:
                  kstring l2="", intptr_t a2=0,
                  kstring l3="", intptr_t a3=0)
     {
-        Entry &e = records[windex++ % records.size()];
+        Ring *ring = current;
+        if (!ring)
+            ring = Acquire();
+        uint windex = ring->windex;
+        Entry &e = ring->records[windex % ring->records.size()];
+        e.timestamp = Now();
+        e.thread = ring->thread;
         e.what = what;
         e.caller = caller;
         e.label1 = l1;
@@ -114,11 +145,22 @@ public:
         e.arg2 = a2;
         e.label3 = l3;
         e.arg3 = a3;
+        ring->windex = windex + 1;
         return enabled;
     }
 
     void Dump(int fd, bool consume = false);
-    void Resize(uint size) { records.resize(size); }
+    bool Export(kstring file);
+    void Resize(uint size);
+
+    static ulonglong Now();
+
+    static void Release(void *ring);
+
+private:
+    Ring *      Acquire();
+    uint        Start();
+    Entry *     Next();
 
 public:
     // Static interface
@@ -132,17 +174,43 @@ public:
         return recorder->Record(what, caller, l1, a1, l2, a2, l3, a3);
     }
     static void SDump(int fd, bool kill=false) { recorder->Dump(fd,kill); }
+    static bool SExport(kstring file) { return recorder->Export(file); }
     static void SResize(uint size) { recorder->Resize(size); }
     static void SFlags(ulong en) { enabled = en | REC_ALWAYS; }
 
 public:
-    uint               windex, rindex;
-    std::vector<Entry> records;
+    uint                size;           // Size of rings created from now on
+    Atomic<uint>        threads;
+    Atomic<Ring *>      rings;
 
     static ulong            enabled;
 
 private:
     static FlightRecorder * recorder;
+    static __thread Ring *  current;
+};
+
+
+struct FlightHistogram
+// ----------------------------------------------------------------------------
+//   Power-of-two histogram of values, shown in flight recorder dumps
+// ----------------------------------------------------------------------------
+//   Histograms are meant to be static objects. Bucket 'b' counts values
+//   below 2^b that do not fit in the previous bucket.
+{
+    enum { BUCKETS = 24 };
+
+    FlightHistogram(kstring what, kstring unit);
+    void                Add(ulong value);
+    void                Dump(int fd);
+
+public:
+    kstring             what, unit;
+    ulong               count, total, max;
+    ulong               buckets[BUCKETS];
+    FlightHistogram *   next;
+
+    static FlightHistogram *histograms;
 };
 
 
@@ -157,5 +225,6 @@ ELIOT_END
 
 // For use within a debugger session
 extern void recorder_dump();
+extern void recorder_export(const char *file);
 
 #endif // FLIGHT_RECORDER_H
@@ -48,6 +48,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <pthread.h>
+#include <time.h>
 
 #ifdef CONFIG_MINGW // Windows: When getting in the way becomes an art form...
 #include <malloc.h>
@@ -72,19 +73,73 @@ Atomic<uint> TypeAllocator::finalizing = 0;
 #define PTHREAD_NULL ((pthread_t) 0)
 static pthread_t collecting = PTHREAD_NULL;
 
+// Per-thread free lists, indexed by allocator, flushed when the thread exits
+typedef TypeAllocator::ThreadCache ThreadCache;
+static __thread ThreadCache thread_caches[TypeAllocator::CACHE_SLOTS];
+static __thread bool        thread_caches_registered = false;
+static pthread_key_t        thread_caches_key;
+static pthread_once_t       thread_caches_once = PTHREAD_ONCE_INIT;
+
+// Number of objects allocated by each thread, e.g. for rewrite statistics
+static __thread ulong       thread_allocations = 0;
+
+
+static void thread_caches_create_key()
+// ----------------------------------------------------------------------------
+//   Create the key used to flush thread caches when a thread exits
+// ----------------------------------------------------------------------------
+{
+    pthread_key_create(&thread_caches_key, TypeAllocator::FlushThreadCaches);
+}
+
+
+GCBudget::GCBudget(uint items, uint micros)
+// ----------------------------------------------------------------------------
+//   Create a budget, where zero means no limit
+// ----------------------------------------------------------------------------
+    : items(items ? items : ~0U), ticks(0),
+      deadline(micros ? Now() + micros : 0)
+{}
+
+
+ulonglong GCBudget::Now()
+// ----------------------------------------------------------------------------
+//   Return the current time in microseconds
+// ----------------------------------------------------------------------------
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+bool GCBudget::CheckTime()
+// ----------------------------------------------------------------------------
+//   Exhaust the budget once we are past the deadline
+// ----------------------------------------------------------------------------
+{
+    if (Now() >= deadline)
+        items = 0;
+    return true;
+}
+
 
 TypeAllocator::TypeAllocator(kstring tn, uint os)
 // ----------------------------------------------------------------------------
 //    Setup an empty allocator
 // ----------------------------------------------------------------------------
-    : gc(NULL), name(tn), locked(0), lowestInUse(~0UL), highestInUse(0),
+    : gc(NULL), name(tn), cacheIndex(~0U), threadCaches(),
+      locked(0), lowestInUse(~0UL), highestInUse(0),
       chunks(), freeList(NULL), toDelete(NULL),
       available(0), freedCount(0),
+      scanning(false), scanChunk(0), scanLow(NULL), scanHigh(NULL),
+      scanNext(NULL), scanEnd(NULL), scanCollected(0),
       chunkSize(1022), objectSize(os), alignedSize(os),
       allocatedCount(0), scannedCount(0), collectedCount(0), totalCount(0)
 {
     RECORD(MEMORY, "New type allocator",
            tn, os, "this", (intptr_t) this);
+    pthread_mutex_init(&threadCachesLock, NULL);
 
     // Make sure we align everything on Chunk boundaries
     if ((alignedSize + sizeof (Chunk)) & CHUNKALIGN_MASK)
@@ -124,6 +179,16 @@ TypeAllocator::~TypeAllocator()
 
     VALGRIND_DESTROY_MEMPOOL(this);
 
+    // Forget what any thread cached, it points into the chunks we free
+    pthread_mutex_lock(&threadCachesLock);
+    for (ThreadCaches::iterator c = threadCaches.begin();
+         c != threadCaches.end(); c++)
+        if ((*c)->owner == this)
+            (*c)->owner = NULL;
+    threadCaches.clear();
+    pthread_mutex_unlock(&threadCachesLock);
+    pthread_mutex_destroy(&threadCachesLock);
+
     for (Chunks::iterator c = chunks.begin(); c != chunks.end(); c++)
         free((void *) *c);
 }
@@ -133,77 +198,39 @@ void *TypeAllocator::Allocate()
 // ----------------------------------------------------------------------------
 //   Allocate a chunk of the given size
 // ----------------------------------------------------------------------------
+//   Items come from a per-thread cache when the allocator has one, which is
+//   refilled in batches from the shared free list. Only allocators past the
+//   last cache slot take items from the shared list one at a time.
 {
     RECORD(MEMORY_DETAILS, "Allocate", "free", (intptr_t) freeList.Get());
 
     Chunk_vp result;
-    do
+    if (ThreadCache *cache = Cache())
     {
-        result = freeList;
-        while (!result)
+        result = cache->free;
+        if (!result)
         {
-            // Make sure only one thread allocates chunks
-            uint wasLocked = locked++;
-            if (wasLocked)
-            {
-                locked--;
-                result = freeList;
-                continue;
-            }
-        
-            // Nothing free: allocate a big enough chunk
-            size_t  itemSize  = alignedSize + sizeof(Chunk);
-            size_t  allocSize = (chunkSize + 1) * itemSize;
-
-            void   *allocated = malloc(allocSize);
-            (void)VALGRIND_MAKE_MEM_NOACCESS(allocated, allocSize);
-
-            RECORD(MEMORY_DETAILS, "New Chunk", "addr", (intptr_t) allocated);
-
-            char *chunkBase = (char *) allocated + alignedSize;
-            Chunk_vp last = (Chunk_vp) chunkBase;
-            Chunk_vp free = result;
-            for (uint i = 0; i < chunkSize; i++)
-            {
-                Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
-                VALGRIND_MAKE_MEM_UNDEFINED(&ptr->next,sizeof(ptr->next));
-                ptr->next = free;
-                free = ptr;
-            }
-
-            // Update the chunks list
-            chunks.push_back((Chunk *) allocated);
-            available += chunkSize;
-            if (lowestAddress > allocated)
-                lowestAddress = allocated;
-            char *highMark = (char *) allocated + (chunkSize+1) * itemSize;
-            if (highestAddress < (void *) highMark)
-                highestAddress = highMark;
-
-            // Update the freelist
-            while (!freeList.SetQ(result, free))
-            {
-                result = freeList;
-                last->next = result;
-            }
-
-            // Unlock the chunks
-            --locked;
-
-            // Read back the free list
-            result = freeList;
+            Account(cache);
+            result = Take(CACHE_BATCH, cache->count);
         }
+        cache->free = result->next;
+        cache->count--;
+        cache->allocated++;
     }
-    while (!freeList.SetQ(result, result->next));
+    else
+    {
+        uint count = 0;
+        result = Take(1, count);
+        allocatedCount++;
+    }
+
+    thread_allocations++;
 
     VALGRIND_MAKE_MEM_UNDEFINED(result, sizeof(Chunk));
     result->allocator = this;
     result->bits |= IN_USE;     // Mark it as in use for current collection
     result->count = 0;
     UpdateInUseRange(result);
-    allocatedCount++;
-    if (--available < chunkSize * 0.9)
-        gc->MustRun();
 
     void *ret =  (void *) &result[1];
     VALGRIND_MEMPOOL_ALLOC(this, ret, objectSize);
@@ -229,15 +256,6 @@ void TypeAllocator::Delete(void *ptr)
     ELIOT_ASSERT(!chunk->count &&
                  "Deleted pointer has live references");
 
-    // Put the pointer back on the free list
-    do
-    {
-        chunk->next = freeList;
-    }
-    while (!freeList.SetQ(chunk->next, chunk));
-    available++;
-    freedCount++;
-
 #ifdef DEBUG
     // Scrub all the pointers
     uint32 *base = (uint32 *) ptr;
@@ -248,6 +266,215 @@ void TypeAllocator::Delete(void *ptr)
 #endif
 
     VALGRIND_MEMPOOL_FREE(this, ptr);
+
+    // Put the pointer back on this thread's free list, return a batch
+    // to the shared list when this thread frees more than it allocates
+    if (ThreadCache *cache = Cache())
+    {
+        chunk->next = cache->free;
+        cache->free = chunk;
+        cache->freed++;
+        if (++cache->count >= 2 * CACHE_BATCH)
+            Flush(cache, CACHE_BATCH);
+    }
+    else
+    {
+        Give(chunk, chunk, 1);
+        freedCount++;
+    }
+}
+
+
+TypeAllocator::ThreadCache *TypeAllocator::Cache()
+// ----------------------------------------------------------------------------
+//   Return the cache for the current thread, or NULL if there is no slot
+// ----------------------------------------------------------------------------
+{
+    if (cacheIndex >= CACHE_SLOTS)
+        return NULL;
+
+    ThreadCache *cache = &thread_caches[cacheIndex];
+    if (cache->owner != this)
+    {
+        // First use in this thread, or slot left by a deleted allocator
+        cache->owner = this;
+        cache->free = NULL;
+        cache->count = 0;
+        cache->allocated = 0;
+        cache->freed = 0;
+
+        // Record the cache so that our destructor can detach it
+        pthread_mutex_lock(&threadCachesLock);
+        threadCaches.insert(cache);
+        pthread_mutex_unlock(&threadCachesLock);
+
+        // Make sure we give the items back when the thread exits
+        if (!thread_caches_registered)
+        {
+            pthread_once(&thread_caches_once, thread_caches_create_key);
+            pthread_setspecific(thread_caches_key, thread_caches);
+            thread_caches_registered = true;
+        }
+    }
+    return cache;
+}
+
+
+TypeAllocator::Chunk_vp TypeAllocator::Take(uint wanted, uint &count)
+// ----------------------------------------------------------------------------
+//   Take up to 'wanted' items from the shared free list, growing it if empty
+// ----------------------------------------------------------------------------
+//   Only one thread takes items at a time, so that the items we walk through
+//   cannot be popped by another thread. Pushes in Give remain lock-free.
+{
+    while (locked++)
+        locked--;
+
+    Chunk_vp result = freeList;
+    if (!result)
+    {
+        // Nothing free: allocate a big enough chunk
+        size_t  itemSize  = alignedSize + sizeof(Chunk);
+        size_t  allocSize = (chunkSize + 1) * itemSize;
+
+        void   *allocated = malloc(allocSize);
+        (void)VALGRIND_MAKE_MEM_NOACCESS(allocated, allocSize);
+
+        RECORD(MEMORY_DETAILS, "New Chunk", "addr", (intptr_t) allocated);
+
+        char *chunkBase = (char *) allocated + alignedSize;
+        Chunk_vp last = (Chunk_vp) chunkBase;
+        Chunk_vp free = NULL;
+        for (uint i = 0; i < chunkSize; i++)
+        {
+            Chunk_vp ptr = (Chunk_vp) (chunkBase + i * itemSize);
+            VALGRIND_MAKE_MEM_UNDEFINED(&ptr->next,sizeof(ptr->next));
+            ptr->next = free;
+            free = ptr;
+        }
+
+        // Update the chunks list
+        chunks.push_back((Chunk *) allocated);
+        if (lowestAddress > allocated)
+            lowestAddress = allocated;
+        char *highMark = (char *) allocated + (chunkSize+1) * itemSize;
+        if (highestAddress < (void *) highMark)
+            highestAddress = highMark;
+
+        Give(free, last, chunkSize);
+    }
+
+    // Detach the first 'wanted' items from the shared list
+    Chunk_vp last;
+    do
+    {
+        result = freeList;
+        last = result;
+        count = 1;
+        while (count < wanted && last->next)
+        {
+            last = last->next;
+            count++;
+        }
+    }
+    while (!freeList.SetQ(result, last->next));
+    last->next = NULL;
+
+    --locked;
+
+    available -= count;
+    if (available < chunkSize * 0.9)
+        gc->MustRun();
+    return result;
+}
+
+
+void TypeAllocator::Give(Chunk_vp first, Chunk_vp last, uint count)
+// ----------------------------------------------------------------------------
+//   Put a list of items back on the shared free list
+// ----------------------------------------------------------------------------
+{
+    do
+    {
+        last->next = freeList;
+    }
+    while (!freeList.SetQ(last->next, first));
+    available += count;
+}
+
+
+void TypeAllocator::Flush(ThreadCache *cache, uint count)
+// ----------------------------------------------------------------------------
+//   Return 'count' items from a thread cache to the shared free list
+// ----------------------------------------------------------------------------
+{
+    Account(cache);
+    if (!count)
+        return;
+
+    Chunk_vp first = cache->free;
+    Chunk_vp last = first;
+    for (uint i = 1; i < count; i++)
+        last = last->next;
+    cache->free = last->next;
+    cache->count -= count;
+    Give(first, last, count);
+}
+
+
+void TypeAllocator::Account(ThreadCache *cache)
+// ----------------------------------------------------------------------------
+//   Report the statistics kept in a thread cache to the allocator
+// ----------------------------------------------------------------------------
+{
+    allocatedCount += cache->allocated;
+    freedCount += cache->freed;
+    cache->allocated = 0;
+    cache->freed = 0;
+}
+
+
+void TypeAllocator::Detach(ThreadCache *cache)
+// ----------------------------------------------------------------------------
+//   Forget a thread cache, e.g. when its thread exits
+// ----------------------------------------------------------------------------
+{
+    pthread_mutex_lock(&threadCachesLock);
+    threadCaches.erase(cache);
+    cache->owner = NULL;
+    pthread_mutex_unlock(&threadCachesLock);
+}
+
+
+ulong TypeAllocator::ThreadAllocations()
+// ----------------------------------------------------------------------------
+//   Return the number of objects allocated so far by the current thread
+// ----------------------------------------------------------------------------
+{
+    return thread_allocations;
+}
+
+
+void TypeAllocator::FlushThreadCaches(void *caches)
+// ----------------------------------------------------------------------------
+//   Give back all items cached by a thread, by default the current one
+// ----------------------------------------------------------------------------
+//   This is also the destructor for the thread-specific key, so that
+//   items cached by worker threads are not lost when they exit
+{
+    ThreadCache *cache = caches ? (ThreadCache *) caches : thread_caches;
+    for (uint slot = 0; slot < CACHE_SLOTS; slot++, cache++)
+    {
+        if (TypeAllocator *owner = cache->owner)
+        {
+            owner->Flush(cache, cache->count);
+            owner->Detach(cache);
+        }
+    }
+
+    // If the exiting thread allocates again, register the caches again
+    if (caches)
+        thread_caches_registered = false;
 }
 
 
@@ -296,6 +523,20 @@ bool TypeAllocator::CheckLeakedPointers()
 // ----------------------------------------------------------------------------
 //   Check if any pointers were allocated and not captured between safe points
 // ----------------------------------------------------------------------------
+{
+    GCBudget unlimited;
+    BeginScan();
+    ScanLeakedPointers(unlimited);
+    return scanCollected;
+}
+
+
+void TypeAllocator::BeginScan()
+// ----------------------------------------------------------------------------
+//   Take the range of items in use, to be scanned in one or several steps
+// ----------------------------------------------------------------------------
+//   Items marked in use after this point go in the next range. Scanning them
+//   at a later safe point is fine, since the rule holds at every safe point.
 {
     RECORD(MEMORY_DETAILS, "CheckLeaks");
 
@@ -305,65 +546,93 @@ bool TypeAllocator::CheckLeakedPointers()
     lowestInUse.Set((uintptr_t) lo, ~0UL);
     highestInUse.Set((uintptr_t) hi, 0UL);
 
-    uint  collected = 0;
+    scanning = true;
+    scanChunk = 0;
+    scanLow = lo;
+    scanHigh = hi;
+    scanNext = NULL;
+    scanEnd = NULL;
+    scanCollected = 0;
     totalCount = 0;
-    for (Chunks::iterator chk = chunks.begin(); chk != chunks.end(); chk++)
+}
+
+
+bool TypeAllocator::ScanLeakedPointers(GCBudget &budget)
+// ----------------------------------------------------------------------------
+//   Scan the range taken by BeginScan, return true once it is complete
+// ----------------------------------------------------------------------------
+{
+    size_t itemSize = alignedSize + sizeof(Chunk);
+    char  *lo = scanLow;
+    char  *hi = scanHigh;
+
+    while (scanChunk < chunks.size())
     {
-        char   *chunkBase = (char *) *chk + alignedSize;
-        size_t  itemSize  = alignedSize + sizeof(Chunk);
-        char   *chunkEnd = chunkBase + itemSize * chunkSize;
-        totalCount += chunkSize;
-        
-        if (chunkBase <= hi && chunkEnd  >= lo)
+        if (!scanNext)
+        {
+            char *chunkBase = (char *) chunks[scanChunk] + alignedSize;
+            char *chunkEnd = chunkBase + itemSize * chunkSize;
+            totalCount += chunkSize;
+            if (chunkBase > hi || chunkEnd < lo)
+            {
+                scanChunk++;
+                continue;
+            }
+
+            scanNext = chunkBase < lo ? lo : chunkBase;
+            scanEnd = chunkEnd > hi ? hi : chunkEnd;
+            if (scanNext < scanEnd)
+                scannedCount += (scanEnd - scanNext) / itemSize;
+        }
+
+        while (scanNext < scanEnd)
         {
-            char *start = (char *) chunkBase;
-            char *end = (char *) chunkEnd;
-            if (start < lo)
-                start = lo;
-            if (end > hi)
-                end = hi;
-            scannedCount += (end - start) / itemSize;
-
-            for (char *addr = start; addr < end; addr += itemSize)
+            if (!budget.Spend())
+                return false;
+
+            Chunk_vp ptr = (Chunk_vp) scanNext;
+            scanNext += itemSize;
+            if (AllocatorPointer(ptr->allocator) == this)
             {
-                Chunk_vp ptr = (Chunk_vp) addr;
-                if (AllocatorPointer(ptr->allocator) == this)
+                Atomic<uintptr_t>::And(ptr->bits, ~(uintptr_t) IN_USE);
+                if (!ptr->count)
                 {
-                    Atomic<uintptr_t>::And(ptr->bits, ~(uintptr_t) IN_USE);
-                    if (!ptr->count)
-                    {
-                        // It is dead, Jim
-                        Finalize((void *) (ptr+1));
-                        collected++;
-                    }
+                    // It is dead, Jim
+                    Finalize((void *) (ptr+1));
+                    scanCollected++;
                 }
             }
         }
+        scanNext = NULL;
+        scanChunk++;
     }
 
-    collectedCount += collected;
+    scanning = false;
+    collectedCount += scanCollected;
     RECORD(MEMORY_DETAILS, "CheckLeaks done",
-           "scanned", scannedCount, "collect", collected);
-    return collected;
+           "scanned", scannedCount, "collect", scanCollected);
+    return true;
 }
 
 
-bool TypeAllocator::Sweep()
+bool TypeAllocator::Sweep(GCBudget &budget)
 // ----------------------------------------------------------------------------
-//    Remove all the things that we have pushed on the toDelete list
+//    Remove things on the toDelete list within budget, true if none are left
 // ----------------------------------------------------------------------------
+//    Finalizing an object only puts its children on the toDelete lists,
+//    so a deep tree is released over as many steps as necessary
 {
     RECORD(MEMORY_DETAILS, "Sweep");
 
-    bool result = false;
     while (toDelete)
     {
+        if (!budget.Spend())
+            return false;
         Chunk_vp next = LinkedListPopFront(toDelete);
         next->allocator = this;
         Finalize((void *) (next+1));
-        result = true;
     }
-    return result;
+    return true;
 }
 
 
@@ -430,6 +699,97 @@ bool TypeAllocator::CanDelete(void *obj)
 
 
 
+// ============================================================================
+//
+//    Payload allocator
+//
+// ============================================================================
+
+PayloadAllocator *PayloadAllocator::classes[PayloadAllocator::CLASSES];
+Atomic<uint>      PayloadAllocator::largeCount = 0;
+Atomic<ulong>     PayloadAllocator::largeBytes = 0;
+
+
+PayloadAllocator *PayloadAllocator::SizeClass(size_t size)
+// ----------------------------------------------------------------------------
+//   Return the allocator for the smallest class holding 'size' bytes
+// ----------------------------------------------------------------------------
+{
+    static kstring names[CLASSES] =
+    {
+        "Payload32", "Payload64", "Payload128", "Payload256", "Payload512"
+    };
+
+    uint index = 0;
+    size_t classSize = MIN_SIZE;
+    while (classSize < size)
+    {
+        if (++index >= CLASSES)
+            return NULL;
+        classSize <<= 1;
+    }
+
+    if (!classes[index])
+        classes[index] = new PayloadAllocator(names[index], classSize);
+    return classes[index];
+}
+
+
+void *PayloadAllocator::Allocate(size_t size)
+// ----------------------------------------------------------------------------
+//   Allocate a payload from its size class, or from malloc if too large
+// ----------------------------------------------------------------------------
+{
+    if (PayloadAllocator *allocator = SizeClass(size))
+    {
+        void *result = allocator->TypeAllocator::Allocate();
+        Acquire(result);        // Owned until Delete, not by the collector
+        return result;
+    }
+
+    void *result = malloc(size);
+    if (!result)
+        throw std::bad_alloc();
+    largeCount++;
+    largeBytes += size;
+    return result;
+}
+
+
+void PayloadAllocator::Delete(void *ptr, size_t size)
+// ----------------------------------------------------------------------------
+//   Return a payload to its size class
+// ----------------------------------------------------------------------------
+//   Payloads freed after the collector is gone, e.g. by static destructors,
+//   were already released with the chunks holding them.
+{
+    if (size > (MIN_SIZE << (CLASSES - 1)))
+    {
+        largeCount--;
+        largeBytes -= size;
+        free(ptr);
+        return;
+    }
+
+    if (!IsGarbageCollected(ptr))
+        return;
+    Chunk_vp chunk = (Chunk_vp) ptr - 1;
+    chunk->count = 0;
+    ValidPointer(chunk->allocator)->TypeAllocator::Delete(ptr);
+}
+
+
+void PayloadAllocator::PrintStatistics()
+// ----------------------------------------------------------------------------
+//   Print the payloads that did not fit in any size class
+// ----------------------------------------------------------------------------
+{
+    printf("%24s %8u %7luK\n", "Large payloads",
+           largeCount.Get(), largeBytes.Get() >> 10);
+}
+
+
+
 // ============================================================================
 //
 //   Garbage Collector class
@@ -440,7 +800,8 @@ GarbageCollector::GarbageCollector()
 // ----------------------------------------------------------------------------
 //   Create the garbage collector
 // ----------------------------------------------------------------------------
-    : mustRun(false), running(false)
+    : mustRun(false), running(false),
+      phase(IDLE), scanIndex(0), swept(false), budgetItems(0), budgetMicros(0)
 {}
 
 
@@ -471,27 +832,56 @@ void GarbageCollector::Register(TypeAllocator *allocator)
 //    Record each individual allocator
 // ----------------------------------------------------------------------------
 {
+    allocator->cacheIndex = allocators.size();
     allocators.push_back(allocator);
 }
 
 
 bool GarbageCollector::Sweep()
 // ----------------------------------------------------------------------------
-//    Cleanup all the pending deletions
+//    Cleanup pending deletions, leave the rest to the next safe point
 // ----------------------------------------------------------------------------
+//    Without a budget, this cleans up everything, however deep the cascade
 {
+    GCBudget budget(gc->budgetItems, gc->budgetMicros);
     bool purging = false;
     Allocators &allocators = gc->allocators;
     for (Allocators::iterator a=allocators.begin(); a!=allocators.end(); a++)
-        purging |= (*a)->Sweep();
+    {
+        if ((*a)->toDelete)
+        {
+            purging = true;
+            if (!(*a)->Sweep(budget))
+            {
+                MustRun();
+                break;
+            }
+        }
+    }
     return purging;
 }
 
 
+void GarbageCollector::Budget(uint items, uint micros)
+// ----------------------------------------------------------------------------
+//    Limit the work done at each safe point, zero meaning no limit
+// ----------------------------------------------------------------------------
+{
+    gc->budgetItems = items;
+    gc->budgetMicros = micros;
+}
+
+
+// Time spent in each collection step
+static FlightHistogram gc_pauses("GC pause", "us");
+
+
 bool GarbageCollector::Collect()
 // ----------------------------------------------------------------------------
-//   Run garbage collection on all the allocators we own
+//   Run one step of garbage collection on all the allocators we own
 // ----------------------------------------------------------------------------
+//   Without a budget, the first step completes the collection. Otherwise,
+//   the collection resumes where it stopped at the next safe points.
 {
     pthread_t self = pthread_self();
 
@@ -499,47 +889,45 @@ bool GarbageCollector::Collect()
     // Only one thread enters collecting, the others spin and wait
     if (Atomic<pthread_t>::SetQ(collecting, PTHREAD_NULL, self))
     {
-        RECORD(MEMORY, "Garbage collection", "self", (intptr_t) self);
-
-        Allocators::iterator a;
-        Listeners listeners;
-        Listeners::iterator l;
+        ulonglong start = GCBudget::Now();
+        GCBudget budget(budgetItems, budgetMicros);
 
-        // Build the listeners from all allocators
-        for (a = allocators.begin(); a != allocators.end(); a++)
-            for (l = (*a)->listeners.begin(); l != (*a)->listeners.end(); l++)
-                listeners.insert(*l);
+        RECORD(MEMORY, "Garbage collection",
+               "self", (intptr_t) self, "phase", phase);
 
         // Notify all the listeners that we begin a collection
-        for (l = listeners.begin(); l != listeners.end(); l++)
-            (*l)->BeginCollection();
-
-        // Cleanup pending purges to maximize the effect of garbage collection
-        bool sweeping = true;
-        while (sweeping)
+        if (phase == IDLE)
         {
-            // Check if any object was allocated and not captured at this stage
-            for (a = allocators.begin(); a != allocators.end(); a++)
-                (*a)->CheckLeakedPointers();
-            sweeping = Sweep();
+            Notify(true);
+            phase = SCANNING;
+            scanIndex = 0;
+            swept = false;
         }
 
-        // Notify all the listeners that we completed the collection
-        for (l = listeners.begin(); l != listeners.end(); l++)
-            (*l)->EndCollection();
+        bool done = Step(budget);
+        if (done)
+        {
+            // Notify all the listeners that we completed the collection
+            Notify(false);
+            phase = IDLE;
 
-        // Print statistics (inside lock, to increase race pressure)
-        IFTRACE(memory)
-            PrintStatistics();
+            // Print statistics (inside lock, to increase race pressure)
+            IFTRACE(memory)
+                PrintStatistics();
+
+            // We are done, mark it so
+            mustRun &= 0U;
+        }
+
+        ulonglong pause = GCBudget::Now() - start;
+        gc_pauses.Add(pause);
 
-        // We are done, mark it so
-        mustRun &= 0U;
         if (!Atomic<pthread_t>::SetQ(collecting, self, PTHREAD_NULL))
         {
             ELIOT_ASSERT(!"Someone else stole the collection lock?");
         }
 
-        RECORD(MEMORY, "Garbage collection", "self", (intptr_t) self);
+        RECORD(MEMORY, "GC pause", "us", pause, "done", done);
 
         return true;
     }
@@ -547,6 +935,79 @@ bool GarbageCollector::Collect()
 }
 
 
+bool GarbageCollector::Step(GCBudget &budget)
+// ----------------------------------------------------------------------------
+//   Scan and sweep within budget, return true when the collection is complete
+// ----------------------------------------------------------------------------
+{
+    for (;;)
+    {
+        if (phase == SCANNING)
+        {
+            // Check if any object was allocated and not captured at this stage
+            while (scanIndex < allocators.size())
+            {
+                TypeAllocator *allocator = allocators[scanIndex];
+                if (!allocator->scanning)
+                    allocator->BeginScan();
+                if (!allocator->ScanLeakedPointers(budget))
+                    return false;
+                scanIndex++;
+            }
+            phase = SWEEPING;
+            swept = false;
+        }
+
+        // Cleanup pending purges to maximize the effect of garbage collection
+        bool pending = true;
+        while (pending)
+        {
+            pending = false;
+            Allocators::iterator a;
+            for (a = allocators.begin(); a != allocators.end(); a++)
+            {
+                if ((*a)->toDelete)
+                {
+                    pending = swept = true;
+                    if (!(*a)->Sweep(budget))
+                        return false;
+                }
+            }
+        }
+
+        // If we purged something, scan again for what it released
+        if (!swept)
+            return true;
+        phase = SCANNING;
+        scanIndex = 0;
+    }
+}
+
+
+void GarbageCollector::Notify(bool begin)
+// ----------------------------------------------------------------------------
+//   Notify the listeners of all allocators that a collection begins or ends
+// ----------------------------------------------------------------------------
+{
+    Allocators::iterator a;
+    Listeners listeners;
+    Listeners::iterator l;
+
+    // Build the listeners from all allocators
+    for (a = allocators.begin(); a != allocators.end(); a++)
+        for (l = (*a)->listeners.begin(); l != (*a)->listeners.end(); l++)
+            listeners.insert(*l);
+
+    for (l = listeners.begin(); l != listeners.end(); l++)
+    {
+        if (begin)
+            (*l)->BeginCollection();
+        else
+            (*l)->EndCollection();
+    }
+}
+
+
 void GarbageCollector::PrintStatistics()
 // ----------------------------------------------------------------------------
 //    Print statistics about collection
@@ -579,6 +1040,9 @@ void GarbageCollector::PrintStatistics()
            "Kilobytes",
            tot >> 10, avail >> 10, alloc >> 10,
            freed >> 10, scan >> 10, collect >> 10);
+
+    // Payloads too large for the size classes listed above
+    PayloadAllocator::PrintStatistics();
 }
 
 
@@ -719,6 +1183,25 @@ void debuggc(void *ptr)
                         prev = f;
                     }
 
+                    freeIndex = 0;
+                    prev = NULL;
+                    if (alloc->cacheIndex < TA::CACHE_SLOTS &&
+                        thread_caches[alloc->cacheIndex].owner == alloc)
+                    {
+                        ThreadCache &cache = thread_caches[alloc->cacheIndex];
+                        for (Chunk_vp f = cache.free; f; f = f->next)
+                        {
+                            freeIndex++;
+                            if (f == chunk)
+                            {
+                                std::cerr << " thread cache #" << freeIndex
+                                          << " after " << prev << " ";
+                                found++;
+                            }
+                            prev = f;
+                        }
+                    }
+
                     freeIndex = 0;
                     prev = NULL;
                     for (Chunk_vp f = alloc->toDelete; f; f = f->next)
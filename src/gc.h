@@ -49,6 +49,8 @@
 #include <set>
 #include <stdint.h>
 #include <typeinfo>
+#include <new>
+#include <pthread.h>
 
 extern void debuggc(void *);
 
@@ -59,6 +61,49 @@ template <class Object, typename ValueType=void> struct GCPtr;
 
 
 
+// ****************************************************************************
+//
+//   Collection budget - Bound the work done at a safe point
+//
+// ****************************************************************************
+
+struct GCBudget
+// ----------------------------------------------------------------------------
+//   Amount of work one collection step may do before returning
+// ----------------------------------------------------------------------------
+//   Each item scanned or finalized spends one unit. A budget in microseconds
+//   is checked every few items, since reading the clock is not free.
+{
+    GCBudget(uint items = 0, uint micros = 0);
+
+    bool                Spend();
+    bool                Exhausted()             { return items == 0; }
+    static ulonglong    Now();
+
+private:
+    bool                CheckTime();
+
+    uint                items;
+    uint                ticks;
+    ulonglong           deadline;
+};
+
+
+inline bool GCBudget::Spend()
+// ----------------------------------------------------------------------------
+//   Spend one unit of work, return false if there is nothing left
+// ----------------------------------------------------------------------------
+{
+    if (!items)
+        return false;
+    items--;
+    if (deadline && (++ticks & 63) == 0)
+        return CheckTime();
+    return true;
+}
+
+
+
 // ****************************************************************************
 //
 //   Type Allocator - Manage allocation for a given type
@@ -83,6 +128,16 @@ struct TypeAllocator
     typedef volatile Chunk *Chunk_vp;
     typedef std::vector<Chunk_vp> Chunks;
 
+    struct ThreadCache
+    {
+        TypeAllocator * owner;          // Allocator owning the cached items
+        Chunk_vp        free;           // Items only this thread allocates
+        uint            count;          // Number of items in 'free'
+        uint            allocated;      // Allocations not yet accounted for
+        uint            freed;          // Deletions not yet accounted for
+    };
+    typedef std::set<ThreadCache *> ThreadCaches;
+
 public:
     TypeAllocator(kstring name, uint objectSize);
     virtual ~TypeAllocator();
@@ -103,8 +158,12 @@ public:
     static void         UpdateInUseRange(Chunk_vp chunk);
     static void         ScheduleDelete(Chunk_vp);
     bool                CheckLeakedPointers();
-    bool                Sweep();
+    void                BeginScan();
+    bool                ScanLeakedPointers(GCBudget &budget);
+    bool                Sweep(GCBudget &budget);
     void                ResetStatistics();
+    static void         FlushThreadCaches(void * = NULL);
+    static ulong        ThreadAllocations();
 
     void *operator new(size_t size);
     void operator delete(void *ptr);
@@ -117,6 +176,11 @@ public:
         ALLOCATED       = 0,            // Just allocated
         IN_USE          = 1             // Set if already marked this time
     };
+    enum ThreadCaching
+    {
+        CACHE_SLOTS     = 32,           // Allocators with a per-thread cache
+        CACHE_BATCH     = 32            // Items moved to or from shared list
+    };
 
 public:
     struct Listener
@@ -129,9 +193,20 @@ public:
     void AddListener(Listener *l) { listeners.insert(l); }
     bool CanDelete(void *object);
 
+protected:
+    ThreadCache *       Cache();
+    Chunk_vp            Take(uint wanted, uint &count);
+    void                Give(Chunk_vp first, Chunk_vp last, uint count);
+    void                Flush(ThreadCache *cache, uint count);
+    void                Account(ThreadCache *cache);
+    void                Detach(ThreadCache *cache);
+
 protected:
     GarbageCollector *  gc;
     kstring             name;
+    uint                cacheIndex;
+    ThreadCaches        threadCaches;
+    pthread_mutex_t     threadCachesLock;
     Atomic<uint>        locked;
     Atomic<uintptr_t>   lowestInUse;
     Atomic<uintptr_t>   highestInUse;
@@ -142,6 +217,15 @@ protected:
     Atomic<uint>        available;
     Atomic<uint>        freedCount;
 
+    // Incremental scan, which may span several safe points
+    bool                scanning;
+    uint                scanChunk;
+    char *              scanLow;
+    char *              scanHigh;
+    char *              scanNext;
+    char *              scanEnd;
+    uint                scanCollected;
+
     uint                chunkSize;
     uint                objectSize;
     uint                alignedSize;
@@ -186,6 +270,84 @@ private:
 };
 
 
+struct PayloadAllocator : TypeAllocator
+// ----------------------------------------------------------------------------
+//   Size-class slabs for variable-length data owned by collected objects
+// ----------------------------------------------------------------------------
+//   Payloads such as the characters of a long Text or Name come from one
+//   allocator per size class, sharing chunks and thread caches with the
+//   nodes that own them. Each item keeps a reference until its owner
+//   frees it, so the collector never reclaims it behind the owner's back.
+//   Payloads larger than the largest class go to malloc and are counted.
+{
+    enum SizeClasses
+    {
+        MIN_SIZE        = 32,           // Smallest size class
+        CLASSES         = 5             // Classes of 32, 64, ... 512 bytes
+    };
+
+public:
+    PayloadAllocator(kstring name, uint size): TypeAllocator(name, size) {}
+
+    static void *       Allocate(size_t size);
+    static void         Delete(void *ptr, size_t size);
+    static void         PrintStatistics();
+
+private:
+    static PayloadAllocator *SizeClass(size_t size);
+    static PayloadAllocator *classes[CLASSES];
+    static Atomic<uint>      largeCount;
+    static Atomic<ulong>     largeBytes;
+};
+
+
+template <class T>
+struct PayloadStorage
+// ----------------------------------------------------------------------------
+//   Standard allocator placing containers' storage in payload slabs
+// ----------------------------------------------------------------------------
+{
+    typedef T               value_type;
+    typedef T *             pointer;
+    typedef const T *       const_pointer;
+    typedef T &             reference;
+    typedef const T &       const_reference;
+    typedef size_t          size_type;
+    typedef ptrdiff_t       difference_type;
+    template <class U> struct rebind { typedef PayloadStorage<U> other; };
+
+    PayloadStorage() {}
+    PayloadStorage(const PayloadStorage &) {}
+    template <class U> PayloadStorage(const PayloadStorage<U> &) {}
+
+    pointer             address(reference x) const      { return &x; }
+    const_pointer       address(const_reference x) const{ return &x; }
+    size_type           max_size() const { return size_type(~0UL)/sizeof(T); }
+    void                construct(pointer p, const T &v){ new(p) T(v); }
+    void                destroy(pointer p)              { p->~T(); }
+    pointer allocate(size_type n, const void * = 0)
+    {
+        return (pointer) PayloadAllocator::Allocate(n * sizeof(T));
+    }
+    void deallocate(pointer p, size_type n)
+    {
+        PayloadAllocator::Delete(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U> inline
+bool operator==(const PayloadStorage<T> &, const PayloadStorage<U> &)
+{
+    return true;
+}
+
+template <class T, class U> inline
+bool operator!=(const PayloadStorage<T> &, const PayloadStorage<U> &)
+{
+    return false;
+}
+
+
 
 // ****************************************************************************
 //
@@ -237,6 +399,11 @@ struct GCPtr
     Object *operator->() const                  { return pointer; }
     Object& operator*() const                   { return *pointer; }
 
+    // Uncounted stores, for slots whose value is known to be rooted elsewhere.
+    // A borrowed pointer must be cleared with Unborrow, never reassigned.
+    void Borrow(Object *ptr)                    { pointer = ptr; }
+    void Unborrow()                             { pointer = 0; }
+
     // Two threads may be assigning to this GCPtr at the same time,
     // e.g. if we update a same Tree child from two different threads.
     GCPtr& Assign(Object *oldVal, Object *newVal)
@@ -304,6 +471,7 @@ struct GarbageCollector
     static bool                 Running()       { return gc->running; }
     static bool                 SafePoint();
     static bool                 Sweep();
+    static void                 Budget(uint items, uint micros);
     
     void                        Statistics(uint &totalBytes,
                                            uint &allocBytes,
@@ -317,6 +485,8 @@ struct GarbageCollector
 private:
     // Collection happens at SafePoint, you can't trigger it manually.
     bool                        Collect();
+    bool                        Step(GCBudget &budget);
+    void                        Notify(bool begin);
 
 private:
     typedef std::vector<TypeAllocator *> Allocators;
@@ -324,10 +494,19 @@ private:
 
     static GarbageCollector *   gc;
 
+    enum Phase { IDLE, SCANNING, SWEEPING };
+
     Allocators                  allocators;
     Atomic<uint>                mustRun;
     Atomic<uint>                running;
 
+    // Incremental collection state, carried over between safe points
+    Phase                       phase;
+    uint                        scanIndex;
+    bool                        swept;
+    uint                        budgetItems;
+    uint                        budgetMicros;
+
     friend void ::debuggc(void *ptr);
 };
 
@@ -25,6 +25,8 @@
 #include "types.h"
 #include "renderer.h"
 #include "basics.h"
+#include "remote.h"
+#include "profiler.h"
 
 #include <cmath>
 #include <algorithm>
@@ -236,7 +238,7 @@ bool Bindings::DoPrefix(Prefix *what)
         {
             if (Name *testName = pfx->left->AsName())
             {
-                if (name->value == testName->value)
+                if (name->Is(testName))
                 {
                     test = pfx->right;
                     return what->right->Do(this);
@@ -278,7 +280,7 @@ bool Bindings::DoPostfix(Postfix *what)
         {
             if (Name *testName = pfx->right->AsName())
             {
-                if (name->value == testName->value)
+                if (name->Is(testName))
                 {
                     test = pfx->left;
                     return what->left->Do(this);
@@ -331,6 +333,18 @@ bool Bindings::DoInfix(Infix *what)
             MustEvaluate(type != ELIOT::value_type);
             checked = TypeCheck(context, type, test);
         }
+        if (!checked)
+        {
+            // A future from ask_async only gets a type once it has a value
+            Tree *value = eliot_future(test);
+            if (value != test)
+            {
+                test = value;
+                if (Tree *inside = IsClosure(test, &context))
+                    test = inside;
+                checked = TypeCheck(context, type, test);
+            }
+        }
         if (checked)
         {
             Bind(name, checked);
@@ -487,7 +501,7 @@ void Bindings::BindClosure(Name *name, Tree *value)
 //
 // ============================================================================
 
-static Tree *error_result = NULL;
+static __thread Tree *error_result = NULL;
 
 
 static Tree *evalLookup(Scope *evalScope, Scope *declScope,
@@ -496,7 +510,7 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
 //   Calllback function to check if the candidate matches
 // ----------------------------------------------------------------------------
 {
-    static uint depth = 0;
+    static __thread uint depth = 0;
     Save<uint> saveDepth(depth, depth+1);
     IFTRACE(eval)
         std::cerr << "EVAL" << depth << "(" << self
@@ -563,6 +577,10 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
             resultType = bindings.resultType;
     }
 
+    // Statistics skip names and constants, e.g. parameters bound locally
+    if (!defined->IsLeaf())
+        RewriteStats::Enter(decl);
+
     // Check if the right is "self"
     if (result == eliot_self)
     {
@@ -576,6 +594,8 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     // Check if we have builtins (opcode or C bindings)
     if (opcode)
     {
+        Profiler::Frame profile(decl->Position());
+
         // Cached callback
         uint offset = args.size();
         std::reverse(args.begin(), args.end());
@@ -593,6 +613,10 @@ static Tree *evalLookup(Scope *evalScope, Scope *declScope,
     }
 
     // Normal case: evaluate body of the declaration in the new context
+    // The caller's loop evaluates it, and pops the frame when it returns.
+    // Arguments bound to a parameter are accounted to the caller's frame.
+    if (!defined->IsLeaf() || !IsClosure(decl->right, NULL))
+        Profiler::Enter(decl->Position());
     result = decl->right;
     if (resultType != tree_type)
         result = new Infix("as", result, resultType, self->Position());
@@ -626,13 +650,15 @@ static Tree *Instructions(Context_p context, Tree_p what)
 {
     Tree_p      result = what;
     Scope_p     originalScope = context->CurrentScope();
+    Profiler::Frame profile;
+    RewriteTimer    timer;
 
     // Loop to avoid recursion for a few common cases, e.g. sequences, blocks
     while (what)
     {
         // First attempt to look things up
         EvalCache cache;
-        if (Tree *eval = context->Lookup(what, evalLookup, &cache))
+        if (Tree *eval = context->Lookup(what, evalLookup, &cache, true, true))
         {
             if (eval == eliot_error)
                 return eval;
@@ -690,12 +716,18 @@ static Tree *Instructions(Context_p context, Tree_p what)
                 callee = inside;
 
             if (Name *name = callee->AsName())
+            {
                 // A few cases where we don't interpret the result
                 if (name->value == "type"   ||
                     name->value == "extern" ||
                     name->value == "data")
                     return what;
 
+                // A future from ask_async is a value until it is needed
+                if (name->value == "future" && what->GetInfo<FutureInfo>())
+                    return what;
+            }
+
             // This variable records if we evaluated the callee
             Tree *newCallee = NULL;
             Tree *arg = pfx->right;
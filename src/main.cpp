@@ -54,6 +54,7 @@
 #include "runtime.h"
 #include "traces.h"
 #include "flight_recorder.h"
+#include "profiler.h"
 #include "utf8_fileutils.h"
 #include "interpreter.h"
 #include "opcodes.h"
@@ -73,6 +74,8 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 
 ELIOT_DEFINE_TRACES
@@ -154,8 +157,12 @@ Main::Main(int inArgc, char **inArgv, text compilerName,
     options.builtins = builtinsName;
     ParseOptions();
     FlightRecorder::SResize(options.flightRecorderSize);
+    GarbageCollector::Budget(options.gcBudget, options.gcPause);
     if (options.flightRecorderFlags)
         FlightRecorder::SFlags(options.flightRecorderFlags);
+    if (options.profile != "" && !Profiler::Start(options.profile_rate))
+        std::cerr << "Unable to start the profiler\n";
+    RewriteStats::enabled = options.stats;
 
     // Once all options have been read, enter symbols and setup compiler
 #ifndef INTERPRETER_ONLY
@@ -190,12 +197,18 @@ int Main::LoadAndRun()
 //   An single entry point for the normal phases
 // ----------------------------------------------------------------------------
 {
+    if (options.allocBench)
+        AllocationBenchmark(std::cerr, options.allocBench);
+
     int rc = LoadFiles();
     if (!rc && !options.parseOnly)
         rc = Run();
     if (!rc && HadErrors())
         rc = 1;
 
+    if (!rc && options.listen && options.listen_threads)
+        return eliot_listen_threaded(context, options.listen_threads,
+                                     options.listen);
     if (!rc && options.listen)
         return eliot_listen(context, options.listen_forks, options.listen);
     
@@ -302,6 +315,25 @@ int Main::LoadFile(text file, text modname)
         input = &inputStream;
     }
 
+    // Check if we can restore builtins from a snapshot
+    if (file == options.builtins && options.restore != "")
+        if (RestoreSnapshot(file))
+            return false;
+
+    // Check if we have a precompiled version of this exact source
+    bool        cached   = (options.sourceCache && file != "-" &&
+                            !options.crypted && !options.packed);
+    ulonglong   cacheKey = 0;
+    if (cached)
+    {
+        inputStream << input->rdbuf();
+        input = &inputStream;
+        cacheKey = SourceKey(inputStream.str(), syntax);
+        tree = ReadCache(file, inputStream.str(), cacheKey);
+        if (tree)
+            cached = false;
+    }
+
     // Check if we need to deserialize the input file first
     if (options.packed)
     {
@@ -321,8 +353,16 @@ int Main::LoadFile(text file, text modname)
         kstring errName = file.c_str();
         if (file == "-")
             errName = "<stdin>";
-        Parser parser (*input, syntax, positions, topLevelErrors, errName);
-        tree = parser.Parse();
+        uint errCount = topLevelErrors.Count();
+        {
+            Parser parser (*input, syntax, positions, topLevelErrors, errName);
+            tree = parser.Parse();
+        }
+
+        // Save the result unless parsing failed or changed the syntax
+        if (cached && tree && errCount == topLevelErrors.Count() &&
+            cacheKey == SourceKey(inputStream.str(), syntax))
+            WriteCache(file, tree, cacheKey);
     }
 
     // If at this stage we don't have a tree, this is an error
@@ -364,6 +404,10 @@ int Main::LoadFile(text file, text modname)
         }
     }
 
+    // Compare serialization formats if this was requested
+    if (options.serialBench)
+        SerializationBenchmark(std::cerr, file, tree, options.serialBench);
+
     // Normalize if necessary
     tree = Normalize(tree);
 
@@ -408,6 +452,320 @@ int Main::LoadFile(text file, text modname)
 }
 
 
+ulonglong Main::SourceKey(text source, Syntax &syntax)
+// ----------------------------------------------------------------------------
+//   Compute the key identifying a source file in its cache (64-bit FNV-1a)
+// ----------------------------------------------------------------------------
+//   The key depends on the source, on the syntax it is parsed with, and on
+//   the cache version, which must change when the tree format changes.
+{
+    static kstring version = "ELIOT source cache 1 " __DATE__ " " __TIME__;
+    const ulonglong prime = 0x100000001b3ULL;
+    ulonglong hash = 0xcbf29ce484222325ULL;
+#define HASH_BYTE(b)    (hash = (hash ^ byte(b)) * prime)
+#define HASH_TEXT(t)    for (uint c = 0; c < t.length(); c++) HASH_BYTE(t[c]); \
+                        HASH_BYTE(0)
+#define HASH_INT(i)     for (uint b = 0; b < 4; b++) HASH_BYTE((i) >> (8*b))
+
+    text versionText = version;
+    HASH_TEXT(versionText);
+    HASH_TEXT(source);
+
+    priority_table *priorities[] = { &syntax.infix_priority,
+                                     &syntax.prefix_priority,
+                                     &syntax.postfix_priority };
+    for (uint t = 0; t < 3; t++)
+    {
+        priority_table::iterator p;
+        for (p = priorities[t]->begin(); p != priorities[t]->end(); p++)
+        {
+            HASH_TEXT(p->first);
+            HASH_INT(p->second);
+        }
+    }
+
+    delimiter_table *delimiters[] = { &syntax.comment_delimiters,
+                                      &syntax.text_delimiters,
+                                      &syntax.block_delimiters,
+                                      &syntax.subsyntax_file };
+    for (uint t = 0; t < 4; t++)
+    {
+        delimiter_table::iterator d;
+        for (d = delimiters[t]->begin(); d != delimiters[t]->end(); d++)
+        {
+            HASH_TEXT(d->first);
+            HASH_TEXT(d->second);
+        }
+    }
+    HASH_INT(syntax.default_priority);
+    HASH_INT(syntax.statement_priority);
+    HASH_INT(syntax.function_priority);
+
+#undef HASH_INT
+#undef HASH_TEXT
+#undef HASH_BYTE
+    return hash;
+}
+
+
+static void SourceTrees(Tree *tree, TreeList &trees)
+// ----------------------------------------------------------------------------
+//   List the nodes in a tree in a stable order, to attach their positions
+// ----------------------------------------------------------------------------
+{
+    TreeList pending;
+    pending.push_back(tree);
+    while (!pending.empty())
+    {
+        tree = pending.back();
+        pending.pop_back();
+        trees.push_back(tree);
+        switch(tree->Kind())
+        {
+        case BLOCK:
+            pending.push_back(((Block *) tree)->child);
+            break;
+        case PREFIX:
+            pending.push_back(((Prefix *) tree)->right);
+            pending.push_back(((Prefix *) tree)->left);
+            break;
+        case POSTFIX:
+            pending.push_back(((Postfix *) tree)->right);
+            pending.push_back(((Postfix *) tree)->left);
+            break;
+        case INFIX:
+            pending.push_back(((Infix *) tree)->right);
+            pending.push_back(((Infix *) tree)->left);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+
+void Main::WritePositions(Serializer &serializer, Tree *tree, text file)
+// ----------------------------------------------------------------------------
+//   Write the offset in 'file' of each node in the tree, 0 if elsewhere
+// ----------------------------------------------------------------------------
+{
+    TreeList trees;
+    SourceTrees(tree, trees);
+    uint count = trees.size();
+    serializer.WriteUnsigned(count);
+    for (uint t = 0; t < count; t++)
+    {
+        text   name;
+        ulong  offset = 0;
+        positions.GetFile(trees[t]->Position(), &name, &offset);
+        serializer.WriteUnsigned(name == file ? offset + 1 : 0);
+    }
+}
+
+
+bool Main::ReadPositions(Deserializer &deserializer, Tree *tree,
+                         text file, ulong length)
+// ----------------------------------------------------------------------------
+//   Record 'file' in the positions, as the scanner would, and restore nodes
+// ----------------------------------------------------------------------------
+{
+    TreeList trees;
+    SourceTrees(tree, trees);
+    uint count = trees.size();
+    if (deserializer.ReadUnsigned() != count)
+        return false;
+
+    ulong base = positions.OpenFile(file);
+    positions.CloseFile(base + length);
+    for (uint t = 0; t < count; t++)
+    {
+        ulonglong offset = deserializer.ReadUnsigned();
+        TreePosition pos = offset ? base + offset - 1 : Tree::NOWHERE;
+        trees[t]->SetPosition(pos, false);
+    }
+    return deserializer.IsValid();
+}
+
+
+static text CacheName(text file)
+// ----------------------------------------------------------------------------
+//   Name of the cache file for a given source file
+// ----------------------------------------------------------------------------
+{
+    return file + "c";
+}
+
+
+Tree *Main::ReadCache(text file, text source, ulonglong key)
+// ----------------------------------------------------------------------------
+//   Read the tree for a source file from its cache, if it matches the key
+// ----------------------------------------------------------------------------
+//   The cache holds the key, the serialized tree, then the offset of each
+//   node in the source file, which lets us restore error positions.
+{
+    text cacheName = CacheName(file);
+    std::ifstream cache(cacheName.c_str(), std::ios::in|std::ios::binary);
+    if (!cache.good())
+        return NULL;
+
+    Deserializer deserializer(cache);
+    if (!deserializer.IsValid() || deserializer.ReadUnsigned() != key)
+        return NULL;
+    Tree_p tree = deserializer.ReadTree();
+    if (!tree || !deserializer.IsValid())
+        return NULL;
+
+    if (!ReadPositions(deserializer, tree, file, source.length()))
+        return NULL;
+
+    IFTRACE(fileload)
+        std::cerr << "Loaded " << file << " from " << cacheName << "\n";
+    return tree;
+}
+
+
+void Main::WriteCache(text file, Tree *tree, ulonglong key)
+// ----------------------------------------------------------------------------
+//   Write the cache for a source file, ignoring failures
+// ----------------------------------------------------------------------------
+{
+    text cacheName = CacheName(file);
+    text tempName = cacheName + ".tmp";
+    {
+        std::ofstream cache(tempName.c_str(),
+                            std::ios::out|std::ios::binary|std::ios::trunc);
+        if (!cache.good())
+            return;
+
+        Serializer serializer(cache);
+        serializer.WriteUnsigned(key);
+        tree->Do(serializer);
+
+        WritePositions(serializer, tree, file);
+        if (!serializer.IsValid())
+        {
+            cache.close();
+            unlink(tempName.c_str());
+            return;
+        }
+    }
+    if (rename(tempName.c_str(), cacheName.c_str()) != 0)
+    {
+        unlink(tempName.c_str());
+        return;
+    }
+
+    IFTRACE(fileload)
+        std::cerr << "Saved " << file << " to " << cacheName << "\n";
+}
+
+
+static bool ReadSource(text file, text &source)
+// ----------------------------------------------------------------------------
+//   Read the whole source for a file
+// ----------------------------------------------------------------------------
+{
+    utf8_ifstream input(file.c_str(), std::ios::in|std::ios::binary);
+    if (!input.good())
+        return false;
+    std::stringstream stream;
+    stream << input.rdbuf();
+    source = stream.str();
+    return true;
+}
+
+
+bool Main::RestoreSnapshot(text file)
+// ----------------------------------------------------------------------------
+//   Restore the context for the builtins file from a snapshot
+// ----------------------------------------------------------------------------
+//   The snapshot holds the symbol table of the builtins context once it was
+//   evaluated. It is only valid for the same builtins source, syntax and
+//   build. Opcodes and C bindings are found again by name on first use.
+{
+    text source;
+    if (!ReadSource(file, source))
+        return false;
+    ulonglong key = SourceKey(source, syntax);
+
+    int fd = open(options.restore.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *image = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return false;
+
+    Deserializer deserializer((const byte *) image, ~size_t(0), 0, st.st_size);
+    bool valid = deserializer.IsValid() && deserializer.ReadUnsigned() == key;
+    uint kinds = valid ? deserializer.ReadUnsigned() : 0;
+    Tree_p table = valid ? deserializer.ReadTree() : NULL;
+    valid = table && deserializer.IsValid() &&
+        ReadPositions(deserializer, table, file, source.length());
+    munmap(image, st.st_size);
+    if (!valid)
+    {
+        IFTRACE(fileload)
+            std::cerr << "Snapshot " << options.restore
+                      << " does not match " << file << "\n";
+        return false;
+    }
+
+    // Rebuild the context for builtins, as LoadFile and Run would have
+    table = eliot_restore_nil(table);
+    Context *ctx = new Context(context, table->Position());
+    ctx->CurrentScope()->right = table;
+    Context::hasRewritesForKind |= kinds;
+    context = ctx;
+    files[file] = SourceFile(file, NULL, ctx);
+
+    IFTRACE(fileload)
+        std::cerr << "Restored " << file << " from "
+                  << options.restore << "\n";
+    return true;
+}
+
+
+void Main::WriteSnapshot(text file)
+// ----------------------------------------------------------------------------
+//   Write a snapshot of the context for the builtins file
+// ----------------------------------------------------------------------------
+{
+    SourceFile &sf = files[file];
+    text source;
+    if (!sf.context || !ReadSource(file, source))
+    {
+        Ooops("Cannot take snapshot of $1", Tree::COMMAND_LINE).Arg(file);
+        return;
+    }
+
+    text image;
+    {
+        Serializer serializer(image);
+        serializer.WriteUnsigned(SourceKey(source, syntax));
+        serializer.WriteUnsigned(Context::hasRewritesForKind);
+        Tree *table = sf.context->CurrentScope()->right;
+        table->Do(serializer);
+        WritePositions(serializer, table, file);
+    }
+
+    text snapshot = options.snapshot;
+    text tempName = snapshot + ".tmp";
+    std::ofstream output(tempName.c_str(),
+                         std::ios::out|std::ios::binary|std::ios::trunc);
+    output.write(image.data(), image.length());
+    output.close();
+    if (!output.good() || rename(tempName.c_str(), snapshot.c_str()) != 0)
+    {
+        unlink(tempName.c_str());
+        Ooops("Cannot write snapshot $1", Tree::COMMAND_LINE).Arg(snapshot);
+    }
+}
+
+
 int Main::Run()
 // ----------------------------------------------------------------------------
 //   Run all files given on the command line
@@ -448,6 +806,10 @@ int Main::Run()
         {
             std::cout << "RESULT of " << sf.name << "\n" << result << "\n";
         }
+
+        // Save the initialized builtins if requested
+        if (*file == options.builtins && options.snapshot != "")
+            WriteSnapshot(*file);
     }
 
     // Output the result
@@ -604,6 +966,19 @@ int main(int argc, char **argv)
 
     IFTRACE(gcstats)
         ELIOT::GarbageCollector::GC()->PrintStatistics();
+#ifndef INTERPRETER_ONLY
+    IFTRACE(codestats)
+        ELIOT::Context::PrintCompiledStatistics();
+#endif // INTERPRETER_ONLY
+    text exportFile = main.options.flightRecorderExport;
+    if (exportFile != "")
+        ELIOT::FlightRecorder::SExport(exportFile.c_str());
+    text profileFile = main.options.profile;
+    if (profileFile != "")
+    {
+        ELIOT::Profiler::Stop();
+        ELIOT::Profiler::Write(profileFile.c_str());
+    }
 
 #if CONFIG_USE_SBRK
     IFTRACE(memory)
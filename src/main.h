@@ -103,6 +103,14 @@ struct Main
     int          ParseOptions();
     int          LoadFiles();
     int          LoadFile(text file, text modname="");
+    ulonglong    SourceKey(text source, Syntax &syntax);
+    Tree *       ReadCache(text file, text source, ulonglong key);
+    void         WriteCache(text file, Tree *tree, ulonglong key);
+    void         WritePositions(Serializer &, Tree *tree, text file);
+    bool         ReadPositions(Deserializer &, Tree *tree,
+                               text file, ulong length);
+    bool         RestoreSnapshot(text file);
+    void         WriteSnapshot(text file);
     int          Run();
 
     // Error checking
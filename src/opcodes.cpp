@@ -104,7 +104,7 @@ void Opcode::Register(Context *context)
                                 new Prefix(opcodeName,
                                            new Name(this->OpID())));
         context->Enter(decl);
-        decl->right->SetInfo<Opcode> (this);
+        decl->right->SetInfo<Opcode> (this->Clone());
     }
     else
     {
@@ -130,7 +130,7 @@ void NameOpcode::Register(Context *context)
         std::cerr << "Opcode " << this->OpID() << " is a name\n";
 
     context->Define(toDefine, toDefine);
-    toDefine->SetInfo<Opcode> (this);
+    toDefine->SetInfo<Opcode> (this->Clone());
 
 #ifndef INTERPRETER_ONLY
     if (MAIN->options.optimize_level > 1)
@@ -138,6 +138,7 @@ public:
     virtual Opcode *            Clone() = 0;
     virtual Op *                Run(Data data) = 0;
     virtual void                SetParms(ParmOrder &parms)  {}
+    virtual bool                Operands(int &, int &)      { return false; }
 
 public:
     static void                 Enter(Context *context);
@@ -206,9 +207,9 @@ struct InfixOpcode : Opcode
         return
             new Infix("as",
                       new Infix(infix,
-                                new Infix(":", new Name("left"),
+                                new Infix(":", Name::Interned("left"),
                                           leftTy),
-                                new Infix(":", new Name("right"),
+                                new Infix(":", Name::Interned("right"),
                                           rightTy)),
                       resTy);
     }
@@ -240,8 +241,8 @@ struct PrefixOpcode : Opcode
         Save<TreePosition> savePos(Tree::NOWHERE, Tree::BUILTIN);
         return
             new Infix("as",
-                      new Prefix(new Name(prefix),
-                                 new Infix(":", new Name("left"), argTy)),
+                      new Prefix(Name::Interned(prefix),
+                                 new Infix(":", Name::Interned("left"), argTy)),
                       resTy);
     }
 
@@ -272,8 +273,8 @@ struct PostfixOpcode : Opcode
         Save<TreePosition> savePos(Tree::NOWHERE, Tree::BUILTIN);
         return
             new Infix("as",
-                      new Postfix(new Infix(":", new Name("left"), argTy),
-                                  new Name(postfix)),
+                      new Postfix(new Infix(":", Name::Interned("left"), argTy),
+                                  Name::Interned(postfix)),
                       resTy);
     }
 
@@ -304,7 +305,7 @@ struct FunctionOpcode : Opcode
     {
         Save<TreePosition> savePos(Tree::NOWHERE, Tree::BUILTIN);
         Tree *type = OpcodeType((TreeType *) 0);
-        Infix *parmDecl = new Infix(":", new Name(name), type);
+        Infix *parmDecl = new Infix(":", Name::Interned(name), type);
         if (!result)
         {
             *ptr = parmDecl;
@@ -585,6 +586,12 @@ ELIOT_END
             leftID = parms[0];                                          \
             rightID = parms[1];                                         \
         }                                                               \
+        virtual bool Operands(int &left, int &right)                    \
+        {                                                               \
+            left = leftID;                                              \
+            right = rightID;                                            \
+            return true;                                                \
+        }                                                               \
         int leftID, rightID;                                            \
     };                                                                  \
                                                                         \
@@ -736,9 +743,9 @@ ELIOT_END
             _parms.size = 0;                                            \
             Parms;                                                      \
             if (result)                                                 \
-                result = new Prefix(new Name(Symbol), result);          \
+                result = new Prefix(Name::Interned(Symbol), result);   \
             else                                                        \
-                result = new Name(Symbol);                              \
+                result = Name::Interned(Symbol);                       \
             self = new Infix("as", result, ResTy##_type);               \
             return self;                                                \
         }                                                               \
@@ -0,0 +1,475 @@
+// ****************************************************************************
+//  profiler.cpp                                                 ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     A sampling profiler reporting time spent in ELIOT rewrites
+//
+//
+//
+//
+//
+//
+//
+//
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+
+#include "profiler.h"
+#include "main.h"
+#include "atomic.h"
+#include "gc.h"
+#include "flight_recorder.h"
+
+#include <map>
+#include <set>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+ELIOT_BEGIN
+
+// ============================================================================
+//
+//    Samples
+//
+// ============================================================================
+//  The signal handler cannot allocate memory or take locks. Samples are
+//  counted in a fixed open-addressed table, where a slot is claimed by
+//  atomically setting its hash, then marked ready once its frames are set.
+
+struct ProfileSlot
+// ----------------------------------------------------------------------------
+//   Number of samples taken with a given stack
+// ----------------------------------------------------------------------------
+{
+    Atomic<ulong>       hash;           // Zero if the slot is free
+    Atomic<ulong>       count;
+    volatile bool       ready;
+    bool                truncated;      // Outer frames were not kept
+    uint                depth;
+    TreePosition        frames[Profiler::SAMPLE_DEPTH]; // Outermost first
+};
+
+
+static ProfileSlot *    profile_slots   = NULL;
+static Atomic<ulong>    profile_dropped = 0;
+
+
+bool                     Profiler::active = false;
+__thread Profiler::Stack Profiler::stack;
+
+
+void Profiler::Sample(int)
+// ----------------------------------------------------------------------------
+//   Count one sample of the current thread's stack (signal handler)
+// ----------------------------------------------------------------------------
+{
+    uint depth = stack.depth;
+    uint count = depth < SAMPLE_DEPTH ? depth : SAMPLE_DEPTH;
+    bool truncated = depth > count;
+    TreePosition frames[SAMPLE_DEPTH];
+    for (uint f = 0; f < count; f++)
+        frames[f] = stack.frames[(depth - count + f) % STACK_SIZE];
+
+    // FNV-style hash of the frames, never zero since zero marks free slots
+    ulong hash = 14695981039346656037ULL ^ (count << 1) ^ truncated;
+    for (uint f = 0; f < count; f++)
+        hash = (hash ^ frames[f]) * 1099511628211ULL;
+    if (!hash)
+        hash = 1;
+
+    for (uint probe = 0; probe < SAMPLE_SLOTS; probe++)
+    {
+        ProfileSlot &slot = profile_slots[(hash + probe) % SAMPLE_SLOTS];
+        if (slot.hash == 0 && slot.hash.SetQ(0, hash))
+        {
+            slot.depth = count;
+            slot.truncated = truncated;
+            for (uint f = 0; f < count; f++)
+                slot.frames[f] = frames[f];
+            __sync_synchronize();
+            slot.ready = true;
+            slot.count++;
+            return;
+        }
+        if (slot.hash == hash && slot.ready &&
+            slot.depth == count && slot.truncated == truncated &&
+            memcmp(slot.frames, frames, count * sizeof *frames) == 0)
+        {
+            slot.count++;
+            return;
+        }
+    }
+    profile_dropped++;
+}
+
+
+bool Profiler::Start(uint hertz)
+// ----------------------------------------------------------------------------
+//   Start sampling the process CPU time at the given rate
+// ----------------------------------------------------------------------------
+{
+    if (!profile_slots)
+        profile_slots = new ProfileSlot[SAMPLE_SLOTS]();
+
+    // Restart system calls, so that the runtime does not see EINTR
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = Sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) < 0)
+        return false;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hertz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) < 0)
+        return false;
+
+    active = true;
+    return true;
+}
+
+
+void Profiler::Stop()
+// ----------------------------------------------------------------------------
+//   Stop sampling, keeping the samples taken so far
+// ----------------------------------------------------------------------------
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof timer);
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+
+
+// ============================================================================
+//
+//    Output
+//
+// ============================================================================
+
+static text ProfileFrameName(TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Name a frame after the source of the declaration and its location
+// ----------------------------------------------------------------------------
+{
+    switch (pos)
+    {
+    case Tree::UNKNOWN_POSITION:        return "<Unknown position>";
+    case Tree::COMMAND_LINE:            return "<Command line>";
+    case Tree::BUILTIN:                 return "<Builtin>";
+    }
+
+    text  file, source;
+    ulong line, column;
+    MAIN->positions.GetInfo(pos, &file, &line, &column, &source);
+
+    // Keep the start of the source line on one line, with single spaces,
+    // and without the semicolons that separate collapsed frames
+    text name;
+    for (size_t c = 0; c < source.length() && name.length() < 40; c++)
+    {
+        char ch = source[c];
+        if (ch == ';')
+            ch = ',';
+        if (isspace(ch))
+        {
+            if (name.length() && name[name.length()-1] != ' ')
+                name += ' ';
+        }
+        else
+        {
+            name += ch;
+        }
+    }
+
+    std::ostringstream out;
+    out << name << " (" << file << ":" << line << ")";
+    return out.str();
+}
+
+
+text Profiler::Collapsed()
+// ----------------------------------------------------------------------------
+//   Return the samples in collapsed stack format, one stack per line
+// ----------------------------------------------------------------------------
+//   Each line lists the frames from outermost to innermost, separated by
+//   semicolons, followed by the number of samples taken in that stack.
+{
+    if (!profile_slots)
+        return "";
+
+    typedef std::map<TreePosition, text> names_t;
+    typedef std::map<text, ulong>        stacks_t;
+    names_t  names;
+    stacks_t stacks;
+
+    for (uint s = 0; s < SAMPLE_SLOTS; s++)
+    {
+        ProfileSlot &slot = profile_slots[s];
+        if (!slot.ready || !slot.count)
+            continue;
+
+        text stack = slot.truncated ? "..." : "";
+        if (!slot.depth)
+            stack = "<Runtime>";
+        for (uint f = 0; f < slot.depth; f++)
+        {
+            TreePosition pos = slot.frames[f];
+            names_t::iterator found = names.find(pos);
+            if (found == names.end())
+            {
+                text name = ProfileFrameName(pos);
+                found = names.insert(names_t::value_type(pos, name)).first;
+            }
+            if (stack.length())
+                stack += ";";
+            stack += found->second;
+        }
+        stacks[stack] += slot.count;
+    }
+    if (profile_dropped)
+        stacks["<Dropped>"] += profile_dropped;
+
+    std::ostringstream out;
+    for (stacks_t::iterator i = stacks.begin(); i != stacks.end(); i++)
+        out << i->first << " " << i->second << "\n";
+    return out.str();
+}
+
+
+bool Profiler::Write(kstring file)
+// ----------------------------------------------------------------------------
+//   Write the samples in collapsed stack format to the given file
+// ----------------------------------------------------------------------------
+{
+    std::ofstream out(file);
+    out << Collapsed();
+    return out.good();
+}
+
+
+
+
+// ============================================================================
+//
+//    Rewrite statistics
+//
+// ============================================================================
+
+typedef std::set<RewriteStats *> rewrite_stats_t;
+static rewrite_stats_t  rewrite_stats;
+static pthread_mutex_t  rewrite_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+bool                     RewriteStats::enabled = false;
+__thread RewriteTimer *  RewriteTimer::current = NULL;
+__thread uint            RewriteTimer::depth = 0;
+__thread RewriteTimer::Call RewriteTimer::calls[RewriteTimer::MAX_CALLS];
+
+
+RewriteStats::RewriteStats(Infix *decl)
+// ----------------------------------------------------------------------------
+//   Create statistics for a declaration, and list them for Collect()
+// ----------------------------------------------------------------------------
+    : decl(decl), calls(0), total(0), max(0), allocations(0)
+{
+    pthread_mutex_lock(&rewrite_stats_lock);
+    rewrite_stats.insert(this);
+    pthread_mutex_unlock(&rewrite_stats_lock);
+}
+
+
+RewriteStats::~RewriteStats()
+// ----------------------------------------------------------------------------
+//   Remove statistics when the declaration is deleted
+// ----------------------------------------------------------------------------
+{
+    pthread_mutex_lock(&rewrite_stats_lock);
+    rewrite_stats.erase(this);
+    pthread_mutex_unlock(&rewrite_stats_lock);
+}
+
+
+void RewriteStats::Current(Infix *decl)
+// ----------------------------------------------------------------------------
+//   Count a call to the declaration, and time it with the current timer
+// ----------------------------------------------------------------------------
+{
+    RewriteTimer *timer = RewriteTimer::current;
+    if (!timer)
+        return;
+
+    RewriteStats *stats = decl->GetInfo<RewriteStats>();
+    if (!stats)
+    {
+        stats = new RewriteStats(decl);
+        decl->SetInfo<RewriteStats>(stats);
+    }
+    stats->calls++;
+    timer->Start(stats);
+}
+
+
+static text ProfileLocation(TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Return the file and line for a position
+// ----------------------------------------------------------------------------
+{
+    switch (pos)
+    {
+    case Tree::UNKNOWN_POSITION:        return "<Unknown position>";
+    case Tree::COMMAND_LINE:            return "<Command line>";
+    case Tree::BUILTIN:                 return "<Builtin>";
+    }
+
+    text  file;
+    ulong line, column;
+    MAIN->positions.GetInfo(pos, &file, &line, &column, NULL);
+    std::ostringstream out;
+    out << file << ":" << line;
+    return out.str();
+}
+
+
+struct RewriteStatsEntry
+// ----------------------------------------------------------------------------
+//   A copy of the statistics taken while the list is locked
+// ----------------------------------------------------------------------------
+{
+    Infix_p     decl;
+    text        name;
+    ulong       calls;
+    ulonglong   total, max;
+    ulong       allocations;
+
+    bool operator<(const RewriteStatsEntry &o) const { return total > o.total; }
+};
+
+
+Tree *RewriteStats::Collect(uint count)
+// ----------------------------------------------------------------------------
+//   Return the statistics of the 'count' rewrites that took the most time
+// ----------------------------------------------------------------------------
+//   The result is a list of (name, calls, total, max, allocations) blocks,
+//   where the name shows the pattern and its location, and times are
+//   in microseconds. The lock is only held to copy the counters and keep
+//   the declarations alive. Names are built once the list is unlocked.
+{
+    std::vector<RewriteStatsEntry> entries;
+
+    pthread_mutex_lock(&rewrite_stats_lock);
+    entries.reserve(rewrite_stats.size());
+    for (rewrite_stats_t::iterator i = rewrite_stats.begin();
+         i != rewrite_stats.end(); i++)
+    {
+        RewriteStats *stats = *i;
+        RewriteStatsEntry e;
+        e.decl = stats->decl;
+        e.calls = stats->calls;
+        e.total = stats->total;
+        e.max = stats->max;
+        e.allocations = stats->allocations;
+        entries.push_back(e);
+    }
+    pthread_mutex_unlock(&rewrite_stats_lock);
+
+    std::sort(entries.begin(), entries.end());
+    if (entries.size() > count)
+        entries.resize(count);
+    for (uint i = 0; i < entries.size(); i++)
+    {
+        RewriteStatsEntry &e = entries[i];
+        e.name = text(*e.decl->left) + " (" +
+            ProfileLocation(e.decl->Position()) + ")";
+    }
+
+    Tree_p list = NULL;
+    for (uint i = entries.size(); i--; )
+    {
+        RewriteStatsEntry &e = entries[i];
+        Tree_p entry = new Integer(e.allocations);
+        entry = new Infix(",", new Integer(e.max / 1000), entry);
+        entry = new Infix(",", new Integer(e.total / 1000), entry);
+        entry = new Infix(",", new Integer(e.calls), entry);
+        entry = new Infix(",", new Text(e.name), entry);
+        entry = new Block(entry, "(", ")");
+        list = list ? (Tree *) new Infix(",", entry, list) : entry.Pointer();
+    }
+    if (!list)
+        list = eliot_nil;
+    return new Block(list, "(", ")");
+}
+
+
+
+// ============================================================================
+//
+//    Rewrite timers
+//
+// ============================================================================
+
+void RewriteTimer::Push()
+// ----------------------------------------------------------------------------
+//   Make this timer the current one for the thread
+// ----------------------------------------------------------------------------
+{
+    base = depth;
+    outer = current;
+    current = this;
+}
+
+
+void RewriteTimer::Pop()
+// ----------------------------------------------------------------------------
+//   Account the time and allocations of the calls timed by this timer
+// ----------------------------------------------------------------------------
+{
+    if (depth > base)
+    {
+        ulonglong now = FlightRecorder::Now();
+        ulong allocated = TypeAllocator::ThreadAllocations();
+        while (depth > base)
+        {
+            Call &call = calls[--depth];
+            RewriteStats *stats = call.stats;
+            ulonglong elapsed = now - call.start;
+            stats->total += elapsed;
+            stats->max.Maximize(elapsed);
+            stats->allocations += allocated - call.allocations;
+        }
+    }
+    current = outer;
+}
+
+
+void RewriteTimer::Start(RewriteStats *stats)
+// ----------------------------------------------------------------------------
+//   Start timing a call to the given statistics
+// ----------------------------------------------------------------------------
+//   Calls beyond MAX_CALLS are counted, but not timed
+{
+    if (depth > base && calls[depth - 1].stats == stats)
+        return;
+    if (depth >= MAX_CALLS)
+        return;
+
+    Call &call = calls[depth++];
+    call.stats = stats;
+    call.start = FlightRecorder::Now();
+    call.allocations = TypeAllocator::ThreadAllocations();
+}
+
+ELIOT_END
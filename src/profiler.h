@@ -0,0 +1,197 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+// ****************************************************************************
+//  profiler.h                                                   ELIOT project
+// ****************************************************************************
+//
+//   File Description:
+//
+//     A sampling profiler reporting time spent in ELIOT rewrites
+//
+//     The evaluators keep a per-thread stack with the source position of
+//     the declaration being evaluated. A SIGPROF timer samples that stack
+//     and counts identical stacks, which can then be written in the
+//     collapsed format used to draw flame graphs.
+//
+//     Rewrite statistics count calls, time and allocations for each
+//     declaration, and can be returned to ELIOT programs as a tree.
+// ****************************************************************************
+//  (C) 2015 Christophe de Dinechin <christophe@taodyne.com>
+//  (C) 2015 Taodyne SAS
+// ****************************************************************************
+
+#include "base.h"
+#include "tree.h"
+#include "info.h"
+
+ELIOT_BEGIN
+
+struct Profiler
+// ----------------------------------------------------------------------------
+//   Sample the ELIOT-level stack at regular intervals
+// ----------------------------------------------------------------------------
+{
+    enum
+    {
+        STACK_SIZE   = 256,         // Innermost frames kept per thread
+        SAMPLE_DEPTH = 32,          // Innermost frames kept per sample
+        SAMPLE_SLOTS = 4096         // Number of distinct stacks counted
+    };
+
+    struct Stack
+    // ------------------------------------------------------------------------
+    //   Positions of the declarations being evaluated by one thread
+    // ------------------------------------------------------------------------
+    //   Frames beyond STACK_SIZE wrap around, so that the innermost ones
+    //   are always available to the signal handler
+    {
+        volatile TreePosition   frames[STACK_SIZE];
+        volatile uint           depth;
+        uint                    base;   // Depth when the last Frame began
+    };
+
+    struct Frame
+    // ------------------------------------------------------------------------
+    //   Pop the frames entered while this object is alive
+    // ------------------------------------------------------------------------
+    {
+        Frame(): pushed(active)
+        {
+            if (pushed)
+                Begin();
+        }
+        Frame(TreePosition pos): pushed(active)
+        {
+            if (pushed)
+            {
+                Begin();
+                Enter(pos);
+            }
+        }
+        ~Frame()
+        {
+            if (pushed)
+            {
+                stack.depth = depth;
+                stack.base = base;
+            }
+        }
+        void Begin()
+        {
+            depth = stack.depth;
+            base = stack.base;
+            stack.base = depth;
+        }
+        bool pushed;
+        uint depth;
+        uint base;
+    };
+
+    static void         Enter(TreePosition pos)
+    {
+        // Push a frame, popped with the innermost Frame object.
+        // A tail call to the same declaration keeps its existing frame.
+        if (!active)
+            return;
+        Stack &s = stack;
+        uint depth = s.depth;
+        if (depth > s.base && s.frames[(depth - 1) % STACK_SIZE] == pos)
+            return;
+        s.frames[depth % STACK_SIZE] = pos;
+        s.depth = depth + 1;
+    }
+
+    static bool         Start(uint hertz);
+    static void         Stop();
+    static text         Collapsed();
+    static bool         Write(kstring file);
+
+public:
+    static bool         active;
+
+private:
+    static void         Sample(int signal);
+    static __thread Stack stack;
+};
+
+
+struct RewriteStats : Info
+// ----------------------------------------------------------------------------
+//   Calls, time and allocations for a declaration
+// ----------------------------------------------------------------------------
+//   Time and allocations of a call are inclusive of the nested evaluations,
+//   including the calls it makes in tail position.
+{
+    RewriteStats(Infix *decl);
+    ~RewriteStats();
+
+    static void         Enter(Infix *decl)
+    {
+        // Count and time a call to the given declaration
+        if (enabled)
+            Current(decl);
+    }
+    static Tree *       Collect(uint count = ~0U);
+
+public:
+    Infix *             decl;           // Not a Tree_p, since it owns us
+    Atomic<ulong>       calls;
+    Atomic<ulonglong>   total;          // Nanoseconds
+    Atomic<ulonglong>   max;
+    Atomic<ulong>       allocations;
+
+    static bool         enabled;
+
+private:
+    static void         Current(Infix *decl);
+};
+
+
+struct RewriteTimer
+// ----------------------------------------------------------------------------
+//   Time the calls entered while this object is alive
+// ----------------------------------------------------------------------------
+//   A call is timed from RewriteStats::Enter until the innermost timer
+//   ends, i.e. until the evaluation that made the call returns. A tail call
+//   to the declaration timed last by the same timer is counted, but timed
+//   with the pending call, so that tail recursion uses a single entry.
+{
+    enum { MAX_CALLS = 256 };           // Calls timed at once by a thread
+
+    struct Call
+    {
+        RewriteStats *  stats;
+        ulonglong       start;
+        ulong           allocations;
+    };
+
+    RewriteTimer(): active(RewriteStats::enabled)
+    {
+        if (active)
+            Push();
+    }
+    ~RewriteTimer()
+    {
+        if (active)
+            Pop();
+    }
+
+    void                Start(RewriteStats *stats);
+
+public:
+    bool                active;
+    uint                base;           // First call timed by this timer
+    RewriteTimer *      outer;
+
+    static __thread RewriteTimer *current;
+    static __thread uint          depth;
+    static __thread Call          calls[MAX_CALLS];
+
+private:
+    void                Push();
+    void                Pop();
+};
+
+ELIOT_END
+
+#endif // PROFILER_H
@@ -24,10 +24,13 @@
 #include "main.h"
 #include "save.h"
 #include "tree-clone.h"
+#include "profiler.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -35,10 +38,20 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
-
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#ifdef CONFIG_LINUX
+#include <sys/epoll.h>
+#endif
+
+#include <algorithm>
 #include <string>
 #include <sstream>
-#include <ext/stdio_filebuf.h>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
 
 
 ELIOT_BEGIN
@@ -46,15 +59,25 @@ ELIOT_BEGIN
 
 // ============================================================================
 //
-//    Global state (per thread?)
+//    Global state
 //
 // ============================================================================
+//  The request being evaluated is per thread, since the event-driven
+//  listener lets other threads evaluate while one waits in a builtin
+
+static uint                  active_children = 0;
+static __thread int          reply_socket    = 0;
+static __thread ulonglong    reply_id        = 0;
+static __thread bool         reply_discard   = false;
+static __thread pthread_mutex_t    *reply_lock  = NULL;
+static __thread struct RemoteCache *reply_cache = NULL;
+static __thread Tree *       received        = NULL;
+static Tree_p                hook            = eliot_true;
+static bool                  listening       = true;
 
-static uint        active_children = 0;
-static int         reply_socket    = 0;
-static Tree_p      received        = eliot_nil;
-static Tree_p      hook            = eliot_true;
-static bool        listening       = true;
+// Only one listener thread evaluates at a time, see BlockingCall
+static pthread_mutex_t       eval_lock       = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool         eval_locked     = false;
 
 
 
@@ -64,15 +87,286 @@ static bool        listening       = true;
 //
 // ============================================================================
 
-static Tree *eliot_read_tree(int sock)
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+struct RemoteInput
+// ----------------------------------------------------------------------------
+//   Ring buffer filled by recv, parsed in place by the deserializer
+// ----------------------------------------------------------------------------
+//   Positions 'start' and 'end' only increase, and are reduced with 'mask'
+//   when accessing 'data'. The buffer doubles in size when full.
+{
+    enum { INITIAL_SIZE = 4096 };
+
+    RemoteInput()
+        : data(new byte[INITIAL_SIZE]), mask(INITIAL_SIZE-1), start(0), end(0)
+    {}
+    ~RemoteInput()                      { delete[] data; }
+
+    size_t      Size()                  { return end - start; }
+    void        Skip(size_t size)       { start += size; }
+    ssize_t     Fill(int sock, bool wait);
+    bool        Unsigned(size_t &pos, ulonglong &value);
+
+    byte *      data;
+    size_t      mask;
+    size_t      start;
+    size_t      end;
+
+private:
+    RemoteInput(const RemoteInput &);
+    void        Grow();
+};
+
+
+void RemoteInput::Grow()
+// ----------------------------------------------------------------------------
+//   Double the size of the ring buffer, moving the data at the beginning
+// ----------------------------------------------------------------------------
+{
+    size_t capacity = mask + 1;
+    size_t size = Size();
+    size_t offset = start & mask;
+    size_t direct = std::min(size, capacity - offset);
+    byte *bigger = new byte[2 * capacity];
+    memcpy(bigger, data + offset, direct);
+    memcpy(bigger + direct, data, size - direct);
+    delete[] data;
+    data = bigger;
+    mask = 2 * capacity - 1;
+    start = 0;
+    end = size;
+}
+
+
+ssize_t RemoteInput::Fill(int sock, bool wait)
+// ----------------------------------------------------------------------------
+//   Receive as much as fits in the free space, return like recv
+// ----------------------------------------------------------------------------
+{
+    if (Size() == mask + 1)
+        Grow();
+
+    // The free space is at most two segments of the ring
+    size_t capacity = mask + 1;
+    size_t available = capacity - Size();
+    size_t offset = end & mask;
+    size_t direct = std::min(available, capacity - offset);
+    iovec iov[2];
+    iov[0].iov_base = data + offset;
+    iov[0].iov_len = direct;
+    iov[1].iov_base = data;
+    iov[1].iov_len = available - direct;
+
+    msghdr message = { 0 };
+    message.msg_iov = iov;
+    message.msg_iovlen = available > direct ? 2 : 1;
+
+    ssize_t got;
+    do
+        got = recvmsg(sock, &message, wait ? 0 : MSG_DONTWAIT);
+    while (got < 0 && errno == EINTR);
+    if (got > 0)
+        end += got;
+    return got;
+}
+
+
+bool RemoteInput::Unsigned(size_t &pos, ulonglong &value)
+// ----------------------------------------------------------------------------
+//   Decode an unsigned value at 'pos', return false if not all received
+// ----------------------------------------------------------------------------
+{
+    value = 0;
+    uint shift = 0;
+    byte b;
+    do
+    {
+        if (pos == end || shift >= 64)
+            return false;
+        b = data[pos++ & mask];
+        value |= ulonglong(b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return true;
+}
+
+
+static ulonglong remote_clock()
+// ----------------------------------------------------------------------------
+//   Return the current time in milliseconds
+// ----------------------------------------------------------------------------
+{
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return ulonglong(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+
+static const int REMOTE_POLL_SLICE = 50;       // Milliseconds
+
+
+BlockingCall::BlockingCall()
+// ----------------------------------------------------------------------------
+//   Let other listener threads evaluate while this one waits
+// ----------------------------------------------------------------------------
+//   The listener may cancel a thread while it waits, e.g. when it stops
+    : released(eval_locked)
+{
+    if (released)
+    {
+        eval_locked = false;
+        pthread_mutex_unlock(&eval_lock);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+}
+
+
+BlockingCall::~BlockingCall()
+// ----------------------------------------------------------------------------
+//   Wait until we can evaluate again
+// ----------------------------------------------------------------------------
+{
+    if (released)
+    {
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&eval_lock);
+        eval_locked = true;
+    }
+}
+
+
+static void remote_unlock(void *mutex)
+// ----------------------------------------------------------------------------
+//   Release a mutex held by a thread cancelled while waiting
+// ----------------------------------------------------------------------------
+{
+    if (mutex)
+        pthread_mutex_unlock((pthread_mutex_t *) mutex);
+}
+
+
+static int remote_wait(pollfd *fds, uint count, int timeout)
+// ----------------------------------------------------------------------------
+//   Poll without holding the evaluator, return like poll
+// ----------------------------------------------------------------------------
+//   Other listener threads may read the same pooled connections while we
+//   wait, so a listener thread checks what they queued for it regularly
+{
+    if (eval_locked && (timeout < 0 || timeout > REMOTE_POLL_SLICE))
+        timeout = REMOTE_POLL_SLICE;
+    BlockingCall blocking;
+    return poll(fds, count, timeout);
+}
+
+
+static void remote_send_timeout(int sock)
+// ----------------------------------------------------------------------------
+//   Bound the time blocking sends wait for the peer, see remote_send
+// ----------------------------------------------------------------------------
+{
+    uint timeout = MAIN->options.remote_send_timeout;
+    timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+static bool remote_send(int sock, iovec *iov, int count)
+// ----------------------------------------------------------------------------
+//   Write all the segments to the socket in one call if possible
+// ----------------------------------------------------------------------------
+//   A peer that does not read for 'remote_send_timeout' milliseconds makes
+//   the send fail. The socket is then shut down, since part of a frame may
+//   have been sent, and other senders on that socket fail immediately.
+{
+    msghdr message = { 0 };
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+    while (message.msg_iovlen)
+    {
+        ssize_t sent = sendmsg(sock, &message, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Blocking sockets already waited for SO_SNDTIMEO.
+                // Non-blocking ones are used by the event-driven listener
+                int ready = 0;
+                if (fcntl(sock, F_GETFL) & O_NONBLOCK)
+                {
+                    pollfd pfd = { sock, POLLOUT, 0 };
+                    do
+                        ready = poll(&pfd, 1,
+                                     MAIN->options.remote_send_timeout);
+                    while (ready < 0 && errno == EINTR);
+                }
+                if (ready > 0)
+                    continue;
+                std::cerr << "eliot_send: Peer did not read for "
+                          << MAIN->options.remote_send_timeout << "ms\n";
+                shutdown(sock, SHUT_RDWR);
+                errno = ETIMEDOUT;
+            }
+            return false;
+        }
+
+        // Skip what was sent, usually everything
+        while (message.msg_iovlen && size_t(sent) >= message.msg_iov->iov_len)
+        {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen)
+        {
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base+sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+
+static bool remote_send(int sock, const text &data)
+// ----------------------------------------------------------------------------
+//   Write a single buffer to the socket
+// ----------------------------------------------------------------------------
+{
+    iovec iov = { (void *) data.data(), data.length() };
+    return remote_send(sock, &iov, 1);
+}
+
+
+static Tree *eliot_read_tree(int sock, RemoteInput &input)
 // ----------------------------------------------------------------------------
 //   Read a tree directly from the socket
 // ----------------------------------------------------------------------------
+//   The legacy format has no length, so we feed what we receive to a
+//   stream deserializer until the tree is complete
 {
-    int fd = dup(sock);         // stdio_filebuf closes its fd in dtor
-    __gnu_cxx::stdio_filebuf<char> filebuf(fd, std::ios::in);
-    std::istream is(&filebuf);
-    return Deserializer::Read(is);
+    StreamDeserializer reader;
+    size_t fed = 0;
+    while (true)
+    {
+        if (input.Size() > fed)
+        {
+            if (!reader.Feed(input.data, input.mask,
+                             input.start + fed, input.end))
+                return NULL;
+            fed = input.Size();
+            if (reader.IsComplete())
+            {
+                input.Skip(reader.Consumed());
+                return reader.Result();
+            }
+        }
+        if (input.Fill(sock, true) <= 0)
+            return NULL;
+    }
 }
 
 
@@ -81,10 +375,9 @@ static void eliot_write_tree(int sock, Tree *tree)
 //   Write a tree directly into the socket
 // ----------------------------------------------------------------------------
 {
-    int fd = dup(sock);         // stdio_filebuf closes its fd in dtor
-    __gnu_cxx::stdio_filebuf<char> filebuf(fd, std::ios::out);
-    std::ostream os(&filebuf);
-    Serializer::Write(os, tree);
+    text data;
+    Serializer::Write(data, tree);
+    remote_send(sock, data);
 }
 
 
@@ -145,7 +438,7 @@ static Tree_p eliot_attach_context(Context *context, Tree *code)
 }
 
 
-static Tree *eliot_restore_nil(Tree *tree)
+Tree *eliot_restore_nil(Tree *tree)
 // ----------------------------------------------------------------------------
 //   Restore 'nil' names in the symbol tables
 // ----------------------------------------------------------------------------
@@ -178,6 +471,28 @@ static Tree *eliot_restore_nil(Tree *tree)
 }
 
 
+static Context *eliot_merge_symbols(Context *context, Tree *symbols)
+// ----------------------------------------------------------------------------
+//    Merge incoming symbols into the current context, return their context
+// ----------------------------------------------------------------------------
+{
+    // Walk up the chain for incoming symbols, stop at end
+    Context *codeCtx = context;
+    Scope *scope = symbols ? symbols->As<Scope>() : NULL;
+    if (scope)
+    {
+        scope = eliot_restore_nil(scope)->As<Scope>();
+        codeCtx = new Context(scope);
+        while (Scope *parent = ScopeParent(scope))
+            scope = parent;
+
+        // Reattach that end to current scope
+        scope->left = context->CurrentScope();
+    }
+    return codeCtx;
+}
+
+
 static Tree_p eliot_merge_context(Context *context, Tree *code)
 // ----------------------------------------------------------------------------
 //    Merge the code into the current running context
@@ -187,22 +502,9 @@ static Tree_p eliot_merge_context(Context *context, Tree *code)
     {
         if (Prefix *prefix = code->AsPrefix())
         {
-            Scope *scope = prefix->left->As<Scope>();
+            Context *codeCtx = eliot_merge_symbols(context, prefix->left);
             code = prefix->right;
 
-            // Walk up the chain for incoming symbols, stop at end
-            Context *codeCtx = context;
-            if (scope)
-            {
-                scope = eliot_restore_nil(scope)->As<Scope>();
-                codeCtx = new Context(scope);
-                while (Scope *parent = ScopeParent(scope))
-                    scope = parent;
-                
-                // Reattach that end to current scope
-                scope->left = context->CurrentScope();
-            }
-                
             // And make the resulting code a closure at that location
             code = MakeClosure(codeCtx, code);
         }
@@ -215,257 +517,2385 @@ static Tree_p eliot_merge_context(Context *context, Tree *code)
 
 // ============================================================================
 //
-//    Simple program exchange over TCP/IP
+//    Multiplexed connections
 //
 // ============================================================================
+//  A connection that begins with REMOTE_MUX_MAGIC carries a sequence of
+//  frames instead of a single serialized tree. Each frame holds a request ID,
+//  a frame kind, the payload length and the serialized tree itself.
+//  Frames for different requests may interleave on the same connection,
+//  which lets us keep one connection open per host and share it.
 
-static int eliot_send(Context *context, text host, Tree *code)
+const ulonglong REMOTE_MUX_MAGIC = 0x05121969;
+
+enum RemoteFrameKind
 // ----------------------------------------------------------------------------
-//   Send the text for the given body to the target host, return open fd
+//   The kind of frames exchanged on a multiplexed connection
 // ----------------------------------------------------------------------------
 {
-    // Compute port number
-    int port = ELIOT_DEFAULT_PORT;
-    size_t found = host.rfind(':');
-    if (found != std::string::npos)
-    {
-        text portText= host.substr(found+1);
-        port = atoi(portText.c_str());
-        if (!port)
-        {
-            std::cerr << "eliot_tell: Port '" << portText << " is invalid, "
-                      << "using " << ELIOT_DEFAULT_PORT << "\n";
-            port = ELIOT_DEFAULT_PORT;
-        }
-        host = host.substr(0, found);
-    }
-
-    // Open socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
-    {
-        std::cerr << "eliot_tell: Error opening socket: "
-                  << strerror(errno) << "\n";
-        return -1;
-    }
-
-    // Resolve server name
-    struct hostent *server = gethostbyname(host.c_str());
-    if (!server)
-    {
-        std::cerr << "eliot_tell: Error resolving server '" << host << "': "
-                  << strerror(errno) << "\n";
-        return -1;
-    }
-
-    // Initialize socket
-    sockaddr_in address = { 0 };
-    address.sin_family = AF_INET;
-    memcpy((char *) &address.sin_addr.s_addr,
-           (char *) server->h_addr,
-           server->h_length);
-    address.sin_port = htons(port);
-
-    // Connect
-    if (connect(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
-    {
-        std::cerr << "eliot_tell: Error connecting to '"
-                  << host << "' port " << port << ": "
-                  << strerror(errno) << "\n";
-        return -1;
-    }
-
-    // Attach the running context, i.e. all symbols we might need
-    code = eliot_attach_context(context, code);
-
-    // Write program to socket
-    eliot_write_tree(sock, code);
-
-    return sock;
-}
+    frameTELL,                  // Request, no reply expected
+    frameASK,                   // Request, replies and final result expected
+    frameREPLY,                 // Intermediate reply sent by eliot_reply
+    frameDONE,                  // Final result for a request
+    frameOPTIONS                // Capabilities, passed in the ID field
+};
 
 
-int eliot_tell(Context *context, text host, Tree *code)
+enum RemoteCapability
 // ----------------------------------------------------------------------------
-//   Send the text for the given body to the target host
+//   Capabilities negotiated with a frameOPTIONS exchange
 // ----------------------------------------------------------------------------
 {
-    IFTRACE(remote)
-        std::cerr << "eliot_tell: Telling " << host << ":\n"
-                  << code << "\n";
-    int sock = eliot_send(context, host, code);
-    if (sock < 0)
-        return sock;
-    close(sock);
-    return 0;
-}
+    remoteCACHE = 1,            // Declarations sent once, then by hash
+    remoteCOMPACT = 2           // Peer reads serialVERSION_COMPACT
+};
 
 
-Tree_p eliot_ask(Context *context, text host, Tree *code)
+struct RemoteFrame
 // ----------------------------------------------------------------------------
-//   Send code to the target, wait for reply
+//   A frame as read from a multiplexed connection
 // ----------------------------------------------------------------------------
 {
-    IFTRACE(remote)
-        std::cerr << "eliot_ask: Asking " << host << ":\n"
-                  << code << "\n";
-    int sock = eliot_send(context, host, code);
-    if (sock < 0)
-        return eliot_nil;
-
-    Tree_p result = eliot_read_tree(sock);
-    result = eliot_merge_context(context, result);
-    IFTRACE(remote)
-        std::cerr << "eliot_ask: Response from " << host << " was:\n"
-                  << result << "\n";
-    
-    close(sock);
-
-    return result;
-}
+    RemoteFrame(): id(0), kind(frameDONE), payload(0), length(0), tree() {}
+    ulonglong   id;
+    uint        kind;
+    size_t      payload;                // Position of payload in the input
+    size_t      length;                 // Length of payload
+    Tree_p      tree;                   // Decoded payload
+};
+typedef std::deque<RemoteFrame>                 remote_frames;
+typedef std::map<ulonglong, remote_frames>      remote_pending;
 
 
-Tree_p eliot_invoke(Context *context, text host, Tree *code)
+struct RemoteCache
 // ----------------------------------------------------------------------------
-//   Send code to the target, wait for multiple replies
+//   Declarations exchanged with the peer of a connection, by content hash
 // ----------------------------------------------------------------------------
+//   When 'learn' is set, we remember every declaration in the contexts
+//   we send or receive. When 'refer' is set, the peer does the same, so
+//   we can send a declaration we both know as a serialREFERENCE.
+//   When 'compact' is set, the peer reads the compact format.
 {
-    IFTRACE(remote)
-        std::cerr << "eliot_invoke: Invoking " << host << ":\n"
-                  << code << "\n";
-    int sock = eliot_send(context, host, code);
-    if (sock < 0)
-        return eliot_nil;
-
-    Tree_p result = eliot_nil;
-    while (true)
-    {
-        Tree_p response = eliot_read_tree(sock);
-        if (response == NULL)
-            break;
-        
-        IFTRACE(remote)
-            std::cerr << "eliot_invoke: Response from " << host << " was:\n"
-                      << response << "\n";
-        response = eliot_merge_context(context, response);
-        result = context->Evaluate(response);
-        if (result == eliot_nil)
-            break;
-    }
-    close(sock);
-
-    return result;
-}
-
-
+    RemoteCache(): learn(false), refer(false), compact(false), known() {}
+    bool                learn;
+    bool                refer;
+    bool                compact;
+    hash_trees          known;          // Declarations seen on both ends
+};
 
-// ============================================================================
-//
-//   Listening side
-//
-// ============================================================================
 
-static int child_wait(int flag)
+struct RemoteAddress
 // ----------------------------------------------------------------------------
-//   Wait for a child to die
+//   An address returned by getaddrinfo
 // ----------------------------------------------------------------------------
 {
-    int status = 0;
-    int childPID = waitpid(-1, &status, flag);
-    if (childPID < 0)
-        return childPID;
-    if (childPID > 0)
-    {
-        IFTRACE(remote)
-            std::cerr << "eliot_listen: Child PID " << childPID << " died "
-                      << (flag ? "nowait" : "wait") << "\n";
-        active_children--;
-        if (!flag && WIFEXITED(status))
-        {
-            int rc = WEXITSTATUS(status);
-            if (rc == 42)
-                listening = false;
-        }
-    }
-    return childPID;
-}
+    sockaddr_storage    address;
+    socklen_t           length;
+    int                 family;
+};
+typedef std::vector<RemoteAddress> remote_addresses;
 
 
-static void child_died(int)
+struct RemoteConnection
 // ----------------------------------------------------------------------------
-//    When a child dies, get its exit status
+//   A persistent connection to a given host, shared by in-flight requests
 // ----------------------------------------------------------------------------
 {
-    while (child_wait(WNOHANG) > 0)
-        /* Loop */;
-}
+    RemoteConnection(text key, int sock)
+        : key(key), sock(sock), owner(getpid()), nextId(0), users(0),
+          connecting(false), untried(),
+          pending(), abandoned(), input(), output(), cache() {}
+
+    text                key;            // "host:port" in the pool
+    int                 sock;           // Socket, -1 once broken
+    pid_t               owner;          // Process that opened the socket
+    ulonglong           nextId;         // Last request ID used
+    uint                users;          // Requests currently using it
+    bool                connecting;     // Non-blocking connect in progress
+    remote_addresses    untried;        // Addresses to try if connect fails
+    remote_pending      pending;        // Frames received for other requests
+    std::set<ulonglong> abandoned;      // Requests whose frames we discard
+    RemoteInput         input;          // Data received, not yet decoded
+    text                output;         // Reused for encoding requests
+    RemoteCache         cache;          // Declarations known on both ends
+};
+typedef std::map<text, RemoteConnection *> remote_pool_map;
+static remote_pool_map remote_pool;
 
+// A request is sent again once if its connection closes before the reply.
+// Listeners only close connections that are idle, so when this happens,
+// the peer closed the connection before it read the request.
+static const uint REMOTE_ATTEMPTS = 2;
 
 
-Tree_p  eliot_listen_received()
+static size_t remote_put_unsigned(byte *out, ulonglong value)
 // ----------------------------------------------------------------------------
-//    Return the incoming message before evaluation
+//   Encode an unsigned value the same way as Serializer::WriteUnsigned
 // ----------------------------------------------------------------------------
 {
-    return received;
+    size_t size = 0;
+    byte b;
+    do
+    {
+        b = value & 0x7F;
+        value >>= 7;
+        if (value != 0)
+            b |= 0x80;
+        out[size++] = b;
+    } while (b & 0x80);
+    return size;
 }
 
 
-Tree_p eliot_listen_hook(Tree *newHook)
+static bool remote_send_frame(int sock, ulonglong id, uint kind,
+                              const text &payload)
 // ----------------------------------------------------------------------------
-//   Set the listen hook, return the previous one
+//   Send a frame header and its already encoded payload in a single call
 // ----------------------------------------------------------------------------
 {
-    Tree_p result = hook;
-    if (newHook != eliot_nil)
-        hook = newHook;
-    return result;
+    byte header[32];
+    size_t size = remote_put_unsigned(header, id);
+    size += remote_put_unsigned(header + size, kind);
+    size += remote_put_unsigned(header + size, payload.length());
+
+    iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = size;
+    iov[1].iov_base = (void *) payload.data();
+    iov[1].iov_len = payload.length();
+    return remote_send(sock, iov, payload.length() ? 2 : 1);
 }
 
 
-int eliot_listen(Context *context, uint forking, uint port)
+static ulonglong remote_hash(Tree *tree, ulonglong hash = 0xcbf29ce484222325ULL)
 // ----------------------------------------------------------------------------
-//    Listen on the given port for sockets, evaluate programs when received
+//   Compute a content hash (64-bit FNV-1a) for a tree
 // ----------------------------------------------------------------------------
 {
-    // Open the socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0)
-    {
+    const ulonglong prime = 0x100000001b3ULL;
+#define HASH_BYTE(b)    (hash = (hash ^ byte(b)) * prime)
+#define HASH_TEXT(t)    for (uint c = 0; c < t.length(); c++) HASH_BYTE(t[c]); \
+                        HASH_BYTE(0)
+
+    if (!tree)
+        return HASH_BYTE(0xFF);
+
+    kind k = tree->Kind();
+    HASH_BYTE(k);
+    switch(k)
+    {
+    case INTEGER:
+    {
+        longlong value = ((Integer *) tree)->value;
+        for (uint i = 0; i < sizeof(value); i++)
+            HASH_BYTE(value >> (8 * i));
+        break;
+    }
+    case REAL:
+    {
+        double value = ((Real *) tree)->value;
+        byte *bytes = (byte *) &value;
+        for (uint i = 0; i < sizeof(value); i++)
+            HASH_BYTE(bytes[i]);
+        break;
+    }
+    case TEXT:
+    {
+        Text *t = (Text *) tree;
+        HASH_TEXT(t->opening);
+        HASH_TEXT(t->value);
+        HASH_TEXT(t->closing);
+        break;
+    }
+    case NAME:
+    {
+        Name *n = (Name *) tree;
+        HASH_TEXT(n->value);
+        break;
+    }
+    case BLOCK:
+    {
+        Block *b = (Block *) tree;
+        HASH_TEXT(b->opening);
+        HASH_TEXT(b->closing);
+        hash = remote_hash(b->child, hash);
+        break;
+    }
+    case PREFIX:
+    {
+        Prefix *p = (Prefix *) tree;
+        hash = remote_hash(p->left, hash);
+        hash = remote_hash(p->right, hash);
+        break;
+    }
+    case POSTFIX:
+    {
+        Postfix *p = (Postfix *) tree;
+        hash = remote_hash(p->left, hash);
+        hash = remote_hash(p->right, hash);
+        break;
+    }
+    case INFIX:
+    {
+        Infix *i = (Infix *) tree;
+        HASH_TEXT(i->name);
+        hash = remote_hash(i->left, hash);
+        hash = remote_hash(i->right, hash);
+        break;
+    }
+    }
+
+#undef HASH_TEXT
+#undef HASH_BYTE
+    return hash;
+}
+
+
+static void remote_declarations(Tree *message, RewriteList &decls)
+// ----------------------------------------------------------------------------
+//   Collect the declarations in the context attached to a message
+// ----------------------------------------------------------------------------
+//   Messages built by eliot_attach_context are a Prefix with the symbol
+//   table on the left, and each scope holds a tree of rewrites
+{
+    Prefix *prefix = message ? message->AsPrefix() : NULL;
+    if (!prefix)
+        return;
+
+    RewriteList todo;
+    for (Scope *scope = prefix->left->AsPrefix();
+         scope;
+         scope = ScopeParent(scope))
+    {
+        if (Rewrite *rw = ScopeRewrites(scope))
+            todo.push_back(rw);
+        while (todo.size())
+        {
+            Rewrite *rw = todo.back();
+            todo.pop_back();
+            if (Infix *decl = RewriteDeclaration(rw))
+                decls.push_back(decl);
+            if (RewriteChildren *children = RewriteNext(rw))
+            {
+                if (Rewrite *left = children->left->AsInfix())
+                    todo.push_back(left);
+                if (Rewrite *right = children->right->AsInfix())
+                    todo.push_back(right);
+            }
+        }
+    }
+}
+
+
+static void remote_encode(text &payload, Tree *tree,
+                          RemoteCache *cache = NULL, bool context = true)
+// ----------------------------------------------------------------------------
+//   Encode a tree in a reused buffer (a NULL tree has no payload)
+// ----------------------------------------------------------------------------
+//   If a cache is given and the tree is a message with context, we
+//   replace the declarations the peer already has with their hash
+{
+    payload.clear();
+    if (!tree)
+        return;
+
+    SerializationFormat format = serialSTANDARD;
+    if (cache && cache->compact)
+        format = MAIN->options.remote_compress ? serialCOMPRESSED
+                                               : serialCOMPACT;
+
+    tree_hashes references;
+    if (cache && cache->learn && context)
+    {
+        RewriteList decls;
+        remote_declarations(tree, decls);
+        std::vector<ulonglong> hashes;
+        RewriteList::iterator d;
+        for (d = decls.begin(); d != decls.end(); d++)
+        {
+            ulonglong hash = remote_hash(*d);
+            hashes.push_back(hash);
+            if (cache->refer && cache->known.count(hash))
+                references[*d] = hash;
+        }
+
+        // The peer only learns new declarations once it read the message
+        for (uint i = 0; i < hashes.size(); i++)
+            if (!cache->known.count(hashes[i]))
+                cache->known[hashes[i]] = decls[i];
+        IFTRACE(remote)
+            std::cerr << "remote_encode: " << references.size() << " of "
+                      << decls.size() << " declarations sent by hash\n";
+    }
+
+    Serializer serializer(payload, references.size() ? &references : NULL,
+                          format);
+    tree->Do(serializer);
+    serializer.Finish();
+}
+
+
+static void remote_learn(RemoteCache *cache, Tree *message)
+// ----------------------------------------------------------------------------
+//   Remember declarations received with a message so we can refer to them
+// ----------------------------------------------------------------------------
+{
+    if (!cache || !cache->learn)
+        return;
+
+    RewriteList decls;
+    remote_declarations(message, decls);
+    RewriteList::iterator d;
+    for (d = decls.begin(); d != decls.end(); d++)
+    {
+        ulonglong hash = remote_hash(*d);
+        if (!cache->known.count(hash))
+            cache->known[hash] = *d;
+    }
+}
+
+
+static bool remote_frame_header(RemoteInput &input, RemoteFrame &frame)
+// ----------------------------------------------------------------------------
+//   Decode the header of the next frame, return true if received
+// ----------------------------------------------------------------------------
+{
+    size_t pos = input.start;
+    ulonglong kind = 0, length = 0;
+    if (!input.Unsigned(pos, frame.id) ||
+        !input.Unsigned(pos, kind) ||
+        !input.Unsigned(pos, length))
+        return false;
+    frame.kind = kind;
+    frame.payload = pos;
+    frame.length = length;
+    return true;
+}
+
+
+static bool remote_frame_ready(RemoteInput &input, RemoteFrame &frame)
+// ----------------------------------------------------------------------------
+//   Decode the header of the next frame, return true if fully received
+// ----------------------------------------------------------------------------
+{
+    return remote_frame_header(input, frame) &&
+        input.end - frame.payload >= frame.length;
+}
+
+
+static void remote_frame_take(RemoteInput &input, RemoteFrame &frame,
+                              bool decode, RemoteCache *cache)
+// ----------------------------------------------------------------------------
+//   Consume a frame checked by remote_frame_ready, decoding it if needed
+// ----------------------------------------------------------------------------
+//   When we learn declarations, we must decode every message carrying
+//   a context, since the peer assumes we saw what it sent
+{
+    bool context = frame.kind != frameDONE && frame.kind != frameOPTIONS;
+    if (cache && cache->learn && context)
+        decode = true;
+
+    frame.tree = NULL;
+    if (decode && frame.length)
+    {
+        size_t end = frame.payload + frame.length;
+        Deserializer reader(input.data, input.mask, frame.payload, end,
+                            cache ? &cache->known : NULL);
+        frame.tree = reader.ReadTree();
+        if (context)
+            remote_learn(cache, frame.tree);
+    }
+    input.start = frame.payload + frame.length;
+}
+
+
+static bool remote_options(int sock, RemoteFrame &frame, RemoteCache &cache)
+// ----------------------------------------------------------------------------
+//   Listening side of the capabilities negotiation, return true if handled
+// ----------------------------------------------------------------------------
+{
+    if (frame.kind != frameOPTIONS)
+        return false;
+
+    ulonglong accepted = 0;
+    if ((frame.id & remoteCACHE) && MAIN->options.remote_cache)
+    {
+        accepted |= remoteCACHE;
+        cache.learn = cache.refer = true;
+    }
+    if ((frame.id & remoteCOMPACT) && MAIN->options.remote_compact)
+    {
+        accepted |= remoteCOMPACT;
+        cache.compact = true;
+    }
+    IFTRACE(remote)
+        std::cerr << "eliot_listen: Options " << frame.id
+                  << " accepted " << accepted << "\n";
+    remote_send_frame(sock, accepted, frameOPTIONS, text());
+    return true;
+}
+
+
+static int remote_multiplexed(RemoteInput &input)
+// ----------------------------------------------------------------------------
+//   Check if input starts with the multiplexing magic, -1 if too early
+// ----------------------------------------------------------------------------
+//   The legacy format begins with serialMAGIC, which differs in the first
+//   byte, so we can tell as soon as the first bytes arrive
+{
+    byte magic[16];
+    size_t size = remote_put_unsigned(magic, REMOTE_MUX_MAGIC);
+    for (size_t i = 0; i < size; i++)
+    {
+        if (input.start + i == input.end)
+            return -1;
+        if (input.data[(input.start + i) & input.mask] != magic[i])
+            return 0;
+    }
+    input.Skip(size);
+    return 1;
+}
+
+
+
+// ============================================================================
+//
+//    Host name resolution
+//
+// ============================================================================
+//  Addresses are kept for -dnsttl seconds, failures for a few seconds.
+//  An entry used in the last quarter of its life is resolved again by
+//  a background thread, so hosts we talk to often are never resolved
+//  while a request waits.
+
+static const uint REMOTE_NEGATIVE_TTL = 5;      // Seconds for failures
+
+
+struct RemoteResolved
+// ----------------------------------------------------------------------------
+//   The result of resolving a host name, as kept in the cache
+// ----------------------------------------------------------------------------
+{
+    RemoteResolved()
+        : addresses(), error(0), resolved(0), expires(0), refreshing(false) {}
+    remote_addresses    addresses;
+    int                 error;          // getaddrinfo error, 0 if resolved
+    ulonglong           resolved;       // Time of resolution (ms)
+    ulonglong           expires;        // Time the entry is no longer used
+    bool                refreshing;     // Background refresh in progress
+};
+typedef std::map<text, RemoteResolved> remote_resolved_map;
+
+
+struct RemoteRefresh
+// ----------------------------------------------------------------------------
+//   Arguments for a background refresh
+// ----------------------------------------------------------------------------
+{
+    text                key;
+    text                host;
+    uint                port;
+};
+
+
+static pthread_mutex_t     resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static remote_resolved_map resolve_cache;
+
+
+static void remote_resolve_now(text host, uint port, RemoteResolved &result)
+// ----------------------------------------------------------------------------
+//   Resolve a host name with getaddrinfo, bypassing the cache
+// ----------------------------------------------------------------------------
+{
+    addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    snprintf(service, sizeof(service), "%u", port);
+
+    addrinfo *list = NULL;
+    result.error = getaddrinfo(host.c_str(), service, &hints, &list);
+    result.addresses.clear();
+    for (addrinfo *info = list; info; info = info->ai_next)
+    {
+        RemoteAddress address;
+        memcpy(&address.address, info->ai_addr, info->ai_addrlen);
+        address.length = info->ai_addrlen;
+        address.family = info->ai_family;
+        result.addresses.push_back(address);
+    }
+    if (list)
+        freeaddrinfo(list);
+    if (!result.error && result.addresses.empty())
+        result.error = EAI_NONAME;
+
+    ulonglong ttl = MAIN->options.resolve_ttl;
+    if (result.error)
+        ttl = std::min(ttl, (ulonglong) REMOTE_NEGATIVE_TTL);
+    result.resolved = remote_clock();
+    result.expires = result.resolved + 1000 * ttl;
+    result.refreshing = false;
+}
+
+
+static void *remote_refresh(void *arg)
+// ----------------------------------------------------------------------------
+//   Resolve a host name again in the background
+// ----------------------------------------------------------------------------
+{
+    RemoteRefresh *refresh = (RemoteRefresh *) arg;
+    RemoteResolved fresh;
+    remote_resolve_now(refresh->host, refresh->port, fresh);
+
+    pthread_mutex_lock(&resolve_lock);
+    RemoteResolved &entry = resolve_cache[refresh->key];
+    entry.refreshing = false;
+    if (!fresh.error || entry.error)
+        entry = fresh;
+    pthread_mutex_unlock(&resolve_lock);
+
+    IFTRACE(remote)
+        std::cerr << "eliot_tell: Refreshed " << refresh->key << "\n";
+    delete refresh;
+    return NULL;
+}
+
+
+static bool remote_resolve(text host, uint port, remote_addresses &addresses)
+// ----------------------------------------------------------------------------
+//   Find the addresses for a host, using the cache if possible
+// ----------------------------------------------------------------------------
+//   Failures are cached too, and only reported on the first failed lookup
+{
+    std::ostringstream keyStream;
+    keyStream << host << ":" << port;
+    text key = keyStream.str();
+    ulonglong now = remote_clock();
+    int error = 0;
+    bool report = false;
+
+    pthread_mutex_lock(&resolve_lock);
+    remote_resolved_map::iterator found = resolve_cache.find(key);
+    bool known = found != resolve_cache.end();
+    bool cached = known && now < found->second.expires;
+    int previous = known ? found->second.error : 0;
+    if (cached)
+    {
+        RemoteResolved &entry = found->second;
+        addresses = entry.addresses;
+        error = entry.error;
+
+        // Refresh entries in use before they expire
+        ulonglong ttl = entry.expires - entry.resolved;
+        if (!error && !entry.refreshing && now > entry.expires - ttl / 4)
+        {
+            RemoteRefresh *refresh = new RemoteRefresh;
+            refresh->key = key;
+            refresh->host = host;
+            refresh->port = port;
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, remote_refresh, refresh) == 0)
+            {
+                pthread_detach(thread);
+                entry.refreshing = true;
+            }
+            else
+            {
+                delete refresh;
+            }
+        }
+    }
+    pthread_mutex_unlock(&resolve_lock);
+
+    if (!cached)
+    {
+        RemoteResolved entry;
+        remote_resolve_now(host, port, entry);
+        addresses = entry.addresses;
+        error = entry.error;
+        pthread_mutex_lock(&resolve_lock);
+        resolve_cache[key] = entry;
+        pthread_mutex_unlock(&resolve_lock);
+
+        // Report a failure once, not each time the negative entry expires
+        report = error && error != previous;
+    }
+
+    IFTRACE(remote)
+        std::cerr << "eliot_tell: " << key << (cached ? " cached" : " resolved")
+                  << " with " << addresses.size() << " addresses\n";
+    if (report)
+        std::cerr << "eliot_tell: Error resolving server '" << host << "': "
+                  << gai_strerror(error) << "\n";
+    return !error;
+}
+
+
+static int remote_listen_socket(uint port)
+// ----------------------------------------------------------------------------
+//   Open a socket bound to the given port for IPv6 and IPv4 clients
+// ----------------------------------------------------------------------------
+{
+    // Prefer an IPv6 socket that also accepts IPv4 clients
+    int sock = socket(AF_INET6, SOCK_STREAM, 0);
+    bool ipv6 = sock >= 0;
+    if (!ipv6)
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
         std::cerr << "eliot_listen: Error opening socket: "
                   << strerror(errno) << "\n";
         return -1;
     }
 
-    int option = 1;
-    if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR,
-                    (char *)&option, sizeof (option)) < 0)
-        std::cerr << "eliot_listen: Error setting SO_REUSEADDR: "
-                  << strerror(errno) << "\n";
+    int option = 1;
+    if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR,
+                    (char *)&option, sizeof (option)) < 0)
+        std::cerr << "eliot_listen: Error setting SO_REUSEADDR: "
+                  << strerror(errno) << "\n";
+
+    int result;
+    if (ipv6)
+    {
+        option = 0;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY,
+                   (char *) &option, sizeof(option));
+        struct sockaddr_in6 address;
+        memset(&address, 0, sizeof(address));
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(port);
+        result = bind(sock, (struct sockaddr *) &address, sizeof(address));
+    }
+    else
+    {
+        struct sockaddr_in address = { 0 };
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+        result = bind(sock, (struct sockaddr *) &address, sizeof(address));
+    }
+    if (result < 0)
+    {
+        std::cerr << "eliot_listen: Error binding to port " << port << ": "
+                  << strerror(errno) << "\n";
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+
+// ============================================================================
+//
+//    Connection pool on the sending side
+//
+// ============================================================================
+
+static int remote_connect_next(remote_addresses &addresses, bool wait,
+                               int &error)
+// ----------------------------------------------------------------------------
+//   Connect to the first address that works, removing those we tried
+// ----------------------------------------------------------------------------
+{
+    while (!addresses.empty())
+    {
+        RemoteAddress address = addresses.front();
+        addresses.erase(addresses.begin());
+        int sock = socket(address.family, SOCK_STREAM, 0);
+        if (sock < 0)
+        {
+            error = errno;
+            continue;
+        }
+        if (!wait)
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        remote_send_timeout(sock);
+        if (connect(sock, (struct sockaddr *) &address.address,
+                    address.length) == 0 ||
+            (!wait && errno == EINPROGRESS))
+            return sock;
+        error = errno;
+        close(sock);
+    }
+    return -1;
+}
+
+
+static int remote_connect(text host, uint port, bool wait,
+                          remote_addresses *untried = NULL)
+// ----------------------------------------------------------------------------
+//   Open a connection to the given host and port, return open fd or -1
+// ----------------------------------------------------------------------------
+//   If 'wait' is false, the socket is left non-blocking and the connection
+//   may still be in progress, see remote_connected. The addresses not
+//   tried yet are then returned in 'untried'.
+//   Resolving the name still blocks if it is not in the cache.
+{
+    remote_addresses addresses;
+    if (!remote_resolve(host, port, addresses))
+        return -1;
+
+    // Try all addresses, e.g. an IPv4 server for a name with IPv6 first
+    int error = 0;
+    int sock = remote_connect_next(addresses, wait, error);
+    if (sock >= 0)
+    {
+        if (untried)
+            untried->swap(addresses);
+        return sock;
+    }
+
+    std::cerr << "eliot_tell: Error connecting to '"
+              << host << "' port " << port << ": "
+              << strerror(error) << "\n";
+    errno = error;
+    return -1;
+}
+
+
+static bool remote_greet(RemoteConnection *conn, bool negotiate = true)
+// ----------------------------------------------------------------------------
+//   Send what starts a multiplexed connection, once connected
+// ----------------------------------------------------------------------------
+{
+    // Announce that we use multiplexed frames on this connection
+    byte magic[16];
+    iovec iov = { magic, remote_put_unsigned(magic, REMOTE_MUX_MAGIC) };
+    bool ok = remote_send(conn->sock, &iov, 1);
+
+    // Offer to send known declarations by hash, learn until answered,
+    // and offer to read the compact format
+    ulonglong offer = 0;
+    if (negotiate && MAIN->options.remote_cache)
+    {
+        conn->cache.learn = true;
+        offer |= remoteCACHE;
+    }
+    if (negotiate && MAIN->options.remote_compact)
+        offer |= remoteCOMPACT;
+    if (ok && offer)
+        ok = remote_send_frame(conn->sock, offer, frameOPTIONS, text());
+
+    if (!ok)
+        std::cerr << "eliot_tell: Error writing to '" << conn->key << "': "
+                  << strerror(errno) << "\n";
+    return ok;
+}
+
+
+static bool remote_connected(RemoteConnection *conn)
+// ----------------------------------------------------------------------------
+//   Complete a non-blocking connect once the socket is writable
+// ----------------------------------------------------------------------------
+{
+    int error = 0;
+    socklen_t size = sizeof(error);
+    if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &error, &size) < 0)
+        error = errno;
+    if (error)
+    {
+        // Try the next address, we will be called again once it connects
+        IFTRACE(remote)
+            std::cerr << "eliot_tell: Error connecting to '" << conn->key
+                      << "', " << conn->untried.size() << " more addresses: "
+                      << strerror(error) << "\n";
+        close(conn->sock);
+        conn->sock = remote_connect_next(conn->untried, false, error);
+        if (conn->sock >= 0)
+            return true;
+        std::cerr << "eliot_tell: Error connecting to '" << conn->key << "': "
+                  << strerror(error) << "\n";
+        return false;
+    }
+
+    // Pooled connections are used with blocking I/O
+    fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL) & ~O_NONBLOCK);
+    conn->connecting = false;
+    return remote_greet(conn);
+}
+
+
+static bool remote_alive(RemoteConnection *conn)
+// ----------------------------------------------------------------------------
+//   Check if a pooled connection can still be used by this process
+// ----------------------------------------------------------------------------
+{
+    if (conn->sock < 0 || conn->owner != getpid())
+        return false;
+    if (conn->connecting)
+        return true;
+
+    // Detect a peer that closed the connection while it was idle
+    pollfd pfd = { conn->sock, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0)
+        return true;
+    if (pfd.revents & (POLLERR | POLLNVAL))
+        return false;
+    char c;
+    ssize_t got = recv(conn->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return got > 0 || (got < 0 && (errno == EAGAIN || errno == EINTR));
+}
+
+
+static void remote_break(RemoteConnection *conn)
+// ----------------------------------------------------------------------------
+//   Remove a connection from the pool after an error or on close
+// ----------------------------------------------------------------------------
+{
+    remote_pool_map::iterator found = remote_pool.find(conn->key);
+    if (found != remote_pool.end() && found->second == conn)
+        remote_pool.erase(found);
+
+    // A child process must not shut down the socket of its parent
+    if (conn->sock >= 0)
+        close(conn->sock);
+    conn->sock = -1;
+    conn->pending.clear();
+    conn->abandoned.clear();
+}
+
+
+static void remote_release(RemoteConnection *conn)
+// ----------------------------------------------------------------------------
+//   Release a connection after a request, delete it if no longer needed
+// ----------------------------------------------------------------------------
+{
+    conn->users--;
+    if (!MAIN->options.remote_pool && conn->users == 0)
+        remote_break(conn);
+    if (conn->sock < 0 && conn->users == 0)
+        delete conn;
+}
+
+
+static text remote_address(text &host, uint &port)
+// ----------------------------------------------------------------------------
+//   Split 'host' into a host name and a port number, return "host:port"
+// ----------------------------------------------------------------------------
+{
+    port = ELIOT_DEFAULT_PORT;
+    size_t found = host.rfind(':');
+    if (found != std::string::npos)
+    {
+        text portText= host.substr(found+1);
+        port = atoi(portText.c_str());
+        if (!port)
+        {
+            std::cerr << "eliot_tell: Port '" << portText << " is invalid, "
+                      << "using " << ELIOT_DEFAULT_PORT << "\n";
+            port = ELIOT_DEFAULT_PORT;
+        }
+        host = host.substr(0, found);
+    }
+
+    std::ostringstream keyStream;
+    keyStream << host << ":" << port;
+    return keyStream.str();
+}
+
+
+static RemoteConnection *remote_connection(text host, bool wait = true)
+// ----------------------------------------------------------------------------
+//   Find or open a connection for the given host
+// ----------------------------------------------------------------------------
+//   If 'wait' is false, a new connection may still be connecting on return
+{
+    // Check if we already have a live connection for that host
+    uint port = 0;
+    text key = remote_address(host, port);
+    remote_pool_map::iterator existing = remote_pool.find(key);
+    if (existing != remote_pool.end())
+    {
+        RemoteConnection *conn = existing->second;
+        if (remote_alive(conn))
+        {
+            conn->users++;
+            return conn;
+        }
+        IFTRACE(remote)
+            std::cerr << "eliot_tell: Connection to " << key << " lost\n";
+        conn->users++;
+        remote_break(conn);
+        remote_release(conn);
+    }
+
+    // Open a new connection
+    remote_addresses untried;
+    int sock = remote_connect(host, port, wait, &untried);
+    if (sock < 0)
+        return NULL;
+    IFTRACE(remote)
+        std::cerr << "eliot_tell: New connection to " << key << "\n";
+    RemoteConnection *conn = new RemoteConnection(key, sock);
+    conn->connecting = !wait;
+    conn->untried.swap(untried);
+    if (wait && !remote_greet(conn))
+    {
+        close(sock);
+        delete conn;
+        return NULL;
+    }
+    if (MAIN->options.remote_pool)
+        remote_pool[key] = conn;
+    conn->users++;
+    return conn;
+}
+
+
+static void remote_accepted(RemoteConnection *conn, RemoteFrame &frame)
+// ----------------------------------------------------------------------------
+//   Record the capabilities the listener accepted for that connection
+// ----------------------------------------------------------------------------
+{
+    conn->cache.refer = conn->cache.learn && (frame.id & remoteCACHE);
+    conn->cache.compact = (frame.id & remoteCOMPACT) != 0;
+    IFTRACE(remote)
+        std::cerr << "eliot_tell: Options accepted by " << conn->key
+                  << ": " << frame.id << "\n";
+}
+
+
+static bool remote_poll(RemoteConnection *conn)
+// ----------------------------------------------------------------------------
+//   Process frames already received without waiting, false if closed
+// ----------------------------------------------------------------------------
+//   A client that only uses 'tell' never waits for responses, but
+//   must still see the listener accept options
+{
+    ssize_t got = conn->input.Fill(conn->sock, false);
+    bool open = got > 0 || (got < 0 && (errno == EAGAIN || errno == EINTR ||
+                                        errno == EWOULDBLOCK));
+
+    RemoteFrame frame;
+    while (remote_frame_ready(conn->input, frame))
+    {
+        bool dropped = conn->abandoned.count(frame.id);
+        remote_frame_take(conn->input, frame, !dropped, &conn->cache);
+        if (frame.kind == frameOPTIONS)
+            remote_accepted(conn, frame);
+        else if (!dropped)
+            conn->pending[frame.id].push_back(frame);
+        else if (frame.kind == frameDONE)
+            conn->abandoned.erase(frame.id);
+    }
+    return open;
+}
+
+
+static RemoteConnection *remote_request(Context *context, text host,
+                                        Tree *code, uint kind, ulonglong &id)
+// ----------------------------------------------------------------------------
+//   Send a request frame to the given host, return the connection used
+// ----------------------------------------------------------------------------
+{
+    // Attach the running context, i.e. all symbols we might need
+    Tree_p message = eliot_attach_context(context, code);
+
+    // A pooled connection may have been closed by the peer since last use
+    for (uint attempt = 0; attempt < REMOTE_ATTEMPTS; attempt++)
+    {
+        RemoteConnection *conn = remote_connection(host);
+        if (!conn)
+            return NULL;
+
+        id = ++conn->nextId;
+        remote_poll(conn);
+        remote_encode(conn->output, message, &conn->cache);
+        if (remote_send_frame(conn->sock, id, kind, conn->output))
+            return conn;
+
+        std::cerr << "eliot_tell: Error writing to '" << conn->key << "': "
+                  << strerror(errno) << "\n";
+        remote_break(conn);
+        remote_release(conn);
+    }
+    return NULL;
+}
+
+
+static bool remote_queued(RemoteConnection *conn, ulonglong id,
+                          RemoteFrame &frame)
+// ----------------------------------------------------------------------------
+//   Get a frame for request 'id' that was already received, if any
+// ----------------------------------------------------------------------------
+{
+    remote_pending::iterator queued = conn->pending.find(id);
+    if (queued == conn->pending.end())
+        return false;
+    frame = queued->second.front();
+    queued->second.pop_front();
+    if (queued->second.empty())
+        conn->pending.erase(queued);
+    return true;
+}
+
+
+static bool remote_response(RemoteConnection *conn, ulonglong id,
+                            RemoteFrame &frame)
+// ----------------------------------------------------------------------------
+//   Get the next frame for request 'id', keeping frames for other requests
+// ----------------------------------------------------------------------------
+{
+    while (true)
+    {
+        // Another listener thread may have read our frame while we waited
+        if (remote_queued(conn, id, frame))
+            return true;
+        if (conn->sock < 0)
+            return false;
+
+        if (!remote_frame_ready(conn->input, frame))
+        {
+            pollfd pfd = { conn->sock, POLLIN, 0 };
+            if (remote_wait(&pfd, 1, -1) == 0 || conn->sock < 0)
+                continue;
+            ssize_t got = conn->input.Fill(conn->sock, false);
+            if (got == 0 || (got < 0 && errno != EAGAIN &&
+                             errno != EWOULDBLOCK && errno != EINTR))
+            {
+                IFTRACE(remote)
+                    std::cerr << "eliot_ask: Connection to " << conn->key
+                              << " closed\n";
+                remote_break(conn);
+                return false;
+            }
+            continue;
+        }
+
+        // Frames for requests we gave up on are skipped without decoding
+        bool dropped = conn->abandoned.count(frame.id);
+        remote_frame_take(conn->input, frame, !dropped, &conn->cache);
+        if (frame.kind == frameOPTIONS)
+        {
+            remote_accepted(conn, frame);
+            continue;
+        }
+        if (frame.id == id)
+            return true;
+        if (dropped)
+        {
+            if (frame.kind == frameDONE)
+                conn->abandoned.erase(frame.id);
+            continue;
+        }
+        conn->pending[frame.id].push_back(frame);
+    }
+}
+
+
+static void remote_abandon(RemoteConnection *conn, ulonglong id)
+// ----------------------------------------------------------------------------
+//   Discard any further frames for a request we are no longer waiting for
+// ----------------------------------------------------------------------------
+{
+    bool done = false;
+    remote_pending::iterator queued = conn->pending.find(id);
+    if (queued != conn->pending.end())
+    {
+        remote_frames &frames = queued->second;
+        for (remote_frames::iterator f = frames.begin(); f != frames.end(); f++)
+            if ((*f).kind == frameDONE)
+                done = true;
+        conn->pending.erase(queued);
+    }
+    if (!done && conn->sock >= 0)
+        conn->abandoned.insert(id);
+}
+
+
+
+// ============================================================================
+//
+//    Simple program exchange over TCP/IP
+//
+// ============================================================================
+
+int eliot_tell(Context *context, text host, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send the text for the given body to the target host
+// ----------------------------------------------------------------------------
+{
+    IFTRACE(remote)
+        std::cerr << "eliot_tell: Telling " << host << ":\n"
+                  << code << "\n";
+    ulonglong id = 0;
+    RemoteConnection *conn = remote_request(context, host, code, frameTELL, id);
+    if (!conn)
+        return -1;
+    remote_release(conn);
+    return 0;
+}
+
+
+Tree_p eliot_ask(Context *context, text host, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send code to the target, wait for reply
+// ----------------------------------------------------------------------------
+{
+    IFTRACE(remote)
+        std::cerr << "eliot_ask: Asking " << host << ":\n"
+                  << code << "\n";
+
+    // If the connection was closed under us, send again on a new one
+    RemoteFrame frame;
+    bool gotReply = false;
+    for (uint attempt = 0; !gotReply && attempt < REMOTE_ATTEMPTS; attempt++)
+    {
+        ulonglong id = 0;
+        RemoteConnection *conn = remote_request(context, host, code,
+                                                frameASK, id);
+        if (!conn)
+            return eliot_nil;
+        gotReply = remote_response(conn, id, frame);
+        if (gotReply && frame.kind != frameDONE)
+            remote_abandon(conn, id);
+        remote_release(conn);
+    }
+    if (!gotReply)
+    {
+        std::cerr << "eliot_ask: Connection to '" << host
+                  << "' closed before the reply\n";
+        return eliot_nil;
+    }
+
+    Tree_p result = eliot_merge_context(context, frame.tree);
+    IFTRACE(remote)
+        std::cerr << "eliot_ask: Response from " << host << " was:\n"
+                  << result << "\n";
+
+    return result;
+}
+
+
+Tree_p eliot_invoke(Context *context, text host, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send code to the target, wait for multiple replies
+// ----------------------------------------------------------------------------
+{
+    IFTRACE(remote)
+        std::cerr << "eliot_invoke: Invoking " << host << ":\n"
+                  << code << "\n";
+    // Until we got a first frame, we can send again on a new connection
+    Tree_p result = eliot_nil;
+    bool done = false, started = false;
+    ulonglong id = 0;
+    RemoteConnection *conn = NULL;
+    RemoteFrame frame;
+    for (uint attempt = 0; !started && attempt < REMOTE_ATTEMPTS; attempt++)
+    {
+        if (conn)
+            remote_release(conn);
+        conn = remote_request(context, host, code, frameASK, id);
+        if (!conn)
+            return eliot_nil;
+        started = remote_response(conn, id, frame);
+    }
+    if (!started)
+        std::cerr << "eliot_invoke: Connection to '" << host
+                  << "' closed before the reply\n";
+
+    while (started && !done)
+    {
+        done = frame.kind == frameDONE;
+        Tree_p response = frame.tree;
+        if (response == NULL)
+            break;
+
+        IFTRACE(remote)
+            std::cerr << "eliot_invoke: Response from " << host << " was:\n"
+                      << response << "\n";
+        response = eliot_merge_context(context, response);
+        result = context->Evaluate(response);
+        if (result == eliot_nil)
+            break;
+        if (!done && !remote_response(conn, id, frame))
+            break;
+    }
+    if (!done)
+        remote_abandon(conn, id);
+    remote_release(conn);
+
+    return result;
+}
+
+
+
+// ============================================================================
+//
+//    Sending the same program to many hosts concurrently
+//
+// ============================================================================
+
+struct RemoteAsk
+// ----------------------------------------------------------------------------
+//   The state of one host in an ask_all request
+// ----------------------------------------------------------------------------
+{
+    RemoteAsk()
+        : host(), conn(NULL), id(0), attempts(0),
+          sending(true), waiting(false), result() {}
+    text                host;
+    RemoteConnection *  conn;
+    ulonglong           id;
+    uint                attempts;       // Number of times request was sent
+    bool                sending;        // Request must be sent (again)
+    bool                waiting;        // Request sent, no reply yet
+    Tree_p              result;
+};
+typedef std::vector<RemoteAsk> remote_asks;
+
+
+static void remote_hosts(Context *context, Tree *hosts, remote_asks &asks,
+                         bool evaluate = true)
+// ----------------------------------------------------------------------------
+//   Collect host names from a text or a list, evaluating names if needed
+// ----------------------------------------------------------------------------
+{
+    switch(hosts->Kind())
+    {
+    case TEXT:
+        asks.push_back(RemoteAsk());
+        asks.back().host = ((Text *) hosts)->value;
+        return;
+    case BLOCK:
+        remote_hosts(context, ((Block *) hosts)->child, asks, evaluate);
+        return;
+    case INFIX:
+    {
+        Infix *infix = (Infix *) hosts;
+        if (infix->name == "," || infix->name == ";" || infix->name == "\n")
+        {
+            remote_hosts(context, infix->left, asks, evaluate);
+            remote_hosts(context, infix->right, asks, evaluate);
+            return;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    Tree_p value = evaluate ? context->Evaluate(hosts) : hosts;
+    if (value != hosts)
+        remote_hosts(context, value, asks, false);
+    else
+        std::cerr << "eliot_ask_all: Invalid host " << hosts << "\n";
+}
+
+
+static void remote_connect_all(remote_asks &asks, ulonglong deadline)
+// ----------------------------------------------------------------------------
+//   Open connections to all hosts at once, wait until they are complete
+// ----------------------------------------------------------------------------
+{
+    uint count = asks.size();
+    for (uint i = 0; i < count; i++)
+        if (asks[i].sending && !asks[i].conn)
+            asks[i].conn = remote_connection(asks[i].host, false);
+
+    std::vector<pollfd> fds;
+    std::vector<RemoteConnection *> connecting;
+    while (true)
+    {
+        fds.clear();
+        connecting.clear();
+        for (uint i = 0; i < count; i++)
+        {
+            RemoteConnection *conn = asks[i].conn;
+            if (conn && conn->connecting && conn->sock >= 0 &&
+                std::find(connecting.begin(), connecting.end(), conn) ==
+                connecting.end())
+            {
+                pollfd pfd = { conn->sock, POLLOUT, 0 };
+                fds.push_back(pfd);
+                connecting.push_back(conn);
+            }
+        }
+        if (fds.empty())
+            return;
+
+        ulonglong now = remote_clock();
+        if (now >= deadline)
+            break;
+        int ready = remote_wait(&fds[0], fds.size(), deadline - now);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        // Another listener thread may have completed the same connection
+        for (uint f = 0; ready > 0 && f < fds.size(); f++)
+        {
+            RemoteConnection *conn = connecting[f];
+            if (fds[f].revents && conn->connecting && conn->sock >= 0)
+                if (!remote_connected(conn))
+                    remote_break(conn);
+        }
+    }
+
+    // Give up on hosts that did not answer in time
+    for (uint c = 0; c < connecting.size(); c++)
+    {
+        IFTRACE(remote)
+            std::cerr << "eliot_ask_all: Timeout connecting to "
+                      << connecting[c]->key << "\n";
+        remote_break(connecting[c]);
+    }
+}
+
+
+static void remote_send_all(Tree *message, remote_asks &asks)
+// ----------------------------------------------------------------------------
+//   Send the request to all connected hosts
+// ----------------------------------------------------------------------------
+//   Unless a connection can send some declarations by hash, all hosts
+//   reading the same format get the same payload, which we encode once
+{
+    text shared[2];
+    for (uint i = 0; i < asks.size(); i++)
+    {
+        RemoteConnection *conn = asks[i].conn;
+        if (!asks[i].sending)
+            continue;
+        asks[i].sending = false;
+        if (!conn || conn->sock < 0)
+            continue;
+
+        asks[i].id = ++conn->nextId;
+        asks[i].attempts++;
+        remote_poll(conn);
+        text *payload = &conn->output;
+        if (conn->cache.refer)
+        {
+            remote_encode(conn->output, message, &conn->cache);
+        }
+        else
+        {
+            text &encoded = shared[conn->cache.compact];
+            if (encoded.empty())
+                remote_encode(encoded, message, &conn->cache, false);
+            remote_learn(&conn->cache, message);
+            payload = &encoded;
+        }
+
+        if (remote_send_frame(conn->sock, asks[i].id, frameASK, *payload))
+        {
+            asks[i].waiting = true;
+        }
+        else
+        {
+            std::cerr << "eliot_ask_all: Error writing to '" << conn->key
+                      << "': " << strerror(errno) << "\n";
+            remote_break(conn);
+        }
+    }
+}
+
+
+static uint remote_ask_all(Context *context, Tree *hosts, Tree *code,
+                           Tree *callback, remote_asks &asks)
+// ----------------------------------------------------------------------------
+//   Ask all hosts concurrently, return the number of replies
+// ----------------------------------------------------------------------------
+//   Each host gets 'remote_timeout' milliseconds to connect and reply.
+//   If there is a callback, it is called as 'callback host, reply' for
+//   each reply as it arrives.
+{
+    remote_hosts(context, hosts, asks);
+    uint count = asks.size();
+    IFTRACE(remote)
+        std::cerr << "eliot_ask_all: Asking " << count << " hosts:\n"
+                  << code << "\n";
+
+    ulonglong deadline = remote_clock() + MAIN->options.remote_timeout;
+    Tree_p message = eliot_attach_context(context, code);
+    remote_connect_all(asks, deadline);
+    remote_send_all(message, asks);
+
+    // Collect replies as they arrive from any host
+    uint replies = 0;
+    std::vector<pollfd> fds;
+    std::vector<RemoteConnection *> polled;
+    while (true)
+    {
+        bool resend = false;
+        fds.clear();
+        polled.clear();
+        for (uint i = 0; i < count; i++)
+        {
+            RemoteAsk &ask = asks[i];
+            if (!ask.waiting)
+                continue;
+
+            RemoteConnection *conn = ask.conn;
+            RemoteFrame frame;
+            if (remote_queued(conn, ask.id, frame))
+            {
+                ask.waiting = false;
+                if (frame.kind != frameDONE)
+                    remote_abandon(conn, ask.id);
+                if (!frame.tree)
+                    continue;
+                replies++;
+                ask.result = eliot_merge_context(context, frame.tree);
+                IFTRACE(remote)
+                    std::cerr << "eliot_ask_all: Response from " << ask.host
+                              << " was:\n" << ask.result << "\n";
+                if (callback)
+                {
+                    Tree_p host = new Text(ask.host);
+                    Tree_p args = new Infix(",", host, ask.result);
+                    context->Evaluate(new Prefix(callback, args));
+                }
+            }
+            else if (conn->sock < 0)
+            {
+                // Closed before the reply, send again on a new connection
+                ask.waiting = false;
+                if (ask.attempts < REMOTE_ATTEMPTS)
+                {
+                    remote_release(conn);
+                    ask.conn = NULL;
+                    ask.sending = resend = true;
+                }
+                else
+                {
+                    std::cerr << "eliot_ask_all: Connection to '" << ask.host
+                              << "' closed before the reply\n";
+                }
+            }
+            else if (std::find(polled.begin(), polled.end(), conn) ==
+                     polled.end())
+            {
+                pollfd pfd = { conn->sock, POLLIN, 0 };
+                fds.push_back(pfd);
+                polled.push_back(conn);
+            }
+        }
+        if (resend)
+        {
+            remote_connect_all(asks, deadline);
+            remote_send_all(message, asks);
+            continue;
+        }
+        if (fds.empty())
+            break;
+
+        ulonglong now = remote_clock();
+        if (now >= deadline)
+            break;
+        int ready = remote_wait(&fds[0], fds.size(), deadline - now);
+        if (ready < 0 && errno != EINTR)
+            break;
+        for (uint f = 0; ready > 0 && f < fds.size(); f++)
+            if (fds[f].revents && polled[f]->sock >= 0 &&
+                !remote_poll(polled[f]))
+                remote_break(polled[f]);
+    }
+
+    // Release connections, ignoring replies that come too late
+    for (uint i = 0; i < count; i++)
+    {
+        RemoteAsk &ask = asks[i];
+        if (!ask.conn)
+            continue;
+        if (ask.waiting)
+        {
+            IFTRACE(remote)
+                std::cerr << "eliot_ask_all: No reply from " << ask.host
+                          << "\n";
+            remote_abandon(ask.conn, ask.id);
+        }
+        remote_release(ask.conn);
+        ask.conn = NULL;
+    }
+    return replies;
+}
+
+
+Tree_p eliot_ask_all(Context *context, Tree *hosts, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send code to all hosts at once, return a block with their replies
+// ----------------------------------------------------------------------------
+//   The replies are in the same order as the hosts, with nil for hosts
+//   that did not reply in time
+{
+    remote_asks asks;
+    remote_ask_all(context, hosts, code, NULL, asks);
+
+    uint count = asks.size();
+    if (!count)
+        return eliot_nil;
+    Tree_p list = NULL;
+    for (uint i = count; i-- > 0; )
+    {
+        Tree *result = asks[i].result;
+        if (!result)
+            result = eliot_nil;
+        list = list ? (Tree *) new Infix(",", result, list) : result;
+    }
+    return new Block(list, "(", ")");
+}
+
+
+int eliot_ask_each(Context *context, Tree *hosts, Tree *code, Tree *callback)
+// ----------------------------------------------------------------------------
+//   Send code to all hosts at once, call 'callback' for each reply
+// ----------------------------------------------------------------------------
+{
+    remote_asks asks;
+    return remote_ask_all(context, hosts, code, callback, asks);
+}
+
+
+
+// ============================================================================
+//
+//    Asynchronous requests
+//
+// ============================================================================
+//  Requests from ask_async go through connections that are read by a
+//  reactor thread. That thread only deals with bytes, it never allocates
+//  trees, so it does not interfere with the garbage collector. Replies
+//  are decoded by the evaluator when it needs the value of the future.
+//  These connections do not use the declaration cache, since decoding
+//  frames out of order would get the caches out of sync.
+
+enum RemoteFutureState
+// ----------------------------------------------------------------------------
+//   State of an asynchronous request
+// ----------------------------------------------------------------------------
+{
+    futurePENDING,              // Waiting for the reply
+    futureREADY,                // Reply received, not decoded yet
+    futureFAILED,               // Connection closed before the reply
+    futureDONE                  // Value available
+};
+
+
+struct RemoteFuture
+// ----------------------------------------------------------------------------
+//   A request in flight, shared by the FutureInfo and the reactor thread
+// ----------------------------------------------------------------------------
+{
+    RemoteFuture(): state(futurePENDING), refs(2), payload() {}
+    RemoteFutureState   state;
+    uint                refs;           // FutureInfo + reactor
+    text                payload;        // Serialized reply
+};
+typedef std::map<ulonglong, RemoteFuture *> remote_futures;
+
+
+struct RemoteAsync
+// ----------------------------------------------------------------------------
+//   A connection for asynchronous requests, read by the reactor thread
+// ----------------------------------------------------------------------------
+{
+    RemoteAsync(RemoteConnection *conn): conn(conn), futures() {}
+    RemoteConnection *  conn;
+    remote_futures      futures;        // Requests without a final frame
+};
+typedef std::map<text, RemoteAsync *> remote_async_map;
+
+
+static pthread_mutex_t  async_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   async_ready = PTHREAD_COND_INITIALIZER;
+static remote_async_map async_connections;
+static pid_t            async_owner = 0;
+static int              async_wakeup[2] = { -1, -1 };
+
+
+static void remote_future_release(RemoteFuture *future)
+// ----------------------------------------------------------------------------
+//   Release a reference to a future, called with async_lock held
+// ----------------------------------------------------------------------------
+{
+    if (--future->refs == 0)
+        delete future;
+}
+
+
+static void remote_async_close(RemoteAsync *async)
+// ----------------------------------------------------------------------------
+//   Fail all requests on a connection, called with async_lock held
+// ----------------------------------------------------------------------------
+{
+    remote_futures::iterator f;
+    for (f = async->futures.begin(); f != async->futures.end(); f++)
+    {
+        RemoteFuture *future = f->second;
+        if (future->state == futurePENDING)
+            future->state = futureFAILED;
+        remote_future_release(future);
+    }
+    async->futures.clear();
+    async_connections.erase(async->conn->key);
+    close(async->conn->sock);
+    delete async->conn;
+    delete async;
+    pthread_cond_broadcast(&async_ready);
+}
+
+
+static bool remote_async_read(RemoteAsync *async)
+// ----------------------------------------------------------------------------
+//   Read frames for asynchronous requests, false if connection closed
+// ----------------------------------------------------------------------------
+//   Like ask, the first frame for a request is its result, and we
+//   discard the others until the final one
+{
+    RemoteConnection *conn = async->conn;
+    RemoteInput &input = conn->input;
+    ssize_t got = input.Fill(conn->sock, false);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+        return false;
+
+    RemoteFrame frame;
+    bool signal = false;
+    while (remote_frame_ready(input, frame))
+    {
+        remote_futures::iterator found = async->futures.find(frame.id);
+        if (found != async->futures.end())
+        {
+            RemoteFuture *future = found->second;
+            if (future->state == futurePENDING)
+            {
+                future->payload.resize(frame.length);
+                for (size_t i = 0; i < frame.length; i++)
+                    future->payload[i] = input.data[(frame.payload+i) &
+                                                    input.mask];
+                future->state = futureREADY;
+                signal = true;
+            }
+            if (frame.kind == frameDONE)
+            {
+                async->futures.erase(found);
+                remote_future_release(future);
+            }
+        }
+        input.start = frame.payload + frame.length;
+    }
+    if (signal)
+        pthread_cond_broadcast(&async_ready);
+    return true;
+}
+
+
+static void *remote_reactor(void *)
+// ----------------------------------------------------------------------------
+//   Thread waiting for replies to asynchronous requests
+// ----------------------------------------------------------------------------
+{
+    std::vector<pollfd> fds;
+    std::vector<RemoteAsync *> polled;
+    while (true)
+    {
+        fds.clear();
+        polled.clear();
+        pollfd wakeup = { async_wakeup[0], POLLIN, 0 };
+        fds.push_back(wakeup);
+
+        pthread_mutex_lock(&async_lock);
+        remote_async_map::iterator a;
+        for (a = async_connections.begin(); a != async_connections.end(); a++)
+        {
+            pollfd pfd = { a->second->conn->sock, POLLIN, 0 };
+            fds.push_back(pfd);
+            polled.push_back(a->second);
+        }
+        pthread_mutex_unlock(&async_lock);
+
+        if (poll(&fds[0], fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "eliot_ask_async: Error waiting for replies: "
+                      << strerror(errno) << "\n";
+            break;
+        }
+
+        // Connections are only removed by this thread, so 'polled' is valid
+        if (fds[0].revents)
+        {
+            char buffer[64];
+            if (read(async_wakeup[0], buffer, sizeof(buffer)) <= 0)
+                break;
+        }
+        pthread_mutex_lock(&async_lock);
+        for (uint p = 0; p < polled.size(); p++)
+            if (fds[p+1].revents && !remote_async_read(polled[p]))
+                remote_async_close(polled[p]);
+        pthread_mutex_unlock(&async_lock);
+    }
+    return NULL;
+}
+
+
+static bool remote_reactor_start()
+// ----------------------------------------------------------------------------
+//   Start the reactor thread if needed, e.g. after a fork
+// ----------------------------------------------------------------------------
+//   Called with async_lock held
+{
+    if (async_owner == getpid())
+        return true;
+
+    // A forked child inherits connections, but not the reactor thread
+    if (async_owner)
+    {
+        close(async_wakeup[0]);
+        close(async_wakeup[1]);
+        async_connections.clear();
+    }
+
+    pthread_t thread;
+    if (pipe(async_wakeup) < 0 ||
+        pthread_create(&thread, NULL, remote_reactor, NULL) != 0)
+    {
+        std::cerr << "eliot_ask_async: Unable to start reactor: "
+                  << strerror(errno) << "\n";
+        return false;
+    }
+    pthread_detach(thread);
+    async_owner = getpid();
+    return true;
+}
+
+
+FutureInfo::~FutureInfo()
+// ----------------------------------------------------------------------------
+//   Release the request if the future is collected before its value is used
+// ----------------------------------------------------------------------------
+{
+    if (future)
+    {
+        pthread_mutex_lock(&async_lock);
+        remote_future_release(future);
+        pthread_mutex_unlock(&async_lock);
+    }
+}
+
+
+Tree_p eliot_ask_async(Context *context, text host, Tree *code)
+// ----------------------------------------------------------------------------
+//   Send code to the target, return a future for the reply
+// ----------------------------------------------------------------------------
+{
+    IFTRACE(remote)
+        std::cerr << "eliot_ask_async: Asking " << host << ":\n"
+                  << code << "\n";
+    Tree_p message = eliot_attach_context(context, code);
+    text payload;
+    remote_encode(payload, message);
+
+    uint port = 0;
+    text name = host;
+    text key = remote_address(name, port);
+    RemoteAsync *async = NULL;
+    RemoteFuture *future = new RemoteFuture;
+    pthread_mutex_lock(&async_lock);
+    bool started = remote_reactor_start();
+    if (started)
+    {
+        remote_async_map::iterator found = async_connections.find(key);
+        if (found != async_connections.end())
+            async = found->second;
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    // Connect without the lock, so that a slow host does not hold back
+    // other futures. Not from the pool, since only the reactor reads it
+    RemoteConnection *conn = NULL;
+    if (started && !async)
+    {
+        int sock = remote_connect(name, port, true);
+        if (sock >= 0)
+        {
+            conn = new RemoteConnection(key, sock);
+            if (!remote_greet(conn, false))
+            {
+                close(sock);
+                delete conn;
+                conn = NULL;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&async_lock);
+    if (conn)
+    {
+        remote_async_map::iterator found = async_connections.find(key);
+        if (found != async_connections.end())
+        {
+            // Another thread connected to the same host in the meantime
+            close(conn->sock);
+            delete conn;
+            async = found->second;
+        }
+        else
+        {
+            async = new RemoteAsync(conn);
+            async_connections[key] = async;
+            if (write(async_wakeup[1], "+", 1) < 0)
+                std::cerr << "eliot_ask_async: "
+                          << "Unable to wake reactor: "
+                          << strerror(errno) << "\n";
+        }
+    }
+    else if (async)
+    {
+        // The reactor may have closed it while we were not looking
+        remote_async_map::iterator found = async_connections.find(key);
+        if (found == async_connections.end() || found->second != async)
+            async = NULL;
+    }
+
+    bool sent = false;
+    if (async)
+    {
+        conn = async->conn;
+        ulonglong id = ++conn->nextId;
+        async->futures[id] = future;
+        sent = remote_send_frame(conn->sock, id, frameASK, payload);
+        if (!sent)
+        {
+            std::cerr << "eliot_ask_async: Error writing to '"
+                      << conn->key << "': " << strerror(errno) << "\n";
+            async->futures.erase(id);
+        }
+    }
+    if (!sent)
+    {
+        future->state = futureFAILED;
+        future->refs--;
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    Tree_p result = new Prefix(new Name("future"), new Text(host));
+    FutureInfo *info = new FutureInfo;
+    info->context = context;
+    info->future = future;
+    result->SetInfo<FutureInfo>(info);
+    return result;
+}
+
+
+Tree *eliot_future_wait(Tree *value)
+// ----------------------------------------------------------------------------
+//   If value is a future, wait for the reply and return it
+// ----------------------------------------------------------------------------
+{
+    Tree *tree = value;
+    if (Tree *inside = IsClosure(value, NULL))
+        tree = inside;
+    FutureInfo *info = tree->GetInfo<FutureInfo>();
+    if (!info)
+        return value;
+    if (RemoteFuture *future = info->future)
+    {
+        IFTRACE(remote)
+            std::cerr << "eliot_wait: Waiting for " << tree << "\n";
+        pthread_mutex_lock(&async_lock);
+        if (future->state == futurePENDING)
+        {
+            BlockingCall blocking;
+            pthread_cleanup_push(remote_unlock, &async_lock);
+            while (future->state == futurePENDING)
+                pthread_cond_wait(&async_ready, &async_lock);
+            pthread_cleanup_pop(0);
+        }
+        text payload;
+        if (future->state == futureREADY)
+            payload.swap(future->payload);
+        remote_future_release(future);
+        info->future = NULL;
+        pthread_mutex_unlock(&async_lock);
+
+        // Decode the reply like 'ask' would have
+        Tree_p reply = NULL;
+        if (payload.length())
+        {
+            Deserializer reader((const byte *) payload.data(), ~0UL,
+                                0, payload.length());
+            reply = reader.ReadTree();
+        }
+        info->value = reply ? eliot_merge_context(info->context, reply)
+                            : (Tree_p) eliot_nil;
+        info->context = NULL;
+        IFTRACE(remote)
+            std::cerr << "eliot_wait: Reply was:\n" << info->value << "\n";
+    }
+    return info->value;
+}
+
+
+bool eliot_future_ready(Tree *value)
+// ----------------------------------------------------------------------------
+//   Check if waiting for a value would not block
+// ----------------------------------------------------------------------------
+{
+    if (Tree *inside = IsClosure(value, NULL))
+        value = inside;
+    FutureInfo *info = value->GetInfo<FutureInfo>();
+    if (!info || !info->future)
+        return true;
+    pthread_mutex_lock(&async_lock);
+    bool ready = info->future->state != futurePENDING;
+    pthread_mutex_unlock(&async_lock);
+    return ready;
+}
+
+
+
+// ============================================================================
+//
+//   Listening side
+//
+// ============================================================================
+
+static int child_wait(int flag)
+// ----------------------------------------------------------------------------
+//   Wait for a child to die
+// ----------------------------------------------------------------------------
+{
+    int status = 0;
+    int childPID = waitpid(-1, &status, flag);
+    if (childPID < 0)
+        return childPID;
+    if (childPID > 0)
+    {
+        IFTRACE(remote)
+            std::cerr << "eliot_listen: Child PID " << childPID << " died "
+                      << (flag ? "nowait" : "wait") << "\n";
+        active_children--;
+        if (!flag && WIFEXITED(status))
+        {
+            int rc = WEXITSTATUS(status);
+            if (rc == 42)
+                listening = false;
+        }
+    }
+    return childPID;
+}
+
+
+static void child_died(int)
+// ----------------------------------------------------------------------------
+//    When a child dies, get its exit status
+// ----------------------------------------------------------------------------
+{
+    while (child_wait(WNOHANG) > 0)
+        /* Loop */;
+}
+
+
+
+Tree_p  eliot_listen_received()
+// ----------------------------------------------------------------------------
+//    Return the incoming message before evaluation
+// ----------------------------------------------------------------------------
+{
+    return received ? received : eliot_nil;
+}
+
+
+Tree_p eliot_listen_hook(Tree *newHook)
+// ----------------------------------------------------------------------------
+//   Set the listen hook, return the previous one
+// ----------------------------------------------------------------------------
+{
+    Tree_p result = hook;
+    if (newHook != eliot_nil)
+        hook = newHook;
+    return result;
+}
+
+
+static bool eliot_evaluate_received(Context *context, Tree_p &code)
+// ----------------------------------------------------------------------------
+//   Run the listen hook on incoming code, then evaluate it if accepted
+// ----------------------------------------------------------------------------
+{
+    IFTRACE(remote)
+        std::cerr << "eliot_listen: Received code: " << code << "\n";
+    Tree_p message = code;
+    Save<Tree *> saveReceived(received, message);
+    Tree_p hookResult = context->Evaluate(hook);
+    bool accepted = hookResult != eliot_nil;
+    if (accepted)
+    {
+        code = eliot_merge_context(context, code);
+        code = context->Evaluate(code);
+        IFTRACE(remote)
+            std::cerr << "eliot_listen: Evaluated as: " << code << "\n";
+    }
+    if (hookResult == eliot_false || hookResult == eliot_nil)
+        listening = false;
+    return accepted;
+}
+
+
+static bool remote_streamed(RemoteInput &input, RemoteFrame &frame)
+// ----------------------------------------------------------------------------
+//   Check if we evaluate a partially received request as it arrives
+// ----------------------------------------------------------------------------
+{
+    return MAIN->options.listen_stream && hook == eliot_true &&
+        remote_frame_header(input, frame) &&
+        (frame.kind == frameASK || frame.kind == frameTELL);
+}
+
+
+static bool eliot_stream_received(Context *context, int insock,
+                                  RemoteInput &input, RemoteFrame &frame,
+                                  RemoteCache &cache, Tree_p &code)
+// ----------------------------------------------------------------------------
+//   Evaluate the statements of a request while the rest is still arriving
+// ----------------------------------------------------------------------------
+//   Only used without a listen hook, since the hook needs the whole message.
+//   Statements are evaluated in order, in a scope holding the declarations
+//   received so far, so they cannot use declarations that come later.
+{
+    StreamDeserializer reader(true, &cache.known);
+    Context_p codeCtx;
+    Tree_p result;
+    bool ok = true;
+
+    input.Skip(frame.payload - input.start);
+    size_t remaining = frame.length;
+    while (ok)
+    {
+        size_t available = std::min(input.Size(), remaining);
+        if (available)
+        {
+            ok = reader.Feed(input.data, input.mask,
+                             input.start, input.start + available);
+            input.Skip(available);
+            remaining -= available;
+        }
+
+        while (Tree_p statement = ok ? reader.Statement() : NULL)
+        {
+            // The symbols come before the code, so we have them by now
+            if (!codeCtx)
+                codeCtx = new Context(eliot_merge_symbols(context,
+                                                          reader.Symbols()));
+            IFTRACE(remote)
+                std::cerr << "eliot_listen: Streamed statement: "
+                          << statement << "\n";
+            Tree_p value = codeCtx->Evaluate(statement);
+            Infix *infix = statement->AsInfix();
+            if (!result || !infix || infix->name != "->")
+                result = value;
+        }
+
+        if (!remaining || !ok)
+            break;
+        ok = input.Fill(insock, true) > 0;
+    }
+
+    ok = ok && reader.Finish();
+    if (!ok)
+    {
+        std::cerr << "eliot_listen: Invalid or incomplete request "
+                  << frame.id << "\n";
+        return false;
+    }
+
+    remote_learn(&cache, reader.Result());
+    code = result ? result : code;
+    IFTRACE(remote)
+        std::cerr << "eliot_listen: Evaluated as: " << code << "\n";
+    return true;
+}
+
+
+static bool eliot_serve_frames(Context *context, int insock,
+                               RemoteInput &input, RemoteCache &cache)
+// ----------------------------------------------------------------------------
+//   Serve the requests received on a multiplexed connection, in order
+// ----------------------------------------------------------------------------
+//   Return true if at least one request was evaluated. A request that is
+//   streamed is evaluated as soon as its header arrives, so we may block
+//   reading the rest of it.
+{
+    bool served = false;
+    text output;
+    while (listening)
+    {
+        RemoteFrame frame;
+        bool ready = remote_frame_ready(input, frame);
+        bool streamed = !ready && remote_streamed(input, frame);
+        if (!ready && !streamed)
+            break;
+        if (frame.kind == frameOPTIONS)
+        {
+            // Options come before the first request, wait for it
+            remote_frame_take(input, frame, false, NULL);
+            remote_options(insock, frame, cache);
+            continue;
+        }
+        served = true;
+
+        Tree_p code;
+        if (!streamed)
+        {
+            remote_frame_take(input, frame, true, &cache);
+            code = frame.tree;
+            frame.tree = NULL;
+        }
+
+        bool wantReply = frame.kind != frameTELL;
+        if (!streamed && !code)
+        {
+            // Answer nil rather than leave the sender waiting
+            std::cerr << "eliot_listen: Invalid or incomplete request "
+                      << frame.id << "\n";
+            if (wantReply)
+            {
+                remote_encode(output, NULL, &cache, false);
+                remote_send_frame(insock, frame.id, frameDONE, output);
+            }
+            continue;
+        }
+        Save<int>            saveReply(reply_socket, wantReply ? insock : 0);
+        Save<ulonglong>      saveId(reply_id, frame.id);
+        Save<bool>           saveTell(reply_discard, !wantReply);
+        Save<RemoteCache *>  saveCache(reply_cache, &cache);
+        bool accepted = streamed
+            ? eliot_stream_received(context, insock, input, frame, cache, code)
+            : eliot_evaluate_received(context, code);
+        if (wantReply)
+        {
+            remote_encode(output, accepted ? (Tree *) code : NULL,
+                          &cache, false);
+            remote_send_frame(insock, frame.id, frameDONE, output);
+            IFTRACE(remote)
+                std::cerr << "eliot_listen: Response " << frame.id
+                          << " sent\n";
+        }
+    }
+    return served;
+}
+
 
-    struct sockaddr_in address = { 0 };
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0)
+static void eliot_serve_multiplexed(Context *context, int insock,
+                                    RemoteInput &input, int idle)
+// ----------------------------------------------------------------------------
+//   Serve the frames on a multiplexed connection until closed or idle
+// ----------------------------------------------------------------------------
+//   'idle' is the time in milliseconds we wait for the next request
+//   before closing the connection. Requests are evaluated in order.
+{
+    bool first = true;
+    RemoteCache cache;
+    while (listening)
     {
-        std::cerr << "eliot_listen: Error binding to port " << port << ": "
-                  << strerror(errno) << "\n";
-        return -1;
+        if (eliot_serve_frames(context, insock, input, cache))
+            first = false;
+        if (!listening)
+            break;
+        if (!first)
+        {
+            pollfd pfd = { insock, POLLIN, 0 };
+            int ready;
+            do
+                ready = poll(&pfd, 1, idle);
+            while (ready < 0 && errno == EINTR);
+            if (ready <= 0)
+            {
+                IFTRACE(remote)
+                    std::cerr << "eliot_listen: Closing idle connexion\n";
+                break;
+            }
+        }
+        if (input.Fill(insock, true) <= 0)
+            break;
+    }
+}
+
+
+static void eliot_serve_legacy(Context *context, int insock,
+                               RemoteInput &input)
+// ----------------------------------------------------------------------------
+//   Serve a client sending a single program without frames
+// ----------------------------------------------------------------------------
+{
+    // Read data from client
+    Tree_p code = eliot_read_tree(insock, input);
+
+    // Evaluate resulting code
+    if (code)
+    {
+        Save<int> saveReply(reply_socket, insock);
+        if (eliot_evaluate_received(context, code))
+        {
+            eliot_write_tree(insock, code);
+            IFTRACE(remote)
+                std::cerr << "eliot_listen: Response sent\n";
+        }
+    }
+}
+
+
+struct ListenClient
+// ----------------------------------------------------------------------------
+//   A connexion kept open by a listener that does not fork
+// ----------------------------------------------------------------------------
+{
+    ListenClient(int sock)
+        : sock(sock), mode(-1), expires(0), input(), cache() {}
+    ~ListenClient()                     { close(sock); }
+
+    int                 sock;
+    int                 mode;           // As returned by remote_multiplexed
+    ulonglong           expires;        // When we close it, 0 until used
+    RemoteInput         input;          // Data received, not yet processed
+    RemoteCache         cache;          // Declarations known on both ends
+};
+typedef std::vector<ListenClient *> listen_clients;
+
+
+static bool eliot_serve_client(Context *context, ListenClient *client)
+// ----------------------------------------------------------------------------
+//   Serve the input received on a connexion, return false once done
+// ----------------------------------------------------------------------------
+{
+    ssize_t got = client->input.Fill(client->sock, false);
+    if (got == 0 ||
+        (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return false;
+
+    if (client->mode < 0)
+        client->mode = remote_multiplexed(client->input);
+    if (client->mode == 0)
+    {
+        // A legacy client sends a single program, then we close
+        eliot_serve_legacy(context, client->sock, client->input);
+        return false;
+    }
+    if (client->mode > 0 &&
+        eliot_serve_frames(context, client->sock, client->input,
+                           client->cache))
+        client->expires = remote_clock() + MAIN->options.listen_idle * 1000;
+    return true;
+}
+
+
+static void eliot_listen_polling(Context *context, int sock)
+// ----------------------------------------------------------------------------
+//   Serve all connexions from this process, one request at a time
+// ----------------------------------------------------------------------------
+//   Clients keep their connexion between requests, so we poll them along
+//   with the listening socket, and close them after -keepalive seconds
+//   without a request. Like a forked child, we wait for the first request.
+{
+    listen_clients clients;
+    std::vector<pollfd> fds;
+    while (listening)
+    {
+        // Wait for a new client, a request, or the next idle connexion
+        ulonglong now = remote_clock();
+        int timeout = -1;
+        fds.clear();
+        pollfd lfd = { sock, POLLIN, 0 };
+        fds.push_back(lfd);
+        for (uint c = 0; c < clients.size(); c++)
+        {
+            pollfd pfd = { clients[c]->sock, POLLIN, 0 };
+            fds.push_back(pfd);
+            ulonglong expires = clients[c]->expires;
+            int wait = expires > now ? expires - now : 0;
+            if (expires && (timeout < 0 || wait < timeout))
+                timeout = wait;
+        }
+        if (poll(&fds[0], fds.size(), timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "eliot_listen: Error waiting for input: "
+                      << strerror(errno) << "\n";
+            break;
+        }
+
+        // Serve requests in the order of the connexions
+        now = remote_clock();
+        uint kept = 0;
+        for (uint c = 0; c < clients.size(); c++)
+        {
+            ListenClient *client = clients[c];
+            bool open = listening;
+            if (open && fds[c+1].revents)
+            {
+                open = eliot_serve_client(context, client);
+            }
+            else if (open && client->expires && now >= client->expires)
+            {
+                IFTRACE(remote)
+                    std::cerr << "eliot_listen: Closing idle connexion "
+                              << client->sock << "\n";
+                open = false;
+            }
+            if (open)
+                clients[kept++] = client;
+            else
+                delete client;
+        }
+        clients.resize(kept);
+
+        // Accept new clients
+        if (listening && fds[0].revents)
+        {
+            int insock = accept(sock, NULL, NULL);
+            if (insock < 0)
+            {
+                std::cerr << "eliot_listen: Error accepting connexion: "
+                          << strerror(errno) << "\n";
+                continue;
+            }
+            IFTRACE(remote)
+                std::cerr << "eliot_listen: Got incoming connexion "
+                          << insock << "\n";
+            remote_send_timeout(insock);
+            clients.push_back(new ListenClient(insock));
+        }
     }
 
+    for (uint c = 0; c < clients.size(); c++)
+        delete clients[c];
+}
+
+
+int eliot_listen(Context *context, uint forking, uint port)
+// ----------------------------------------------------------------------------
+//    Listen on the given port for sockets, evaluate programs when received
+// ----------------------------------------------------------------------------
+{
+    // Open the socket
+    int sock = remote_listen_socket(port);
+    if (sock < 0)
+        return -1;
+
     // Listen to socket
     listen(sock, 5);
 
+    // Without forking, we serve all clients from this process
+    listening = true;
+    if (!forking)
+    {
+        eliot_listen_polling(context, sock);
+        close(sock);
+        return 0;
+    }
+
     // Make sure we get notified when a child dies
     signal(SIGCHLD, child_died);
 
     // Accept client
-    listening = true;
     while (listening)
     {
         // Block until we can accept more connexions (avoid fork bombs)
-        while (forking && active_children >= forking)
+        while (active_children >= forking)
         {
             IFTRACE(remote)
                 std::cerr << "eliot_listen: Too many children, waiting\n";
@@ -479,7 +2909,7 @@ int eliot_listen(Context *context, uint forking, uint port)
         // Accept input
         IFTRACE(remote)
             std::cerr << "eliot_listen: Accepting input\n";
-        sockaddr_in client = { 0 };
+        sockaddr_storage client;
         socklen_t length = sizeof(client);
         int insock = accept(sock, (struct sockaddr *) &client, &length);
         if (insock < 0)
@@ -490,9 +2920,10 @@ int eliot_listen(Context *context, uint forking, uint port)
         }
         IFTRACE(remote)
             std::cerr << "eliot_listen: Got incoming connexion\n";
+        remote_send_timeout(insock);
 
         // Fork child for incoming connexion
-        int pid = forking ? fork() : 0;
+        int pid = fork();
         if (pid == -1)
         {
             std::cerr << "eliot_listen: Error forking child\n";
@@ -506,56 +2937,473 @@ int eliot_listen(Context *context, uint forking, uint port)
         }
         else
         {
-            // Read data from client
-            Tree_p code = eliot_read_tree(insock);
+            // Check the kind of connexion from the first bytes
+            RemoteInput input;
+            int multiplexed;
+            while ((multiplexed = remote_multiplexed(input)) < 0)
+                if (input.Fill(insock, true) <= 0)
+                    break;
+
+            // The child keeps a multiplexed connexion open while in use
+            int idle = MAIN->options.listen_idle * 1000;
+            if (multiplexed > 0)
+                eliot_serve_multiplexed(context, insock, input, idle);
+            else if (multiplexed == 0)
+                eliot_serve_legacy(context, insock, input);
+            close(insock);
+
+            IFTRACE(remote)
+                std::cerr << "eliot_listen: Exiting PID "
+                          << getpid() << "\n";
+            exit(listening ? 0 : 42);
+        }
+    }
+
+    close(sock);
+    return 0;
+}
+
+
+// ============================================================================
+//
+//   Event-driven listener
+//
+// ============================================================================
+//  A single thread waits for input on all connections with epoll, and
+//  hands connections with pending input to a pool of worker threads.
+//  Connections are registered with EPOLLONESHOT, so a connection belongs to
+//  at most one worker at a time, which reads, decodes and replies, then
+//  re-arms it. The evaluator is not thread-safe, so workers take eval_lock
+//  while they touch trees. Socket I/O happens outside of that lock, so slow
+//  peers do not hold back evaluation for other connections.
+//
+//  Builtins that wait, like sleep, reply, ask or wait, release eval_lock
+//  with a BlockingCall, so that a program running 'every' or waiting for
+//  another host does not hold back the other clients. Workers can only
+//  be cancelled while they wait that way, which is how the listener stops
+//  programs that would otherwise never end. Limits that remain:
+//  - Programs still evaluate one at a time, so a program that computes
+//    for a long time without waiting delays all the others, and delays
+//    the listener when it stops.
+//  - Requests on one connection are evaluated in order, so a long running
+//    request delays the following ones on the same connection.
+//  - Resolving a host name, connecting to it, and sending a request to
+//    a host that does not read it happen with eval_lock held.
+
+#ifdef CONFIG_LINUX
+
+struct ListenEvaluating
+// ----------------------------------------------------------------------------
+//   Hold eval_lock while a worker thread evaluates or touches trees
+// ----------------------------------------------------------------------------
+{
+    ListenEvaluating()
+    {
+        pthread_mutex_lock(&eval_lock);
+        eval_locked = true;
+    }
+    ~ListenEvaluating()
+    {
+        eval_locked = false;
+        pthread_mutex_unlock(&eval_lock);
+    }
+};
+
+
+struct ListenConnection
+// ----------------------------------------------------------------------------
+//   A connection served by the event-driven listener
+// ----------------------------------------------------------------------------
+{
+    ListenConnection(int sock)
+        : sock(sock), refs(1), mode(-1), input(), cache()
+    {
+        pthread_mutex_init(&writeLock, NULL);
+    }
+    ~ListenConnection()
+    {
+        close(sock);
+        pthread_mutex_destroy(&writeLock);
+    }
+
+    int                 sock;
+    uint                refs;           // epoll registration + worker
+    int                 mode;           // As returned by remote_multiplexed
+    RemoteInput         input;          // Data received, not yet processed
+    RemoteCache         cache;          // Declarations known on both ends
+    pthread_mutex_t     writeLock;      // Keep frames from interleaving
+};
+typedef std::set<ListenConnection *>     listen_connections;
+typedef std::deque<ListenConnection *>   listen_queue;
+
+
+struct ListenServer
+// ----------------------------------------------------------------------------
+//   Shared state between the event loop and the worker threads
+// ----------------------------------------------------------------------------
+{
+    Context *           context;
+    int                 epoll;
+    int                 wakeup[2];      // Workers tell the loop to stop
+    bool                stopping;
+    pthread_mutex_t     lock;           // Protects all fields below
+    pthread_cond_t      ready;
+    listen_queue        queue;          // Connections with input to process
+    listen_connections  connections;
+};
+
+
+static void listen_release(ListenServer *server, ListenConnection *conn)
+// ----------------------------------------------------------------------------
+//   Release a reference to a connection, called with server->lock held
+// ----------------------------------------------------------------------------
+{
+    if (--conn->refs == 0)
+    {
+        IFTRACE(remote)
+            std::cerr << "eliot_listen: Closing connexion " << conn->sock
+                      << "\n";
+        server->connections.erase(conn);
+        delete conn;
+    }
+}
+
+
+static void listen_serve_frame(ListenServer *server, ListenConnection *conn,
+                               RemoteFrame &frame, text &output)
+// ----------------------------------------------------------------------------
+//   Evaluate a request frame in its own context and send the result
+// ----------------------------------------------------------------------------
+{
+    if (frame.kind == frameOPTIONS)
+    {
+        remote_frame_take(conn->input, frame, false, NULL);
+        pthread_mutex_lock(&conn->writeLock);
+        remote_options(conn->sock, frame, conn->cache);
+        pthread_mutex_unlock(&conn->writeLock);
+        return;
+    }
+
+    bool wantReply = frame.kind != frameTELL;
+    {
+        ListenEvaluating evaluating;
+        remote_frame_take(conn->input, frame, true, &conn->cache);
+        Tree_p code = frame.tree;
+        frame.tree = NULL;
+        if (code)
+        {
+            Context_p context = new Context(server->context, code->Position());
+            Save<int>               saveReply(reply_socket,
+                                              wantReply ? conn->sock : 0);
+            Save<ulonglong>         saveId(reply_id, frame.id);
+            Save<bool>              saveTell(reply_discard, !wantReply);
+            Save<pthread_mutex_t *> saveLock(reply_lock, &conn->writeLock);
+            Save<RemoteCache *>     saveCache(reply_cache, &conn->cache);
+            bool accepted = eliot_evaluate_received(context, code);
+            remote_encode(output, accepted ? (Tree *) code : NULL,
+                          &conn->cache, false);
+        }
+        else
+        {
+            std::cerr << "eliot_listen: Invalid or incomplete request "
+                      << frame.id << "\n";
+            output.clear();
+        }
+    }
+
+    if (wantReply)
+    {
+        pthread_mutex_lock(&conn->writeLock);
+        remote_send_frame(conn->sock, frame.id, frameDONE, output);
+        pthread_mutex_unlock(&conn->writeLock);
+    }
+}
+
+
+static bool listen_serve_legacy(ListenServer *server, ListenConnection *conn,
+                                text &output)
+// ----------------------------------------------------------------------------
+//   Try to evaluate a legacy request, return false if it is incomplete
+// ----------------------------------------------------------------------------
+{
+    RemoteInput &input = conn->input;
+    bool complete = false;
+    output.clear();
+    {
+        ListenEvaluating evaluating;
+        Deserializer reader(input.data, input.mask, input.start, input.end);
+        Tree_p code = reader.ReadTree();
+        complete = reader.IsValid() && code;
+        if (complete)
+        {
+            input.Skip(reader.Consumed());
+            Context_p context = new Context(server->context, code->Position());
+            Save<int>               saveReply(reply_socket, conn->sock);
+            Save<ulonglong>         saveId(reply_id, 0);
+            Save<bool>              saveTell(reply_discard, false);
+            Save<pthread_mutex_t *> saveLock(reply_lock, &conn->writeLock);
+            if (eliot_evaluate_received(context, code))
+                Serializer::Write(output, code);
+        }
+    }
+
+    if (complete && output.length())
+    {
+        pthread_mutex_lock(&conn->writeLock);
+        remote_send(conn->sock, output);
+        pthread_mutex_unlock(&conn->writeLock);
+    }
+    return complete;
+}
+
+
+static bool listen_serve(ListenServer *server, ListenConnection *conn,
+                         text &output)
+// ----------------------------------------------------------------------------
+//   Read available input and serve complete requests, false when done
+// ----------------------------------------------------------------------------
+//   Requests on one connection are processed in order, like in a forked
+//   child, since a client may rely on a 'tell' being done before an 'ask'
+{
+    // Read everything the socket has for us
+    bool open = true;
+    while (true)
+    {
+        ssize_t got = conn->input.Fill(conn->sock, false);
+        if (got > 0)
+            continue;
+        if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            open = false;
+        break;
+    }
+
+    if (conn->mode < 0)
+        conn->mode = remote_multiplexed(conn->input);
+
+    if (conn->mode > 0)
+    {
+        RemoteFrame frame;
+        while (listening && remote_frame_ready(conn->input, frame))
+            listen_serve_frame(server, conn, frame, output);
+    }
+    else if (conn->mode == 0 && conn->input.Size())
+    {
+        // A legacy client sends a single program, then we close
+        if (listen_serve_legacy(server, conn, output))
+            open = false;
+    }
+    return open && listening;
+}
+
+
+static void *listen_worker(void *arg)
+// ----------------------------------------------------------------------------
+//   Worker thread processing the requests of one connection at a time
+// ----------------------------------------------------------------------------
+{
+    ListenServer *server = (ListenServer *) arg;
+    text output;                // Reused for all responses of this worker
+
+    // Only cancel while waiting in a builtin, see BlockingCall
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    pthread_mutex_lock(&server->lock);
+    while (true)
+    {
+        while (server->queue.empty() && !server->stopping)
+            pthread_cond_wait(&server->ready, &server->lock);
+        if (server->queue.empty())
+            break;
+
+        ListenConnection *conn = server->queue.front();
+        server->queue.pop_front();
+        pthread_mutex_unlock(&server->lock);
+
+        bool open = listen_serve(server, conn, output);
+
+        pthread_mutex_lock(&server->lock);
+        if (open)
+        {
+            // Let the event loop give us more input for that connection
+            epoll_event event = { 0 };
+            event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            event.data.ptr = conn;
+            epoll_ctl(server->epoll, EPOLL_CTL_MOD, conn->sock, &event);
+        }
+        else if (!server->stopping)
+        {
+            epoll_ctl(server->epoll, EPOLL_CTL_DEL, conn->sock, NULL);
+            listen_release(server, conn);
+        }
+        listen_release(server, conn);
+
+        if (!listening)
+        {
+            char stop = 0;
+            if (write(server->wakeup[1], &stop, 1) < 0)
+                std::cerr << "eliot_listen: Error waking up listener: "
+                          << strerror(errno) << "\n";
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+
+int eliot_listen_threaded(Context *context, uint threads, uint port)
+// ----------------------------------------------------------------------------
+//    Listen on the given port, serve all connexions from a single process
+// ----------------------------------------------------------------------------
+{
+    // Open the socket
+    int sock = remote_listen_socket(port);
+    if (sock < 0)
+        return -1;
+    listen(sock, SOMAXCONN);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    // Setup the event loop, listening socket has a NULL pointer
+    ListenServer server;
+    server.context = context;
+    server.stopping = false;
+    server.epoll = epoll_create(64);
+    if (server.epoll < 0 || pipe(server.wakeup) < 0)
+    {
+        std::cerr << "eliot_listen: Error creating event loop: "
+                  << strerror(errno) << "\n";
+        close(sock);
+        return -1;
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    epoll_event event = { 0 };
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, sock, &event);
+    event.data.ptr = &server;
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.wakeup[0], &event);
+
+    // Start the worker threads
+    std::vector<pthread_t> workers(threads);
+    for (uint t = 0; t < threads; t++)
+        pthread_create(&workers[t], NULL, listen_worker, &server);
+    IFTRACE(remote)
+        std::cerr << "eliot_listen: Listening on port " << port
+                  << " with " << threads << " threads\n";
+
+    // Event loop
+    const int    MAX_EVENTS = 64;
+    epoll_event  events[MAX_EVENTS];
+    listening = true;
+    while (listening)
+    {
+        int count = epoll_wait(server.epoll, events, MAX_EVENTS, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "eliot_listen: Error waiting for events: "
+                      << strerror(errno) << "\n";
+            break;
+        }
 
-            // Evaluate resulting code
-            if (code)
+        pthread_mutex_lock(&server.lock);
+        for (int e = 0; e < count && listening; e++)
+        {
+            void *ptr = events[e].data.ptr;
+            if (ptr == &server)
             {
-                IFTRACE(remote)
-                    std::cerr << "eliot_listen: Received code: "
-                              << code << "\n";
-                received = code;
-                Tree_p hookResult = context->Evaluate(hook);
-                if (hookResult != eliot_nil)
+                // Woken up by a worker, check 'listening' again
+                char buffer[64];
+                if (read(server.wakeup[0], buffer, sizeof(buffer)) < 0)
+                    std::cerr << "eliot_listen: Error reading wakeup: "
+                              << strerror(errno) << "\n";
+            }
+            else if (ptr == NULL)
+            {
+                // Accept all pending connexions
+                int insock;
+                while ((insock = accept(sock, NULL, NULL)) >= 0)
                 {
-                    Save<int> saveReply(reply_socket, insock);
-                    code = eliot_merge_context(context, code);
-                    Tree_p result = context->Evaluate(code);
                     IFTRACE(remote)
-                        std::cerr << "eliot_listen: Evaluated as: "
-                                  << result << "\n";
-                    eliot_write_tree(insock, result);
-                    IFTRACE(remote)
-                        std::cerr << "eliot_listen: Response sent\n";
-                }
-                if (hookResult == eliot_false || hookResult == eliot_nil)
-                {
-                    listening = false;
+                        std::cerr << "eliot_listen: Got incoming connexion "
+                                  << insock << "\n";
+                    fcntl(insock, F_SETFL, fcntl(insock,F_GETFL) | O_NONBLOCK);
+                    ListenConnection *conn = new ListenConnection(insock);
+                    server.connections.insert(conn);
+                    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                    event.data.ptr = conn;
+                    epoll_ctl(server.epoll, EPOLL_CTL_ADD, insock, &event);
                 }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    std::cerr << "eliot_listen: Error accepting port "
+                              << port << ": " << strerror(errno) << "\n";
             }
-            close(insock);
-
-            if (forking)
+            else
             {
-                IFTRACE(remote)
-                    std::cerr << "eliot_listen: Exiting PID "
-                              << getpid() << "\n";
-                exit(listening ? 0 : 42);
+                // Hand the connexion to a worker until it re-arms it
+                ListenConnection *conn = (ListenConnection *) ptr;
+                conn->refs++;
+                server.queue.push_back(conn);
+                pthread_cond_signal(&server.ready);
             }
         }
+        pthread_mutex_unlock(&server.lock);
     }
 
+    // Stop the workers and close remaining connexions. Workers waiting
+    // in a builtin, e.g. in a program running 'every', are cancelled
+    IFTRACE(remote)
+        std::cerr << "eliot_listen: Stopping threaded listener\n";
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    server.queue.clear();
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (uint t = 0; t < threads; t++)
+        pthread_cancel(workers[t]);
+    for (uint t = 0; t < threads; t++)
+        pthread_join(workers[t], NULL);
+
+    listen_connections::iterator c;
+    for (c = server.connections.begin(); c != server.connections.end(); c++)
+        delete *c;
+    close(server.wakeup[0]);
+    close(server.wakeup[1]);
+    close(server.epoll);
     close(sock);
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
     return 0;
 }
 
+#else // !CONFIG_LINUX
+
+int eliot_listen_threaded(Context *context, uint threads, uint port)
+// ----------------------------------------------------------------------------
+//    Without epoll, fall back to the forking listener
+// ----------------------------------------------------------------------------
+{
+    std::cerr << "eliot_listen: Threaded listener not available, forking\n";
+    return eliot_listen(context, MAIN->options.listen_forks, port);
+}
+
+#endif // CONFIG_LINUX
+
+
 
 int eliot_reply(Context *context, Tree *code)
 // ----------------------------------------------------------------------------
 //   Send code back to whoever invoked us
 // ----------------------------------------------------------------------------
 {
+    if (reply_discard)
+    {
+        IFTRACE(remote)
+            std::cerr << "eliot_reply: Sender did not ask for a reply\n";
+        return 0;
+    }
     if (!reply_socket)
     {
         std::cerr << "eliot_reply: Not replying to anybody\n";
@@ -567,7 +3415,19 @@ int eliot_reply(Context *context, Tree *code)
     code = eliot_attach_context(context, code);
     IFTRACE(remote)
         std::cerr << "eliot_reply: After replacement:\n" << code << "\n";
-    eliot_write_tree(reply_socket, code);
+    text output;
+    remote_encode(output, code, reply_cache);
+
+    // The event-driven listener may be sending other frames on that socket
+    BlockingCall blocking;
+    if (reply_lock)
+        pthread_mutex_lock(reply_lock);
+    pthread_cleanup_push(remote_unlock, reply_lock);
+    if (reply_id)
+        remote_send_frame(reply_socket, reply_id, frameREPLY, output);
+    else
+        remote_send(reply_socket, output);
+    pthread_cleanup_pop(reply_lock != NULL);
     return 0;
 }
 
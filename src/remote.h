@@ -28,13 +28,65 @@ ELIOT_BEGIN
 
 const uint ELIOT_DEFAULT_PORT = 1205;
 
+struct RemoteFuture;
+
+struct FutureInfo : Info
+// ----------------------------------------------------------------------------
+//   Mark a tree as the future result of an ask_async
+// ----------------------------------------------------------------------------
+//   A future evaluates as itself until its value is needed, e.g. to
+//   match a parameter type, or when calling 'wait'
+{
+    FutureInfo(): context(), future(NULL), value() {}
+    ~FutureInfo();
+
+    Context_p           context;        // Context for the reply symbols
+    RemoteFuture *      future;         // NULL once the value is known
+    Tree_p              value;
+};
+
+
 int     eliot_tell(Context *, text host, Tree *body);
 Tree_p  eliot_ask(Context *, text host, Tree *body);
 Tree_p  eliot_invoke(Context *, text host, Tree *body);
+Tree_p  eliot_ask_all(Context *, Tree *hosts, Tree *body);
+int     eliot_ask_each(Context *, Tree *hosts, Tree *body, Tree *callback);
+Tree_p  eliot_ask_async(Context *, text host, Tree *body);
+Tree *  eliot_future_wait(Tree *future);
+Tree *  eliot_restore_nil(Tree *tree);
+bool    eliot_future_ready(Tree *future);
 int     eliot_reply(Context *, Tree *body);
 Tree_p  eliot_listen_received();
 Tree_p  eliot_listen_hook(Tree *body);
 int     eliot_listen(Context *, uint forking, uint port = ELIOT_DEFAULT_PORT);
+int     eliot_listen_threaded(Context *, uint threads,
+                              uint port = ELIOT_DEFAULT_PORT);
+
+
+struct BlockingCall
+// ----------------------------------------------------------------------------
+//   Let other listener threads evaluate while a builtin waits
+// ----------------------------------------------------------------------------
+//   The event-driven listener evaluates one program at a time. Builtins
+//   that wait for time or for the network do it in a BlockingCall scope,
+//   where they must not touch trees.
+{
+    BlockingCall();
+    ~BlockingCall();
+    bool                released;       // We held the evaluator
+};
+
+
+inline Tree *eliot_future(Tree *value)
+// ----------------------------------------------------------------------------
+//   Return the value of a future from ask_async, other values unchanged
+// ----------------------------------------------------------------------------
+//   Only futures have a FutureInfo, so most values don't need a call
+{
+    if (value && value->GetInfo<FutureInfo>())
+        return eliot_future_wait(value);
+    return value;
+}
 
 ELIOT_END
 
@@ -80,7 +80,7 @@ Tree *eliot_form_error(Context *context, Tree *what)
     if (quickExit)
         return what;
 
-    static bool recursive = false;
+    static __thread bool recursive = false;
     if (recursive)
     {
         std::cerr << "ABORT - Recursive error during error handling\n"
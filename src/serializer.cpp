@@ -41,6 +41,9 @@
 
 #include "serializer.h"
 #include "renderer.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/time.h>
 #ifdef CONFIG_MINGW
 #include <sys/param.h>
 #elif CONFIG_MACOSX
@@ -92,6 +95,285 @@ union ieee754_double
 
 
 
+// ============================================================================
+//
+//    Compact format
+//
+// ============================================================================
+//
+//  The compact format (serialVERSION_COMPACT) follows the magic and version
+//  with a flags value. If the body is compressed, the flags are followed by
+//  the expanded size, the compressed size and the compressed body.
+//
+//  Nodes begin with a single byte tag. Small integers, names in the static
+//  dictionary below and infix with a dictionary name fit in that byte.
+//  Texts are written as a varint N: if N is even, N/2 bytes follow;
+//  if N is odd, it refers to entry N/2, first in the dictionary, then in
+//  the texts already written in the same stream.
+
+enum CompactTag
+// ----------------------------------------------------------------------------
+//   Single byte tags for the compact format
+// ----------------------------------------------------------------------------
+{
+    compactNULL         = 0x00, // NULL tree
+    compactINTEGER      = 0x01, // Zigzag-encoded value
+    compactREAL         = 0x02, // Exponent and mantissa as in WriteReal
+    compactTEXT         = 0x03, // Value between double quotes
+    compactTEXT_DELIM   = 0x04, // Opening, value, closing
+    compactNAME         = 0x05, // Name not in the first dictionary entries
+    compactBLOCK        = 0x06, // Opening, child, closing
+    compactPARENS       = 0x07, // Child of a ( ) block
+    compactBRACES       = 0x08, // Child of a { } block
+    compactBRACKETS     = 0x09, // Child of a [ ] block
+    compactINDENT       = 0x0A, // Child of an indented block
+    compactPREFIX       = 0x0B, // Left, right
+    compactPOSTFIX      = 0x0C, // Left, right
+    compactINFIX        = 0x0D, // Name, left, right
+    compactREFERENCE    = 0x0E, // Hash of a tree known to the reader
+
+    compactSMALL        = 0x10, // Integers 0 to 47
+    compactSMALL_MAX    = 0x3F,
+    compactDICT_NAME    = 0x40, // Name, dictionary entries 0 to 63
+    compactDICT_INFIX   = 0x80, // Infix, dictionary entries 0 to 127
+
+    compactCOMPRESSED   = 1,    // Flag: the body is compressed
+    compactCOMPRESS_MIN = 512   // Smaller bodies are not worth compressing
+};
+
+
+static kstring serial_dictionary[] =
+// ----------------------------------------------------------------------------
+//   Names shared by all readers and writers, never change existing entries
+// ----------------------------------------------------------------------------
+//   Taken from builtins.eliot and the .tbl modules. The most frequent infix
+//   come first, since only the first 128 entries fit in an infix tag,
+//   and only the first 64 entries fit in a name tag.
+{
+    "\n", ";", "->", ",", ":", "as", "when", ":=",
+    "+", "-", "*", "/", "=", "<>", "<", ">",
+    "<=", ">=", ".", "and", "or", "xor", "mod", "rem",
+    "^", "&", "..", "nil", "true", "false", "integer", "real",
+    "text", "boolean", "tree", "name", "reply", "ask", "tell", "invoke",
+    "temperature", "writeln", "write", "every", "if", "then", "else", "while",
+    "until", "loop", "for", "in", "sleep", "not", "C", "opcode",
+    "process_id", "min", "max", "abs", "s", "ms", "h", "m",
+
+    "infix", "prefix", "postfix", "block", "character", "from", "contains",
+    "shl", "ashr", "lshr", "good", "bad", "kind", "left", "right",
+    "opening", "closing", "child", "quote", "debug",
+    "text_index", "text_replace", "hours", "minutes", "seconds",
+    "year", "month", "day", "week_day", "year_day", "time",
+    "ask_all", "ask_each", "ask_async", "wait", "ready",
+    "listen", "listen_on", "listen_forking", "listen_threaded",
+    "listen_hook", "listen_received",
+    "module_path", "module_directory", "module_file", "module_name",
+    "eliot_write_text", "eliot_write_integer", "eliot_write_real",
+    "eliot_write_character", "eliot_write_cr"
+};
+static const longlong serial_dictionary_size =
+    sizeof(serial_dictionary) / sizeof(serial_dictionary[0]);
+
+
+static text_map serial_dictionary_build()
+// ----------------------------------------------------------------------------
+//   Build the index used by the writer to find dictionary entries
+// ----------------------------------------------------------------------------
+{
+    text_map index;
+    for (longlong i = 0; i < serial_dictionary_size; i++)
+        index[serial_dictionary[i]] = i;
+    return index;
+}
+static const text_map serial_dictionary_index = serial_dictionary_build();
+
+
+static inline longlong serial_dictionary_find(const text &value)
+// ----------------------------------------------------------------------------
+//   Return the dictionary entry for a name, or -1
+// ----------------------------------------------------------------------------
+{
+    text_map::const_iterator found = serial_dictionary_index.find(value);
+    return found == serial_dictionary_index.end() ? -1 : found->second;
+}
+
+
+static inline ulonglong serial_zigzag(longlong value)
+// ----------------------------------------------------------------------------
+//   Map signed to unsigned values so that small magnitudes stay small
+// ----------------------------------------------------------------------------
+{
+    return (ulonglong(value) << 1) ^ ulonglong(value >> 63);
+}
+
+
+static inline longlong serial_unzigzag(ulonglong value)
+// ----------------------------------------------------------------------------
+//   Reverse of serial_zigzag
+// ----------------------------------------------------------------------------
+{
+    return longlong(value >> 1) ^ -longlong(value & 1);
+}
+
+
+
+// ============================================================================
+//
+//    LZ4-style compression of the compact body
+//
+// ============================================================================
+//
+//  Each sequence is a token byte with the literal count in the high nibble
+//  and the match length minus 4 in the low nibble, a nibble of 15 being
+//  followed by bytes to add until one is not 255. Then come the literals,
+//  then a 16-bit little-endian offset for the match. The last sequence
+//  only has literals.
+
+static const uint   SERIAL_LZ_HASH_BITS = 12;
+static const size_t SERIAL_LZ_MIN_MATCH = 4;
+static const size_t SERIAL_LZ_MAX_OFFSET = 0xFFFF;
+
+
+static inline uint serial_lz_hash(const byte *data)
+// ----------------------------------------------------------------------------
+//   Hash the next four bytes
+// ----------------------------------------------------------------------------
+{
+    uint value = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+    return (value * 2654435761U) >> (32 - SERIAL_LZ_HASH_BITS);
+}
+
+
+static void serial_lz_length(text &out, size_t length)
+// ----------------------------------------------------------------------------
+//   Write the part of a length that did not fit in the token
+// ----------------------------------------------------------------------------
+{
+    while (length >= 255)
+    {
+        out.push_back(char(255));
+        length -= 255;
+    }
+    out.push_back(char(length));
+}
+
+
+static void serial_lz_sequence(text &out, const byte *literals, size_t count,
+                               size_t offset, size_t length)
+// ----------------------------------------------------------------------------
+//   Write a sequence, with a zero length for the final literals
+// ----------------------------------------------------------------------------
+{
+    size_t extra = length ? length - SERIAL_LZ_MIN_MATCH : 0;
+    out.push_back(char(((count < 15 ? count : 15) << 4) |
+                       (extra < 15 ? extra : 15)));
+    if (count >= 15)
+        serial_lz_length(out, count - 15);
+    out.append((const char *) literals, count);
+    if (!length)
+        return;
+    out.push_back(char(offset & 0xFF));
+    out.push_back(char(offset >> 8));
+    if (extra >= 15)
+        serial_lz_length(out, extra - 15);
+}
+
+
+static void serial_lz_compress(const byte *in, size_t size, text &out)
+// ----------------------------------------------------------------------------
+//   Greedy compression using a hash of the last position for 4 bytes
+// ----------------------------------------------------------------------------
+{
+    size_t table[1 << SERIAL_LZ_HASH_BITS]; // Position + 1, 0 if unused
+    memset(table, 0, sizeof(table));
+
+    size_t pos = 0, anchor = 0;
+    while (pos + SERIAL_LZ_MIN_MATCH <= size)
+    {
+        uint hash = serial_lz_hash(in + pos);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (!candidate ||
+            pos - (candidate - 1) > SERIAL_LZ_MAX_OFFSET ||
+            memcmp(in + candidate - 1, in + pos, SERIAL_LZ_MIN_MATCH) != 0)
+        {
+            pos++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t length = SERIAL_LZ_MIN_MATCH;
+        while (pos + length < size && in[match + length] == in[pos + length])
+            length++;
+        serial_lz_sequence(out, in + anchor, pos - anchor, pos - match, length);
+        pos += length;
+        anchor = pos;
+    }
+    serial_lz_sequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+
+static bool serial_lz_count(const byte *&in, const byte *end, size_t &count)
+// ----------------------------------------------------------------------------
+//   Read the part of a length that did not fit in the token
+// ----------------------------------------------------------------------------
+{
+    byte b;
+    do
+    {
+        if (in == end)
+            return false;
+        b = *in++;
+        count += b;
+    } while (b == 255);
+    return true;
+}
+
+
+static bool serial_lz_expand(const byte *in, size_t size,
+                             text &out, size_t expected)
+// ----------------------------------------------------------------------------
+//   Decompress, return false if the input is corrupt
+// ----------------------------------------------------------------------------
+{
+    const byte *end = in + size;
+    out.clear();
+    out.reserve(expected);
+    while (in < end)
+    {
+        byte token = *in++;
+        size_t count = token >> 4;
+        if (count == 15 && !serial_lz_count(in, end, count))
+            return false;
+        if (count > size_t(end - in) || count > expected - out.size())
+            return false;
+        out.append((const char *) in, count);
+        in += count;
+        if (in == end)
+            break;
+
+        if (end - in < 2)
+            return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !serial_lz_count(in, end, length))
+            return false;
+        length += SERIAL_LZ_MIN_MATCH;
+        if (offset == 0 || offset > out.size() ||
+            length > expected - out.size())
+            return false;
+
+        // Matches may overlap what they produce, so copy byte by byte
+        size_t from = out.size() - offset;
+        for (size_t i = 0; i < length; i++)
+            out.push_back(out[from + i]);
+    }
+    return out.size() == expected;
+}
+
+
+
 // ============================================================================
 //
 //   Class Serializer : Convert trees to serialized form
@@ -102,10 +384,78 @@ Serializer::Serializer(std::ostream &out)
 // ----------------------------------------------------------------------------
 //   Constructor sends the magic and version number
 // ----------------------------------------------------------------------------
-    : out (out)
+    : out(&out), buffer(NULL), references(NULL),
+      format(serialSTANDARD), output(NULL), body()
+{
+    WriteUnsigned(serialMAGIC);
+    WriteUnsigned(serialVERSION_BASE);
+}
+
+
+Serializer::Serializer(text &buffer, const tree_hashes *references,
+                       SerializationFormat format)
+// ----------------------------------------------------------------------------
+//   Constructor appending to a memory buffer, e.g. to send on a socket
+// ----------------------------------------------------------------------------
+//   Readers that predate references can still read what we write unless
+//   we actually use references, so only bump the version in that case.
+//   The compact format is written to 'body' until Finish() is called.
+    : out(NULL), buffer(&buffer), references(references),
+      format(format), output(NULL), body()
 {
+    if (format != serialSTANDARD)
+    {
+        output = &buffer;
+        this->buffer = &body;
+        return;
+    }
     WriteUnsigned(serialMAGIC);
-    WriteUnsigned(serialVERSION);
+    WriteUnsigned(references ? serialVERSION : serialVERSION_BASE);
+}
+
+
+Serializer::~Serializer()
+// ----------------------------------------------------------------------------
+//   Make sure compact output is complete
+// ----------------------------------------------------------------------------
+{
+    Finish();
+}
+
+
+void Serializer::Finish()
+// ----------------------------------------------------------------------------
+//   Write the header and the body of the compact format, compressed or not
+// ----------------------------------------------------------------------------
+{
+    if (!output)
+        return;
+
+    text packed;
+    if (format == serialCOMPRESSED && body.length() >= compactCOMPRESS_MIN)
+    {
+        serial_lz_compress((const byte *) body.data(), body.length(), packed);
+        if (packed.length() + 8 >= body.length())
+            packed.clear();
+    }
+
+    buffer = output;
+    output = NULL;
+    WriteUnsigned(serialMAGIC);
+    WriteUnsigned(serialVERSION_COMPACT);
+    if (packed.length())
+    {
+        WriteUnsigned(compactCOMPRESSED);
+        WriteUnsigned(body.length());
+        WriteUnsigned(packed.length());
+        Put(packed.data(), packed.length());
+    }
+    else
+    {
+        WriteUnsigned(0);
+        Put(body.data(), body.length());
+    }
+    body.clear();
 }
 
 
@@ -125,6 +475,21 @@ Tree *Serializer::DoInteger(Integer *what)
 //   Serialize an integer leaf
 // ----------------------------------------------------------------------------
 {
+    if (output)
+    {
+        longlong value = what->value;
+        if (value >= 0 && value <= compactSMALL_MAX - compactSMALL)
+        {
+            Put(byte(compactSMALL + value));
+        }
+        else
+        {
+            Put(compactINTEGER);
+            WriteUnsigned(serial_zigzag(value));
+        }
+        return what;
+    }
+
     WriteUnsigned(serialINTEGER);
     WriteSigned(what->value);
     return what;
@@ -136,6 +501,13 @@ Tree *Serializer::DoReal(Real *what)
 //   Serialize a real leaf
 // ----------------------------------------------------------------------------
 {
+    if (output)
+    {
+        Put(compactREAL);
+        WriteReal(what->value);
+        return what;
+    }
+
     WriteUnsigned(serialREAL);
     WriteReal(what->value);
     return what;
@@ -147,6 +519,23 @@ Tree *Serializer::DoText(Text *what)
 //   Serialize a text leaf
 // ----------------------------------------------------------------------------
 {
+    if (output)
+    {
+        if (what->opening == "\"" && what->closing == "\"")
+        {
+            Put(compactTEXT);
+            WriteCompactText(what->value);
+        }
+        else
+        {
+            Put(compactTEXT_DELIM);
+            WriteCompactText(what->opening);
+            WriteCompactText(what->value);
+            WriteCompactText(what->closing);
+        }
+        return what;
+    }
+
     WriteUnsigned(serialTEXT);
     WriteText(what->opening);
     WriteText(what->value);
@@ -160,6 +549,21 @@ Tree *Serializer::DoName(Name *what)
 //   Serialize a name/symbol leaf
 // ----------------------------------------------------------------------------
 {
+    if (output)
+    {
+        longlong entry = serial_dictionary_find(what->value);
+        if (entry >= 0 && entry < compactDICT_INFIX - compactDICT_NAME)
+        {
+            Put(byte(compactDICT_NAME + entry));
+        }
+        else
+        {
+            Put(compactNAME);
+            WriteCompactText(what->value);
+        }
+        return what;
+    }
+
     WriteUnsigned(serialNAME);
     WriteText(what->value);
     return what;
@@ -171,7 +575,10 @@ Tree *Serializer::DoPrefix(Prefix *what)
 //   Serialize a prefix tree
 // ----------------------------------------------------------------------------
 {
-    WriteUnsigned(serialPREFIX);
+    if (output)
+        Put(compactPREFIX);
+    else
+        WriteUnsigned(serialPREFIX);
     WriteChild(what->left);
     WriteChild(what->right);
     return what;
@@ -183,7 +590,10 @@ Tree *Serializer::DoPostfix(Postfix *what)
 //   Serialize a postfix tree
 // ----------------------------------------------------------------------------
 {
-    WriteUnsigned(serialPOSTFIX);
+    if (output)
+        Put(compactPOSTFIX);
+    else
+        WriteUnsigned(serialPOSTFIX);
     WriteChild(what->left);
     WriteChild(what->right);
     return what;
@@ -195,6 +605,12 @@ Tree *Serializer::DoInfix(Infix *what)
 //   Serialize an infix tree
 // ----------------------------------------------------------------------------
 {
+    if (output)
+    {
+        WriteCompactInfix(what);
+        return what;
+    }
+
     WriteUnsigned(serialINFIX);
     WriteChild(what->left);
     WriteText(what->name);
@@ -208,6 +624,27 @@ Tree *Serializer::DoBlock(Block *what)
 //   Serialize a block tree
 // ----------------------------------------------------------------------------
 {
+    if (output)
+    {
+        const text &open = what->opening, &close = what->closing;
+        byte tag = compactBLOCK;
+        if (open == "(" && close == ")")
+            tag = compactPARENS;
+        else if (open == "{" && close == "}")
+            tag = compactBRACES;
+        else if (open == "[" && close == "]")
+            tag = compactBRACKETS;
+        else if (what->IsIndent())
+            tag = compactINDENT;
+        Put(tag);
+        if (tag == compactBLOCK)
+            WriteCompactText(open);
+        WriteChild(what->child);
+        if (tag == compactBLOCK)
+            WriteCompactText(close);
+        return what;
+    }
+
     WriteUnsigned(serialBLOCK);
     WriteText(what->opening);
     WriteChild(what->child);
@@ -228,7 +665,7 @@ void Serializer::WriteSigned(longlong value)
         value >>= 7;
         if ((value != 0 && value != -1) || (value & 0x40) != (b & 0x40))
             b |= 0x80;
-        out << b;
+        Put(b);
     } while (b & 0x80);
 }
 
@@ -245,7 +682,7 @@ void Serializer::WriteUnsigned(ulonglong value)
         value >>= 7;
         if (value != 0)
             b |= 0x80;
-        out << b;
+        Put(b);
     } while (b & 0x80);
 }
 
@@ -282,19 +719,78 @@ void Serializer::WriteText(text value)
     else
     {
         WriteSigned(value.length());
-        out.write(value.data(), value.length());
+        Put(value.data(), value.length());
         texts[value] = texts.size();
     }
 }
 
 
+void Serializer::WriteCompactText(text value)
+// ----------------------------------------------------------------------------
+//   Write a dictionary entry, a text already written, or length and data
+// ----------------------------------------------------------------------------
+{
+    longlong entry = serial_dictionary_find(value);
+    if (entry < 0)
+    {
+        // texts[value] is 0 if not written yet, otherwise its index + 1
+        longlong &exists = texts[value];
+        if (!exists)
+        {
+            exists = texts.size();
+            WriteUnsigned(ulonglong(value.length()) << 1);
+            Put(value.data(), value.length());
+            return;
+        }
+        entry = serial_dictionary_size + exists - 1;
+    }
+    WriteUnsigned((ulonglong(entry) << 1) | 1);
+}
+
+
+void Serializer::WriteCompactInfix(Infix *what)
+// ----------------------------------------------------------------------------
+//   Write an infix, with a single byte if its name is in the dictionary
+// ----------------------------------------------------------------------------
+{
+    longlong entry = serial_dictionary_find(what->name);
+    if (entry >= 0 && entry < 0x100 - compactDICT_INFIX)
+    {
+        Put(byte(compactDICT_INFIX + entry));
+    }
+    else
+    {
+        Put(compactINFIX);
+        WriteCompactText(what->name);
+    }
+    WriteChild(what->left);
+    WriteChild(what->right);
+}
+
+
 void Serializer::WriteChild(Tree *child)
 // ----------------------------------------------------------------------------
 //   Serialie a child, either NULL or actual child
 // ----------------------------------------------------------------------------
 {
+    if (references && child)
+    {
+        tree_hashes::const_iterator found = references->find(child);
+        if (found != references->end())
+        {
+            if (output)
+                Put(compactREFERENCE);
+            else
+                WriteUnsigned(serialREFERENCE);
+            WriteUnsigned(found->second);
+            return;
+        }
+    }
+
     if (child)
         child->Do(this);
+    else if (output)
+        Put(compactNULL);
     else
         WriteUnsigned(serialNULL);
 }
@@ -311,17 +807,38 @@ Deserializer::Deserializer(std::istream &in, TreePosition pos)
 // ----------------------------------------------------------------------------
 //   Read a few bytes from the stream, check version and magic value
 // ----------------------------------------------------------------------------
-    : in(in), pos(pos)
+    : in(&in), ring(NULL), mask(0), first(0), index(0), end(0),
+      failed(false), known(NULL), pos(pos),
+      compact(false), packed(0), expanded()
 {
-    if (ReadUnsigned() != serialMAGIC ||
-        ReadUnsigned() != serialVERSION)
-    {
-        // Error on input: close the stream
-        in.setstate(in.failbit);
-    }
+    ReadHeader();
 }
 
 
+Deserializer::Deserializer(const byte *ring, size_t mask,
+                           size_t start, size_t end,
+                           const hash_trees *known, TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Read from memory, e.g. data received from a socket
+// ----------------------------------------------------------------------------
+    : in(NULL), ring(ring), mask(mask), first(start), index(start), end(end),
+      failed(false), known(known), pos(pos),
+      compact(false), packed(0), expanded()
+{
+    ReadHeader();
+}
+
+
+Deserializer::Deserializer(const hash_trees *known, TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Constructor for derived classes that supply the input later
+// ----------------------------------------------------------------------------
+    : in(NULL), ring(NULL), mask(~size_t(0)), first(0), index(0), end(0),
+      failed(false), known(known), pos(pos),
+      compact(false), packed(0), expanded()
+{}
+
+
 Deserializer::~Deserializer()
 // ----------------------------------------------------------------------------
 //   No-op destructor
@@ -329,14 +846,65 @@ Deserializer::~Deserializer()
 {}
 
 
+void Deserializer::ReadHeader()
+// ----------------------------------------------------------------------------
+//   Check magic and version, expand compressed input
+// ----------------------------------------------------------------------------
+{
+    ulonglong version = 0;
+    if (ReadUnsigned() != serialMAGIC)
+    {
+        // Error on input: close the stream
+        Fail();
+        return;
+    }
+
+    version = ReadUnsigned();
+    if (version == serialVERSION_COMPACT)
+    {
+        compact = true;
+        if (!(ReadUnsigned() & compactCOMPRESSED))
+            return;
+
+        // The expansion ratio cannot exceed 255, check before we allocate
+        ulonglong size = ReadUnsigned();
+        ulonglong length = ReadUnsigned();
+        text input;
+        if (!IsValid() ||
+            length == 0 || size / 255 > length ||
+            !ReadBytes(input, length) ||
+            !serial_lz_expand((const byte *) input.data(), input.length(),
+                              expanded, size))
+        {
+            Fail();
+            return;
+        }
+
+        // Continue reading from the expanded data
+        packed = index - first;
+        in = NULL;
+        ring = (const byte *) expanded.data();
+        mask = ~size_t(0);
+        first = index = 0;
+        end = expanded.length();
+    }
+    else if (version < serialVERSION_BASE || version > serialVERSION)
+    {
+        Fail();
+    }
+}
+
+
 Tree *Deserializer::ReadTree()
 // ----------------------------------------------------------------------------
 //   Read back data from input stream and build tree from it
 // ----------------------------------------------------------------------------
 {
     // If it's bad to start with, stop reading further...
-    if (!in.good())
+    if (!IsValid())
         return NULL;
+    if (compact)
+        return ReadCompactTree();
 
     SerializationTag tag = SerializationTag(ReadUnsigned());
     text             tvalue, opening, closing;
@@ -395,8 +963,19 @@ Tree *Deserializer::ReadTree()
         result = new Postfix(left, right, pos);
         break;
 
+    case serialREFERENCE:
+    {
+        ulonglong hash = ReadUnsigned();
+        hash_trees::const_iterator found;
+        if (known && (found = known->find(hash)) != known->end())
+            result = found->second;
+        else
+            Fail();
+        break;
+    }
+
     default:
-        in.setstate(in.failbit);
+        Fail();
     }
 
     return result;
@@ -408,7 +987,7 @@ longlong Deserializer::ReadSigned()
 //   Read values from input stream, checking that it fits local longlong
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!IsValid())
         return 0;
 
     byte     b;
@@ -417,14 +996,14 @@ longlong Deserializer::ReadSigned()
     uint     shift = 0;
     do
     {
-        b = in.get();
+        b = Get();
         shifted = longlong(b & 0x7f) << shift;
         value |= shifted;
         if ((shifted >> shift) != (b & 0x7f))
-            in.setstate(in.failbit);
+            Fail();
         shift += 7;
     }
-    while (in.good() && (b & 0x80));
+    while (IsValid() && (b & 0x80));
 
     if (b & 0x40)
         value |= ~0ULL << shift;
@@ -438,7 +1017,7 @@ ulonglong Deserializer::ReadUnsigned()
 //   Read unsigned values from input stream, checking that it fits local ull
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!IsValid())
         return 0;
 
     byte      b;
@@ -447,14 +1026,14 @@ ulonglong Deserializer::ReadUnsigned()
     uint      shift   = 0;
     do
     {
-        b = in.get();
+        b = Get();
         shifted = ulonglong(b & 0x7f) << shift;
         value |= shifted;
         if ((shifted >> shift) != (b & 0x7f))
-            in.setstate(in.failbit);
+            Fail();
         shift += 7;
     }
-    while (in.good() && (b & 0x80));
+    while (IsValid() && (b & 0x80));
 
     return value;
 }
@@ -465,7 +1044,7 @@ double Deserializer::ReadReal()
 //   Read a real number from the input stream
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!IsValid())
         return 0;
 
     ieee754_double cvt;
@@ -493,28 +1072,678 @@ text Deserializer::ReadText()
 //   Read a text from the input stream
 // ----------------------------------------------------------------------------
 {
-    if (!in.good())
+    if (!IsValid())
         return "";
 
     text      result;
     longlong  length = ReadSigned();
 
     if (length < 0)
-    {
         result = texts[-length];
-    }
-    else
+    else if (IsValid() && ReadBytes(result, length))
+        texts[texts.size()+1] = result;
+
+    return result;
+}
+
+
+bool Deserializer::ReadBytes(text &result, size_t length)
+// ----------------------------------------------------------------------------
+//   Read raw bytes from the input
+// ----------------------------------------------------------------------------
+{
+    if (in)
     {
         char *    buffer = new char[length];
-        in.read(buffer, length);
+        in->read(buffer, length);
         result.insert(0, buffer, length);
         delete[] buffer;
+        return in->good();
+    }
 
-        texts[texts.size()+1] = result;
+    if (length > end - index)
+    {
+        // Not enough data received yet
+        failed = true;
+        return false;
     }
 
+    // Copy at most two contiguous segments out of the ring buffer
+    size_t offset = index & mask;
+    size_t direct = mask + 1 - offset;
+    if (mask == ~size_t(0) || direct > length)
+        direct = length;
+    result.reserve(length);
+    result.append((const char *) ring + offset, direct);
+    result.append((const char *) ring, length - direct);
+    index += length;
+    return true;
+}
+
+
+Tree *Deserializer::ReadCompactTree()
+// ----------------------------------------------------------------------------
+//   Read a tree in the compact format
+// ----------------------------------------------------------------------------
+{
+    byte    tag = Get();
+    text    tvalue, opening, closing;
+    Tree *  left;
+    Tree *  right;
+    Tree *  result = NULL;
+
+    if (!IsValid())
+        return NULL;
+
+    if (tag >= compactDICT_INFIX)
+    {
+        longlong entry = tag - compactDICT_INFIX;
+        if (entry >= serial_dictionary_size)
+        {
+            Fail();
+            return NULL;
+        }
+        left = ReadCompactTree();
+        right = ReadCompactTree();
+        return new Infix(serial_dictionary[entry], left, right, pos);
+    }
+    if (tag >= compactDICT_NAME)
+    {
+        longlong entry = tag - compactDICT_NAME;
+        if (entry >= serial_dictionary_size)
+        {
+            Fail();
+            return NULL;
+        }
+        return new Name(serial_dictionary[entry], pos);
+    }
+    if (tag >= compactSMALL)
+        return new Integer(tag - compactSMALL, pos);
+
+    switch(tag)
+    {
+    case compactNULL:
+        break;
+
+    case compactINTEGER:
+        result = new Integer(serial_unzigzag(ReadUnsigned()), pos);
+        break;
+    case compactREAL:
+        result = new Real(ReadReal(), pos);
+        break;
+    case compactTEXT:
+        tvalue = ReadCompactText();
+        result = new Text(tvalue, "\"", "\"", pos);
+        break;
+    case compactTEXT_DELIM:
+        opening = ReadCompactText();
+        tvalue = ReadCompactText();
+        closing = ReadCompactText();
+        result = new Text(tvalue, opening, closing, pos);
+        break;
+    case compactNAME:
+        tvalue = ReadCompactText();
+        result = new Name(tvalue, pos);
+        break;
+
+    case compactBLOCK:
+        opening = ReadCompactText();
+        left = ReadCompactTree();
+        closing = ReadCompactText();
+        result = new Block(left, opening, closing, pos);
+        break;
+    case compactPARENS:
+        result = new Block(ReadCompactTree(), "(", ")", pos);
+        break;
+    case compactBRACES:
+        result = new Block(ReadCompactTree(), "{", "}", pos);
+        break;
+    case compactBRACKETS:
+        result = new Block(ReadCompactTree(), "[", "]", pos);
+        break;
+    case compactINDENT:
+        result = new Block(ReadCompactTree(),
+                           Block::indent, Block::unindent, pos);
+        break;
+
+    case compactPREFIX:
+        left = ReadCompactTree();
+        right = ReadCompactTree();
+        result = new Prefix(left, right, pos);
+        break;
+    case compactPOSTFIX:
+        left = ReadCompactTree();
+        right = ReadCompactTree();
+        result = new Postfix(left, right, pos);
+        break;
+    case compactINFIX:
+        tvalue = ReadCompactText();
+        left = ReadCompactTree();
+        right = ReadCompactTree();
+        result = new Infix(tvalue, left, right, pos);
+        break;
+
+    case compactREFERENCE:
+    {
+        ulonglong hash = ReadUnsigned();
+        hash_trees::const_iterator found;
+        if (known && (found = known->find(hash)) != known->end())
+            result = found->second;
+        else
+            Fail();
+        break;
+    }
+
+    default:
+        Fail();
+    }
+
+    return result;
+}
+
+
+text Deserializer::ReadCompactText()
+// ----------------------------------------------------------------------------
+//   Read a text in the compact format
+// ----------------------------------------------------------------------------
+{
+    text        result;
+    ulonglong   code = ReadUnsigned();
+    if (!IsValid())
+        return result;
+
+    if (code & 1)
+    {
+        ulonglong entry = code >> 1;
+        if (entry < ulonglong(serial_dictionary_size))
+            return serial_dictionary[entry];
+
+        text_ids::iterator found = texts.find(entry - serial_dictionary_size);
+        if (found != texts.end())
+            result = found->second;
+        else
+            Fail();
+    }
+    else if (ReadBytes(result, code >> 1))
+    {
+        longlong id = texts.size();
+        texts[id] = result;
+    }
     return result;
 }
 
+
+
+// ============================================================================
+//
+//   Class StreamDeserializer : Read back data as it arrives
+//
+// ============================================================================
+
+StreamDeserializer::StreamDeserializer(bool message, const hash_trees *known,
+                                       TreePosition pos)
+// ----------------------------------------------------------------------------
+//   Create a deserializer waiting for its first data
+// ----------------------------------------------------------------------------
+    : Deserializer(known, pos),
+      header(false), message(message), complete(false), broken(false),
+      consumed(0), buffer(), stack(), statements(), result(), symbols()
+{}
+
+
+StreamDeserializer::~StreamDeserializer()
+// ----------------------------------------------------------------------------
+//   No-op destructor
+// ----------------------------------------------------------------------------
+{}
+
+
+bool StreamDeserializer::Feed(const byte *data, size_t size)
+// ----------------------------------------------------------------------------
+//   Add data to the input and read as much as we can
+// ----------------------------------------------------------------------------
+//   Compressed input is expanded once complete, so we ignore what follows
+{
+    if (!packed)
+    {
+        consumed += index;
+        buffer.erase(0, index);
+        buffer.append((const char *) data, size);
+        ring = (const byte *) buffer.data();
+        index = 0;
+        end = buffer.length();
+    }
+    return Advance();
+}
+
+
+bool StreamDeserializer::Feed(const byte *ring, size_t mask,
+                              size_t start, size_t end)
+// ----------------------------------------------------------------------------
+//   Feed data from a ring buffer, at most two contiguous segments
+// ----------------------------------------------------------------------------
+{
+    size_t size = end - start;
+    size_t offset = start & mask;
+    size_t direct = std::min(size, mask + 1 - offset);
+    if (mask == ~size_t(0))
+        direct = size;
+    return Feed(ring + offset, direct) &&
+        (direct == size || Feed(ring, size - direct));
+}
+
+
+bool StreamDeserializer::Finish()
+// ----------------------------------------------------------------------------
+//   Check that the input we were fed gave a complete tree
+// ----------------------------------------------------------------------------
+{
+    Advance();
+    return complete && !broken;
+}
+
+
+Tree *StreamDeserializer::Statement()
+// ----------------------------------------------------------------------------
+//   Return the next complete top-level statement, or NULL
+// ----------------------------------------------------------------------------
+{
+    if (statements.empty())
+        return NULL;
+    Tree_p statement = statements.front();
+    statements.pop_front();
+    return statement;
+}
+
+
+bool StreamDeserializer::Advance()
+// ----------------------------------------------------------------------------
+//   Read as many steps as we can with the data we have
+// ----------------------------------------------------------------------------
+//   The steps of a node are 'c' for a child, 'i' for a signed value,
+//   'u' for an unsigned value, 'r' for a real and 't' for a text.
+//   A step that fails is retried from the beginning with more data.
+{
+    while (!broken && !complete)
+    {
+        size_t start = index;
+        failed = false;
+
+        if (!header)
+        {
+            ReadHeader();
+            if (failed)
+            {
+                index = start;
+                break;
+            }
+            header = true;
+            continue;
+        }
+
+        Node *node = stack.size() ? &stack.back() : NULL;
+        char step = node ? *node->steps : 'c';
+        switch(step)
+        {
+        case 0:
+            Complete();
+            continue;
+        case 'c':
+            if (Start(node))
+                continue;
+            break;
+        case 'i':
+            node->ivalue = ReadSigned();
+            break;
+        case 'u':
+            node->ivalue = ReadUnsigned();
+            break;
+        case 'r':
+            node->rvalue = ReadReal();
+            break;
+        case 't':
+            node->values[node->valueCount] =
+                compact ? ReadCompactText() : ReadText();
+            break;
+        }
+        if (failed || broken)
+        {
+            index = start;
+            break;
+        }
+        if (step == 't')
+            node->valueCount++;
+        node->steps++;
+        Emit(*node);
+    }
+    return !broken;
+}
+
+
+bool StreamDeserializer::Start(Node *parent)
+// ----------------------------------------------------------------------------
+//   Read the tag of a node and push it, return false if we must wait
+// ----------------------------------------------------------------------------
+{
+    uint tag = compact ? Get() : ReadUnsigned();
+    if (failed)
+        return false;
+
+    kstring steps = NULL;
+    if (compact)
+    {
+        if (tag >= compactDICT_INFIX)
+            steps = tag - compactDICT_INFIX < serial_dictionary_size
+                ? "cc" : NULL;
+        else if (tag >= compactDICT_NAME)
+            steps = tag - compactDICT_NAME < serial_dictionary_size
+                ? "" : NULL;
+        else if (tag >= compactSMALL)
+            steps = "";
+        else switch(tag)
+        {
+        case compactNULL:       steps = "";     break;
+        case compactINTEGER:    steps = "u";    break;
+        case compactREAL:       steps = "r";    break;
+        case compactTEXT:       steps = "t";    break;
+        case compactTEXT_DELIM: steps = "ttt";  break;
+        case compactNAME:       steps = "t";    break;
+        case compactBLOCK:      steps = "tct";  break;
+        case compactPARENS:
+        case compactBRACES:
+        case compactBRACKETS:
+        case compactINDENT:     steps = "c";    break;
+        case compactPREFIX:
+        case compactPOSTFIX:    steps = "cc";   break;
+        case compactINFIX:      steps = "tcc";  break;
+        case compactREFERENCE:  steps = "u";    break;
+        }
+    }
+    else switch(tag)
+    {
+    case serialNULL:            steps = "";     break;
+    case serialINTEGER:         steps = "i";    break;
+    case serialREAL:            steps = "r";    break;
+    case serialTEXT:            steps = "ttt";  break;
+    case serialNAME:            steps = "t";    break;
+    case serialBLOCK:           steps = "tct";  break;
+    case serialPREFIX:
+    case serialPOSTFIX:         steps = "cc";   break;
+    case serialINFIX:           steps = "ctc";  break;
+    case serialREFERENCE:       steps = "u";    break;
+    }
+    if (!steps)
+    {
+        broken = true;
+        return false;
+    }
+
+    // Find where we are relative to the top-level sequence of the code
+    uint role = roleNONE;
+    if (!parent)
+    {
+        uint prefix = compact ? uint(compactPREFIX) : uint(serialPREFIX);
+        if (message && tag == prefix)
+            role = roleMESSAGE;
+    }
+    else if (parent->role == roleMESSAGE)
+    {
+        if (parent->childCount == 1)
+            role = roleCODE;
+    }
+    else if (parent->role == roleCODE && IsBlock(*parent))
+    {
+        role = roleSEQUENCE;
+    }
+    else if (parent->role == roleCODE || parent->role == roleSEQUENCE)
+    {
+        if (parent->childCount == 1 && IsSequence(*parent))
+            role = roleSEQUENCE;
+    }
+
+    stack.push_back(Node(tag, steps, role));
+    return true;
+}
+
+
+void StreamDeserializer::Complete()
+// ----------------------------------------------------------------------------
+//   Build the tree for a node that has all its values, give it to parent
+// ----------------------------------------------------------------------------
+{
+    Node &node = stack.back();
+    Tree_p tree = Build(node);
+    if (tree && !IsSequence(node) &&
+        ((node.role == roleCODE && !IsBlock(node)) ||
+         node.role == roleSEQUENCE))
+        statements.push_back(tree);
+    stack.pop_back();
+
+    if (stack.empty())
+    {
+        result = tree;
+        complete = true;
+        return;
+    }
+
+    Node &parent = stack.back();
+    parent.children[parent.childCount++] = tree;
+    parent.steps++;
+    if (parent.role == roleMESSAGE && parent.childCount == 1)
+        symbols = tree;
+    Emit(parent);
+}
+
+
+void StreamDeserializer::Emit(Node &node)
+// ----------------------------------------------------------------------------
+//   Return the left of a sequence in the code once we have it
+// ----------------------------------------------------------------------------
+{
+    if ((node.role == roleCODE || node.role == roleSEQUENCE) &&
+        !node.emitted && node.childCount && IsSequence(node))
+    {
+        node.emitted = true;
+        if (node.children[0])
+            statements.push_back(node.children[0]);
+    }
+}
+
+
+bool StreamDeserializer::IsBlock(Node &node)
+// ----------------------------------------------------------------------------
+//   Check if a node is a block
+// ----------------------------------------------------------------------------
+{
+    if (compact)
+        return node.tag >= compactBLOCK && node.tag <= compactINDENT;
+    return node.tag == serialBLOCK;
+}
+
+
+bool StreamDeserializer::IsSequence(Node &node)
+// ----------------------------------------------------------------------------
+//   Check if a node is an infix whose name we know to be a separator
+// ----------------------------------------------------------------------------
+{
+    text name;
+    if (compact && node.tag >= compactDICT_INFIX)
+        name = serial_dictionary[node.tag - compactDICT_INFIX];
+    else if (node.tag == (compact ? uint(compactINFIX) : uint(serialINFIX)) &&
+             node.valueCount)
+        name = node.values[0];
+    return name == "\n" || name == ";";
+}
+
+
+Tree *StreamDeserializer::Build(Node &node)
+// ----------------------------------------------------------------------------
+//   Create the tree for a node once all its values were read
+// ----------------------------------------------------------------------------
+{
+    uint     tag = node.tag;
+    text *   values = node.values;
+    Tree_p * children = node.children;
+    bool     reference = false;
+
+    if (compact)
+    {
+        if (tag >= compactDICT_INFIX)
+            return new Infix(serial_dictionary[tag - compactDICT_INFIX],
+                             children[0], children[1], pos);
+        if (tag >= compactDICT_NAME)
+            return new Name(serial_dictionary[tag - compactDICT_NAME], pos);
+        if (tag >= compactSMALL)
+            return new Integer(tag - compactSMALL, pos);
+
+        switch(tag)
+        {
+        case compactINTEGER:
+            return new Integer(serial_unzigzag(node.ivalue), pos);
+        case compactREAL:
+            return new Real(node.rvalue, pos);
+        case compactTEXT:
+            return new Text(values[0], "\"", "\"", pos);
+        case compactTEXT_DELIM:
+            return new Text(values[1], values[0], values[2], pos);
+        case compactNAME:
+            return new Name(values[0], pos);
+        case compactBLOCK:
+            return new Block(children[0], values[0], values[1], pos);
+        case compactPARENS:
+            return new Block(children[0], "(", ")", pos);
+        case compactBRACES:
+            return new Block(children[0], "{", "}", pos);
+        case compactBRACKETS:
+            return new Block(children[0], "[", "]", pos);
+        case compactINDENT:
+            return new Block(children[0], Block::indent, Block::unindent, pos);
+        case compactPREFIX:
+            return new Prefix(children[0], children[1], pos);
+        case compactPOSTFIX:
+            return new Postfix(children[0], children[1], pos);
+        case compactINFIX:
+            return new Infix(values[0], children[0], children[1], pos);
+        case compactREFERENCE:
+            reference = true;
+            break;
+        }
+    }
+    else
+    {
+        switch(tag)
+        {
+        case serialINTEGER:
+            return new Integer(node.ivalue, pos);
+        case serialREAL:
+            return new Real(node.rvalue, pos);
+        case serialTEXT:
+            return new Text(values[1], values[0], values[2], pos);
+        case serialNAME:
+            return new Name(values[0], pos);
+        case serialBLOCK:
+            return new Block(children[0], values[0], values[1], pos);
+        case serialPREFIX:
+            return new Prefix(children[0], children[1], pos);
+        case serialPOSTFIX:
+            return new Postfix(children[0], children[1], pos);
+        case serialINFIX:
+            return new Infix(values[0], children[0], children[1], pos);
+        case serialREFERENCE:
+            reference = true;
+            break;
+        }
+    }
+
+    if (reference)
+    {
+        hash_trees::const_iterator found;
+        if (known && (found = known->find(node.ivalue)) != known->end())
+            return found->second;
+        broken = true;
+    }
+    return NULL;
+}
+
+
+
+// ============================================================================
+//
+//   Comparing the serialization formats
+//
+// ============================================================================
+
+static double serial_clock()
+// ----------------------------------------------------------------------------
+//   Current time in microseconds
+// ----------------------------------------------------------------------------
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+
+void SerializationBenchmark(std::ostream &out, text name, Tree *tree,
+                            uint iterations)
+// ----------------------------------------------------------------------------
+//   Report size and encoding / decoding time for each format
+// ----------------------------------------------------------------------------
+{
+    static kstring formats[] = { "standard", "compact", "compressed" };
+    size_t standard = 0;
+
+    out << "Serialization of " << name << ", " << iterations << " times\n";
+    for (uint f = serialSTANDARD; f <= serialCOMPRESSED; f++)
+    {
+        SerializationFormat format = SerializationFormat(f);
+        text buffer;
+        double start = serial_clock();
+        for (uint i = 0; i < iterations; i++)
+        {
+            buffer.clear();
+            Serializer::Write(buffer, tree, format);
+        }
+        double encoded = serial_clock();
+
+        Tree_p copy;
+        for (uint i = 0; i < iterations; i++)
+        {
+            Deserializer reader((const byte *) buffer.data(), ~size_t(0),
+                                0, buffer.length());
+            copy = reader.ReadTree();
+        }
+        double decoded = serial_clock();
+
+        // Streaming, as if data arrived in small packets
+        const uint packet = 64;
+        Tree_p streamed;
+        for (uint i = 0; i < iterations; i++)
+        {
+            StreamDeserializer reader;
+            const byte *data = (const byte *) buffer.data();
+            for (size_t p = 0; p < buffer.length(); p += packet)
+                reader.Feed(data + p, std::min(size_t(packet),
+                                               buffer.length() - p));
+            reader.Finish();
+            streamed = reader.Result();
+        }
+        double stream = serial_clock();
+
+        if (f == serialSTANDARD)
+            standard = buffer.length();
+        out << "  " << formats[f] << ": "
+            << buffer.length() << " bytes";
+        if (standard)
+            out << " (" << 100 * buffer.length() / standard << "%)";
+        out << ", encode " << (encoded - start) / iterations << "us"
+            << ", decode " << (decoded - encoded) / iterations << "us"
+            << ", stream " << (stream - decoded) / iterations << "us";
+        if (!Tree::Equal(tree, copy) || !Tree::Equal(tree, streamed))
+            out << ", MISMATCH";
+        out << "\n";
+    }
+}
+
 ELIOT_END
 
@@ -43,6 +43,7 @@
 #include "tree.h"
 #include "action.h"
 #include <iostream>
+#include <deque>
 
 
 ELIOT_BEGIN
@@ -58,22 +59,41 @@ enum SerializationTag
     serialBLOCK, serialPREFIX, serialPOSTFIX, serialINFIX,
     serialINVALID,
 
-    serialVERSION = 0x0101,
-    serialMAGIC   = 0x05121968
+    serialREFERENCE,            // Hash of a tree already known to reader
+
+    serialVERSION_BASE  = 0x0101, // Format without references
+    serialVERSION       = 0x0102, // Current format
+    serialVERSION_COMPACT = 0x0200, // Single-byte tags and name dictionary
+    serialMAGIC         = 0x05121968
+};
+
+
+enum SerializationFormat
+// ----------------------------------------------------------------------------
+//   The formats a serializer can write
+// ----------------------------------------------------------------------------
+{
+    serialSTANDARD,             // Readable by all versions
+    serialCOMPACT,              // Compact format, needs a recent reader
+    serialCOMPRESSED            // Compact, compressed if large enough
 };
 
 
 typedef std::map<text, longlong>        text_map;
 typedef std::map<longlong, text>        text_ids;
+typedef std::map<Tree *, ulonglong>     tree_hashes;
+typedef std::map<ulonglong, Tree_p>     hash_trees;
 
 
 struct Serializer : Action
 // ----------------------------------------------------------------------------
-//    Serialize a tree to a stream
+//    Serialize a tree to a stream or to a memory buffer
 // ----------------------------------------------------------------------------
 {
     Serializer(std::ostream &out);
-    ~Serializer() {}
+    Serializer(text &buffer, const tree_hashes *references = NULL,
+               SerializationFormat format = serialSTANDARD);
+    ~Serializer();
 
     // Serialization of the canonical nodes
     Tree *      DoInteger(Integer *what);
@@ -87,14 +107,24 @@ struct Serializer : Action
     Tree *      DoChild(Tree *child);
     Tree *      Do(Tree *what);
 
-    bool        IsValid()       { return out.good(); }
+    bool        IsValid()       { return buffer || out->good(); }
 
     static void Write(std::ostream &out, Tree *tree)
     {
         Serializer s(out);
         tree->Do(s);
     }
-    
+    static void Write(text &buffer, Tree *tree,
+                      SerializationFormat format = serialSTANDARD)
+    {
+        Serializer s(buffer, NULL, format);
+        tree->Do(s);
+        s.Finish();
+    }
+
+    // Complete the compact format, which is written once we have it all
+    void        Finish();
+
 public:
     // Writing data (low level)
     void        WriteSigned(longlong);
@@ -103,9 +133,34 @@ public:
     void        WriteText(text);
     void        WriteChild(Tree *child);
 
+    // Writing data in the compact format
+    void        WriteCompactText(text);
+    void        WriteCompactInfix(Infix *what);
+
 protected:
-    std::ostream &      out;
+    void        Put(byte b)
+    {
+        if (buffer)
+            buffer->push_back(b);
+        else
+            out->put(b);
+    }
+    void        Put(const char *data, size_t size)
+    {
+        if (buffer)
+            buffer->append(data, size);
+        else
+            out->write(data, size);
+    }
+
+protected:
+    std::ostream *      out;
+    text *              buffer;         // Appending to memory if not NULL
+    const tree_hashes * references;     // Subtrees to write as a hash
     text_map            texts;
+    SerializationFormat format;
+    text *              output;         // Final output for compact format
+    text                body;           // Compact format before compression
 };
 
 
@@ -113,13 +168,25 @@ struct Deserializer
 // ----------------------------------------------------------------------------
 //   Reconstruct a tree from its serialized form
 // ----------------------------------------------------------------------------
+//   The memory form reads from 'ring[index & mask]' for index between
+//   'start' and 'end', which lets us parse data straight from a ring buffer.
+//   A flat buffer simply uses a mask with all bits set.
 {
     Deserializer(std::istream &in, TreePosition pos = Tree::NOWHERE);
+    Deserializer(const byte *ring, size_t mask, size_t start, size_t end,
+                 const hash_trees *known = NULL,
+                 TreePosition pos = Tree::NOWHERE);
     ~Deserializer();
 
+protected:
+    // Used by StreamDeserializer, which reads the header later
+    Deserializer(const hash_trees *known, TreePosition pos);
+
+public:
     // Deserialize a tree from the input and return it, or return NULL
     Tree *      ReadTree();
-    bool        IsValid()       { return in.good(); }
+    bool        IsValid()       { return in ? in->good() : !failed; }
+    size_t      Consumed()      { return packed ? packed : index - first; }
 
     static Tree *Read(std::istream &in)
     {
@@ -133,13 +200,118 @@ public:
     ulonglong   ReadUnsigned();
     double      ReadReal();
     text        ReadText();
+    bool        ReadBytes(text &result, size_t length);
+
+    // Reading data in the compact format
+    void        ReadHeader();
+    Tree *      ReadCompactTree();
+    text        ReadCompactText();
 
 protected:
-    std::istream &      in;
+    byte        Get()
+    {
+        if (in)
+            return in->get();
+        if (index == end)
+        {
+            failed = true;
+            return 0;
+        }
+        return ring[index++ & mask];
+    }
+    void        Fail()
+    {
+        if (in)
+            in->setstate(in->failbit);
+        else
+            failed = true;
+    }
+
+protected:
+    std::istream *      in;
+    const byte *        ring;
+    size_t              mask, first, index, end;
+    bool                failed;
+    const hash_trees *  known;          // Trees the writer may refer to
     TreePosition        pos;
     text_ids            texts;
+    bool                compact;        // Reading the compact format
+    size_t              packed;         // Compressed input size, if any
+    text                expanded;       // Decompressed input
 };
 
+
+struct StreamDeserializer : Deserializer
+// ----------------------------------------------------------------------------
+//   Reconstruct a tree from data fed in arbitrary pieces as it arrives
+// ----------------------------------------------------------------------------
+//   Instead of recursing, we keep the nodes being read on a stack, and
+//   each step reads a single value, which we simply retry when more data
+//   arrives. For a message, i.e. code with its symbol table on the left
+//   of a prefix, the statements of the top-level sequence of the code are
+//   returned by Statement() as soon as they are complete.
+{
+    StreamDeserializer(bool message = false, const hash_trees *known = NULL,
+                       TreePosition pos = Tree::NOWHERE);
+    ~StreamDeserializer();
+
+    // Feed data, return false if the input is invalid
+    bool        Feed(const byte *data, size_t size);
+    bool        Feed(const byte *ring, size_t mask, size_t start, size_t end);
+
+    // Call once all the input was fed, return true if we got a tree
+    bool        Finish();
+
+    bool        IsComplete()    { return complete; }
+    Tree *      Result()        { return result; }
+    Tree *      Symbols()       { return symbols; }
+    Tree *      Statement();
+    size_t      Consumed()      { return consumed + (packed ? packed : index); }
+
+protected:
+    struct Node
+    {
+        Node(uint tag, kstring steps, uint role)
+            : tag(tag), steps(steps), role(role), emitted(false),
+              valueCount(0), childCount(0), ivalue(0), rvalue(0.0) {}
+        uint            tag;
+        kstring         steps;          // Values to read, see Advance()
+        uint            role;           // Position relative to the code
+        bool            emitted;        // Left statement already returned
+        text            values[3];
+        uint            valueCount;
+        Tree_p          children[2];
+        uint            childCount;
+        longlong        ivalue;
+        double          rvalue;
+    };
+    enum { roleNONE, roleMESSAGE, roleCODE, roleSEQUENCE };
+
+    bool        Advance();
+    bool        Start(Node *parent);
+    void        Complete();
+    void        Emit(Node &node);
+    Tree *      Build(Node &node);
+    bool        IsBlock(Node &node);
+    bool        IsSequence(Node &node);
+
+protected:
+    bool                header;         // Header was read
+    bool                message;        // Look for statements in messages
+    bool                complete;
+    bool                broken;
+    size_t              consumed;       // Data consumed and discarded
+    text                buffer;         // Data received, not yet consumed
+    std::vector<Node>   stack;
+    std::deque<Tree_p>  statements;
+    Tree_p              result;
+    Tree_p              symbols;
+};
+
+
+void SerializationBenchmark(std::ostream &out, text name, Tree *tree,
+                            uint iterations);
+
 ELIOT_END
 
 #endif // SERIALIZE_H
@@ -19,3 +19,4 @@
 // ****************************************************************************
 
 #include <sys/time.h>
+#include "remote.h"
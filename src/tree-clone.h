@@ -233,7 +233,7 @@ template <CopyMode mode> struct TreeCopyTemplate
     {
         if (Name *nt = dest->AsName())
         {
-            nt->value = what->value;
+            nt->SetValue(what->value);
             nt->tag = ((what->Position()<<Tree::KINDBITS) | nt->Kind());
             return what;
         }
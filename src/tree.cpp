@@ -31,6 +31,11 @@
 #include <sstream>
 #include <cassert>
 #include <iostream>
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 ELIOT_BEGIN
 
@@ -115,6 +120,8 @@ int Tree::Compare(Tree *left, Tree *right, bool recurse)
     {
         Name *ln = (Name *) left;
         Name *rn = (Name *) right;
+        if (ln->Is(rn))
+            return 0;
         return ln->value < rn->value ? -1 : ln->value > rn->value ? 1 : 0;
     }
     case INFIX:
@@ -216,6 +223,160 @@ void Tree::SetPosition(TreePosition pos, bool recurse)
 }
 
 
+
+
+// ============================================================================
+//
+//    Interned names
+//
+// ============================================================================
+//  Names built by the runtime rather than read from source, like the
+//  parameters in builtin shapes, share a single node per spelling, located
+//  at the builtin position. The table does not hold references: when the
+//  garbage collector is about to delete a canonical name, the entry is dropped.
+//  Parsed names keep their own node, since they carry a source position
+//  and per-node information such as lookup caches and compiled code.
+
+struct NameTable : TypeAllocator::Listener
+// ----------------------------------------------------------------------------
+//   Map each spelling to its canonical name
+// ----------------------------------------------------------------------------
+{
+    typedef std::map<text, Name *> names_t;
+
+    NameTable(): names()
+    {
+        pthread_mutex_init(&lock, NULL);
+        Allocator<Name>::Singleton()->AddListener(this);
+    }
+
+    Name *              Intern(const text &value);
+    virtual bool        CanDelete(void *object);
+
+    names_t             names;
+    pthread_mutex_t     lock;
+};
+
+
+Name *NameTable::Intern(const text &value)
+// ----------------------------------------------------------------------------
+//   Return the canonical name for the given spelling, creating it if needed
+// ----------------------------------------------------------------------------
+{
+    pthread_mutex_lock(&lock);
+
+    Name *&entry = names[value];
+    if (!entry)
+    {
+        entry = new Name(value, Tree::BUILTIN);
+        entry->interned = true;
+    }
+    Name *result = entry;
+
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+
+bool NameTable::CanDelete(void *object)
+// ----------------------------------------------------------------------------
+//   Forget canonical names being deleted, unless they were interned again
+// ----------------------------------------------------------------------------
+{
+    Name *name = (Name *) object;
+    if (!name->interned)
+        return true;
+
+    bool result = true;
+    pthread_mutex_lock(&lock);
+
+    if (TypeAllocator::RefCount(name))
+        result = false;
+    else
+        names.erase(name->value);
+
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+
+Name *Name::Interned(const text &value)
+// ----------------------------------------------------------------------------
+//   Return the shared builtin name for the given spelling
+// ----------------------------------------------------------------------------
+{
+    static NameTable *table = new NameTable;
+    return table->Intern(value);
+}
+
+
+
+// ============================================================================
+//
+//    Allocation benchmark
+//
+// ============================================================================
+
+static double alloc_clock()
+// ----------------------------------------------------------------------------
+//   Return the current time in microseconds
+// ----------------------------------------------------------------------------
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+
+static void *alloc_bench_thread(void *arg)
+// ----------------------------------------------------------------------------
+//   Allocate and delete integers in batches, like short-lived values
+// ----------------------------------------------------------------------------
+{
+    const uint batch = 256;
+    uint iterations = *(uint *) arg;
+    Integer *live[batch];
+    for (uint i = 0; i < iterations; i += batch)
+    {
+        for (uint j = 0; j < batch; j++)
+            live[j] = new Integer(i + j);
+        for (uint j = 0; j < batch; j++)
+            delete live[j];
+    }
+    TypeAllocator::FlushThreadCaches();
+    return NULL;
+}
+
+
+void AllocationBenchmark(std::ostream &out, uint iterations)
+// ----------------------------------------------------------------------------
+//   Report the cost of integer allocation with one and several threads
+// ----------------------------------------------------------------------------
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint threads = cpus > 2 ? cpus : 2;
+    uint counts[] = { 1, threads };
+
+    out << "Allocation of integers, " << iterations << " per thread\n";
+    for (uint c = 0; c < 2; c++)
+    {
+        uint count = counts[c];
+        std::vector<pthread_t> workers(count);
+        double start = alloc_clock();
+        for (uint t = 0; t < count; t++)
+            pthread_create(&workers[t], NULL, alloc_bench_thread, &iterations);
+        for (uint t = 0; t < count; t++)
+            pthread_join(workers[t], NULL);
+        double duration = alloc_clock() - start;
+        double total = double(iterations) * count;
+        out << "  " << count << " thread" << (count > 1 ? "s" : "") << ": "
+            << duration / 1000 << "ms, "
+            << 1000 * duration / total << "ns per new/delete, "
+            << total / duration << "M/s\n";
+    }
+}
+
+
 text Block::indent   = "I+";
 text Block::unindent = "I-";
 text Text::textQuote = "\"";
@@ -183,6 +183,78 @@ private:
 
 
 
+// ============================================================================
+//
+//   Payload text - Characters of a Text or Name kept in payload slabs
+//
+// ============================================================================
+
+typedef std::basic_string<char, std::char_traits<char>, PayloadStorage<char> >
+    payload_base;
+
+struct payload_text : payload_base
+// ----------------------------------------------------------------------------
+//   A string whose storage comes from the garbage collector's payload slabs
+// ----------------------------------------------------------------------------
+//   Short values stay inline in the node. Longer ones are in size classes
+//   rather than malloc, and are freed along with the node that owns them.
+{
+    payload_text() {}
+    payload_text(kstring t): payload_base(t) {}
+    payload_text(const text &t): payload_base(t.data(), t.size()) {}
+    payload_text(const payload_base &t): payload_base(t) {}
+    payload_text &operator=(const text &t)
+    {
+        assign(t.data(), t.size());
+        return *this;
+    }
+    operator text() const       { return text(data(), size()); }
+
+    using payload_base::find;
+    size_type find(const text &t, size_type pos = 0) const
+    {
+        return payload_base::find(t.data(), pos, t.size());
+    }
+};
+
+inline bool operator==(const payload_text &p, const text &t)
+{
+    return p.size() == t.size() && p.compare(0, p.size(), t.data()) == 0;
+}
+inline bool operator==(const text &t, const payload_text &p) { return p == t; }
+inline bool operator!=(const payload_text &p, const text &t) { return !(p==t); }
+inline bool operator!=(const text &t, const payload_text &p) { return !(p==t); }
+inline bool operator<(const payload_text &p, const text &t)
+{
+    return p.compare(0, p.size(), t.data(), t.size()) < 0;
+}
+inline bool operator<(const text &t, const payload_text &p)
+{
+    return p.compare(0, p.size(), t.data(), t.size()) > 0;
+}
+inline text operator+(const payload_text &p, const text &t)
+{
+    return text(p.data(), p.size()) + t;
+}
+inline text operator+(const text &t, const payload_text &p)
+{
+    return t + text(p.data(), p.size());
+}
+inline text operator+(const payload_text &p, const payload_text &q)
+{
+    return text(p.data(), p.size()) + q;
+}
+inline text operator+(const payload_text &p, kstring t)
+{
+    return text(p.data(), p.size()) + t;
+}
+inline text operator+(kstring t, const payload_text &p)
+{
+    return t + text(p.data(), p.size());
+}
+
+
+
 // ============================================================================
 //
 //   Leaf nodes (integer, real, name, text)
@@ -242,7 +314,7 @@ struct Text : Tree
     Text(Text *t):
         Tree(TEXT, t),
         value(t->value), opening(t->opening), closing(t->closing) {}
-    value_t             value;
+    payload_text        value;
     text                opening, closing;
     static text         textQuote, charQuote;
     operator value_t()  { return value; }
@@ -269,14 +341,26 @@ struct Name : Tree
     typedef text value_t;
     
     Name(value_t n, TreePosition pos = NOWHERE):
-        Tree(NAME, pos), value(n) {}
+        Tree(NAME, pos), value(n), hash(Hash(n)), interned(false) {}
     Name(Name *n):
-        Tree(NAME, n), value(n->value) {}
+        Tree(NAME, n), value(n->value), hash(n->hash), interned(false) {}
     bool        IsEmpty()       { return value.length() == 0; }
     bool        IsOperator()    { return !IsEmpty() && !isalpha(value[0]); }
     bool        IsName()        { return !IsEmpty() && isalpha(value[0]); }
     bool        IsBoolean()     { return value=="true" || value=="false"; }
-    value_t     value;
+    bool        Is(Name *n)     { return n == this ||
+                                         (n->hash == hash && n->value == value); }
+    static ulong Hash(const text &value);
+    static Name *Interned(const text &value);
+    void        SetValue(const text &v)
+    {
+        ELIOT_ASSERT(!interned && "Canonical names are shared");
+        value = v;
+        hash = Hash(value);
+    }
+    payload_text value;         // Only change it with SetValue
+    ulong       hash;           // Hash of the value, kept in sync with it
+    bool        interned;       // Canonical node in the name table
     operator    value_t()       { return value; }
     GARBAGE_COLLECT(Name);
 };
@@ -602,11 +686,29 @@ retry:
     return NULL;
 }
 
+inline ulong Name::Hash(const text &value)
+// ----------------------------------------------------------------------------
+//   Hash the spelling of a name, computed once when the name is created
+// ----------------------------------------------------------------------------
+//   All characters count, so that long names with a common prefix,
+//   e.g. generated parameter names, do not share a hash
+{
+    ulong h = 0;
+    uint  l = value.length();
+    kstring ptr = value.data();
+    for (uint i = 0; i < l; i++)
+        h = (h * 0x301) ^ *ptr++;
+    return h;
+}
+
+
 extern Name_p   eliot_true;
 extern Name_p   eliot_false;
 extern Name_p   eliot_nil;
 extern Name_p   eliot_self;
 
+void AllocationBenchmark(std::ostream &out, uint iterations);
+
 ELIOT_END
 
 #endif // TREE_H
@@ -0,0 +1,18 @@
+# Send requests with a corrupt and a truncated compressed payload, used
+# by 04-corrupt-frames and 06-streamed-frames. Each gets a DONE frame
+# (kind 3) with no payload. With 'split', each frame arrives in two parts,
+# so that a listener started with -stream decodes it as it arrives
+exec 3<>/dev/tcp/localhost/$1
+printf '\xe9\xb2\xc8\x28' >&3
+for frame in '\x01\x01\x0c\xe8\xb2\xc8\x28\x80\x04\x01\x40\x03\x50\x61\x62' \
+             '\x02\x01\x0c\xe8\xb2\xc8\x28\x80\x04\x01\x40\x10\x41\x42\x43'
+do
+    if [ "$2" == split ]; then
+        printf "${frame:0:32}" >&3
+        sleep 0.3
+        printf "${frame:32}" >&3
+    else
+        printf "$frame" >&3
+    fi
+done
+timeout 2 head -c 6 <&3 | od -An -tu1
@@ -0,0 +1,6 @@
+# Send a request whose reply is a 64MB text, then stop reading, as a
+# stalled peer would, used by 07-stalled-reader. The request was captured
+# from 'ask' with -nocache, and computes the text by doubling it 22 times
+exec 3<>/dev/tcp/localhost/$1
+printf '\xe9\xb2\xc8\x28\x02\x04\x00\x01\x01\xc9\x03\xe8\xb2\xc8\x28\x81\x02\x06\x06\x04\x03\x6e\x69\x6c\x08\x08\x04\x0b\x6d\x6f\x64\x75\x6c\x65\x5f\x70\x61\x74\x68\x02\x2d\x3e\x03\x01\x22\x0e\x2f\x74\x6d\x70\x2f\x62\x69\x67\x2e\x65\x6c\x69\x6f\x74\x7c\x01\x0a\x08\x08\x08\x04\x10\x6d\x6f\x64\x75\x6c\x65\x5f\x64\x69\x72\x65\x63\x74\x6f\x72\x79\x7d\x03\x7c\x05\x2f\x74\x6d\x70\x2f\x7c\x7a\x08\x08\x08\x04\x0b\x6d\x6f\x64\x75\x6c\x65\x5f\x6e\x61\x6d\x65\x7d\x03\x7c\x03\x62\x69\x67\x7c\x7a\x08\x04\x7f\x01\x3b\x04\x7f\x75\x04\x7f\x75\x08\x08\x04\x0b\x6d\x6f\x64\x75\x6c\x65\x5f\x66\x69\x6c\x65\x7d\x03\x7c\x09\x62\x69\x67\x2e\x65\x6c\x69\x6f\x74\x7c\x7a\x08\x04\x7f\x75\x04\x7f\x05\x01\x7b\x08\x08\x04\x01\x58\x02\x3a\x3d\x03\x7c\x10\x30\x31\x32\x33\x34\x35\x36\x37\x38\x39\x61\x62\x63\x64\x65\x66\x7c\x75\x08\x08\x04\x71\x70\x08\x04\x71\x01\x26\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x08\x08\x04\x71\x70\x08\x04\x71\x6e\x04\x71\x75\x04\x71\x01\x7d' >&3
+sleep 15